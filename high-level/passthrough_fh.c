@@ -516,6 +516,26 @@ static int xmp_fallocate(const char *path, int mode,
 }
 #endif
 
+#ifdef HAVE_COPY_FILE_RANGE
+static ssize_t xmp_copy_file_range(const char *path_in,
+				   struct fuse_file_info *fi_in,
+				   off_t offset_in, const char *path_out,
+				   struct fuse_file_info *fi_out,
+				   off_t offset_out, size_t len, int flags)
+{
+	ssize_t res;
+	(void) path_in;
+	(void) path_out;
+
+	res = copy_file_range(fi_in->fh, &offset_in, fi_out->fh, &offset_out,
+			      len, flags);
+	if (res == -1)
+		return -errno;
+
+	return res;
+}
+#endif
+
 #ifdef HAVE_SETXATTR
 /* xattr operations are optional and can safely be left unimplemented */
 static int xmp_setxattr(const char *path, const char *name, const char *value,
@@ -610,6 +630,9 @@ static struct fuse_operations xmp_oper = {
 #ifdef HAVE_POSIX_FALLOCATE
 	.fallocate	= xmp_fallocate,
 #endif
+#ifdef HAVE_COPY_FILE_RANGE
+	.copy_file_range = xmp_copy_file_range,
+#endif
 #ifdef HAVE_SETXATTR
 	.setxattr	= xmp_setxattr,
 	.getxattr	= xmp_getxattr,
@@ -10,13 +10,185 @@
 */
 
 #define _GNU_SOURCE
-#define DEBUG_JC
+
+#ifdef __linux__
+#define HAVE_SPLICE
+#endif
 
 #include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
 #include <assert.h>
+#include <sys/uio.h>
+
+/* bounce buffer for fd to fd copies that cannot be spliced */
+#define FUSE_BUF_BOUNCE_SIZE (1024 * 1024)
+
+/*
+ * Trace points of the copy layer. Nothing is recorded until
+ * fuse_buf_trace_enable(1); after that every my_fuse_buf_copy() call
+ * bumps the counters and leaves one entry in a ring of the most recent
+ * calls, both of which fuse_buf_trace_dump() prints. Ring entries are
+ * written without locking, a dump racing with writers may show a torn
+ * entry.
+ */
+enum fuse_buf_path {
+    FUSE_BUF_PATH_MEMCPY,   /* memory to memory */
+    FUSE_BUF_PATH_WRITE,    /* one memory segment to an fd */
+    FUSE_BUF_PATH_WRITEV,   /* run of memory segments to an fd */
+    FUSE_BUF_PATH_READ,     /* fd to memory */
+    FUSE_BUF_PATH_SPLICE,   /* fd to fd with splice() */
+    FUSE_BUF_PATH_BOUNCE,   /* fd to fd through the bounce buffer */
+    FUSE_BUF_NPATHS
+};
+
+static const char *const fuse_buf_path_names[FUSE_BUF_NPATHS] = {
+    "memcpy", "write", "writev", "read", "splice", "bounce",
+};
+
+#define FUSE_BUF_TRACE_RING 1024
+
+struct fuse_buf_trace_ent {
+    uint64_t seq;
+    uint64_t bytes;
+    uint32_t segments;
+    uint32_t paths;         /* bitmask of enum fuse_buf_path */
+    int32_t err;            /* errno of a failed call, or 0 */
+};
+
+struct fuse_buf_counters {
+    uint64_t calls;
+    uint64_t segments;
+    uint64_t bytes;
+    uint64_t errors;
+    uint64_t path_ops[FUSE_BUF_NPATHS];
+    uint64_t path_bytes[FUSE_BUF_NPATHS];
+};
+
+static struct {
+    int on;
+    uint64_t seq;
+    struct fuse_buf_counters c;
+    struct fuse_buf_trace_ent ring[FUSE_BUF_TRACE_RING];
+} fuse_buf_trace;
+
+/* per-call accumulator, flushed into fuse_buf_trace at the end */
+struct fuse_buf_call {
+    uint64_t segments;
+    uint32_t paths;
+    uint64_t path_ops[FUSE_BUF_NPATHS];
+    uint64_t path_bytes[FUSE_BUF_NPATHS];
+};
+
+#define fuse_buf_count(p, n) __atomic_fetch_add(p, n, __ATOMIC_RELAXED)
+
+static int fuse_buf_trace_enabled(void)
+{
+    return __atomic_load_n(&fuse_buf_trace.on, __ATOMIC_RELAXED);
+}
+
+static void fuse_buf_trace_enable(int on)
+{
+    __atomic_store_n(&fuse_buf_trace.on, on, __ATOMIC_RELAXED);
+}
+
+/* counters are reset while tracing may be running, so field by field */
+static void fuse_buf_trace_reset(void)
+{
+    uint64_t *p = (uint64_t *) &fuse_buf_trace.c;
+    size_t i;
+
+    for (i = 0; i < sizeof(fuse_buf_trace.c) / sizeof(uint64_t); i++)
+        __atomic_store_n(&p[i], 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&fuse_buf_trace.seq, 0, __ATOMIC_RELAXED);
+    memset(fuse_buf_trace.ring, 0, sizeof(fuse_buf_trace.ring));
+}
+
+static void fuse_buf_call_note(struct fuse_buf_call *call,
+                   enum fuse_buf_path path, size_t segments,
+                   ssize_t res)
+{
+    call->segments += segments;
+    call->paths |= 1u << path;
+    call->path_ops[path]++;
+    if (res > 0)
+        call->path_bytes[path] += res;
+}
+
+static void fuse_buf_call_end(const struct fuse_buf_call *call, ssize_t res)
+{
+    struct fuse_buf_counters *c = &fuse_buf_trace.c;
+    struct fuse_buf_trace_ent *e;
+    uint64_t seq;
+    int i;
+
+    fuse_buf_count(&c->calls, 1);
+    fuse_buf_count(&c->segments, call->segments);
+    if (res < 0)
+        fuse_buf_count(&c->errors, 1);
+    else
+        fuse_buf_count(&c->bytes, res);
+    for (i = 0; i < FUSE_BUF_NPATHS; i++) {
+        if (!(call->paths & (1u << i)))
+            continue;
+        fuse_buf_count(&c->path_ops[i], call->path_ops[i]);
+        fuse_buf_count(&c->path_bytes[i], call->path_bytes[i]);
+    }
+
+    seq = fuse_buf_count(&fuse_buf_trace.seq, 1);
+    e = &fuse_buf_trace.ring[seq % FUSE_BUF_TRACE_RING];
+    e->seq = seq + 1;
+    e->bytes = res > 0 ? res : 0;
+    e->segments = call->segments;
+    e->paths = call->paths;
+    e->err = res < 0 ? -res : 0;
+}
+
+/* prints the counters and up to last entries of the ring, oldest first */
+static void fuse_buf_trace_dump(FILE *f, unsigned int last)
+{
+    struct fuse_buf_counters *c = &fuse_buf_trace.c;
+    uint64_t seq = __atomic_load_n(&fuse_buf_trace.seq, __ATOMIC_RELAXED);
+    uint64_t s;
+    int i;
+
+    fprintf(f, "buftrace: %s\n", fuse_buf_trace_enabled() ? "on" : "off");
+    fprintf(f, "calls %" PRIu64 " segments %" PRIu64 " bytes %" PRIu64
+        " errors %" PRIu64 "\n",
+        __atomic_load_n(&c->calls, __ATOMIC_RELAXED),
+        __atomic_load_n(&c->segments, __ATOMIC_RELAXED),
+        __atomic_load_n(&c->bytes, __ATOMIC_RELAXED),
+        __atomic_load_n(&c->errors, __ATOMIC_RELAXED));
+    for (i = 0; i < FUSE_BUF_NPATHS; i++)
+        fprintf(f, "%-7s ops %" PRIu64 " bytes %" PRIu64 "\n",
+            fuse_buf_path_names[i],
+            __atomic_load_n(&c->path_ops[i], __ATOMIC_RELAXED),
+            __atomic_load_n(&c->path_bytes[i], __ATOMIC_RELAXED));
+
+    if (last > FUSE_BUF_TRACE_RING)
+        last = FUSE_BUF_TRACE_RING;
+    for (s = seq > last ? seq - last : 0; s < seq; s++) {
+        const struct fuse_buf_trace_ent *e =
+            &fuse_buf_trace.ring[s % FUSE_BUF_TRACE_RING];
+
+        fprintf(f, "#%" PRIu64 " segs %" PRIu32 " bytes %" PRIu64,
+            e->seq, e->segments, e->bytes);
+        for (i = 0; i < FUSE_BUF_NPATHS; i++) {
+            if (e->paths & (1u << i))
+                fprintf(f, " %s", fuse_buf_path_names[i]);
+        }
+        if (e->err)
+            fprintf(f, " err %s", strerror(e->err));
+        fprintf(f, "\n");
+    }
+}
 
 size_t fuse_buf_size(const struct fuse_bufvec *bufv)
 {
@@ -106,18 +278,33 @@ static ssize_t fuse_buf_read(const struct fuse_buf *dst, size_t dst_off,
     return copied;
 }
 
+/* one lazily allocated buffer per thread, never freed */
+static char *fuse_buf_bounce(void)
+{
+    static __thread char *bounce;
+
+    if (!bounce)
+        bounce = malloc(FUSE_BUF_BOUNCE_SIZE);
+    return bounce;
+}
+
 static ssize_t fuse_buf_fd_to_fd(const struct fuse_buf *dst, size_t dst_off,
                  const struct fuse_buf *src, size_t src_off,
                  size_t len)
 {
-    char buf[4096];
+    char small[4096];
+    char *buf = fuse_buf_bounce();
     struct fuse_buf tmp = {
-        .size = sizeof(buf),
+        .size = FUSE_BUF_BOUNCE_SIZE,
         .flags = 0,
     };
     ssize_t res;
     size_t copied = 0;
 
+    if (!buf) {
+        buf = small;
+        tmp.size = sizeof(small);
+    }
     tmp.mem = buf;
 
     while (len) {
@@ -156,10 +343,12 @@ static ssize_t fuse_buf_fd_to_fd(const struct fuse_buf *dst, size_t dst_off,
     return copied;
 }
 
+/* *path is set to the way the data went, for the trace */
 #ifdef HAVE_SPLICE
 static ssize_t fuse_buf_splice(const struct fuse_buf *dst, size_t dst_off,
                    const struct fuse_buf *src, size_t src_off,
-                   size_t len, enum fuse_buf_copy_flags flags)
+                   size_t len, enum fuse_buf_copy_flags flags,
+                   enum fuse_buf_path *path)
 {
     int splice_flags = 0;
     off_t *srcpos = NULL;
@@ -183,6 +372,7 @@ static ssize_t fuse_buf_splice(const struct fuse_buf *dst, size_t dst_off,
         dstpos = &dstpos_val;
     }
 
+    *path = FUSE_BUF_PATH_SPLICE;
     while (len) {
         res = splice(src->fd, srcpos, dst->fd, dstpos, len,
                  splice_flags);
@@ -194,6 +384,7 @@ static ssize_t fuse_buf_splice(const struct fuse_buf *dst, size_t dst_off,
                 return -errno;
 
             /* Maybe splice is not supported for this combination */
+            *path = FUSE_BUF_PATH_BOUNCE;
             return fuse_buf_fd_to_fd(dst, dst_off, src, src_off,
                          len);
         }
@@ -214,18 +405,22 @@ static ssize_t fuse_buf_splice(const struct fuse_buf *dst, size_t dst_off,
 #else
 static ssize_t fuse_buf_splice(const struct fuse_buf *dst, size_t dst_off,
                    const struct fuse_buf *src, size_t src_off,
-                   size_t len, enum fuse_buf_copy_flags flags)
+                   size_t len, enum fuse_buf_copy_flags flags,
+                   enum fuse_buf_path *path)
 {
     (void) flags;
 
+    *path = FUSE_BUF_PATH_BOUNCE;
     return fuse_buf_fd_to_fd(dst, dst_off, src, src_off, len);
 }
 #endif
 
 
+/* *path is set to the way the data went, for the trace */
 static ssize_t fuse_buf_copy_one(const struct fuse_buf *dst, size_t dst_off,
                  const struct fuse_buf *src, size_t src_off,
-                 size_t len, enum fuse_buf_copy_flags flags)
+                 size_t len, enum fuse_buf_copy_flags flags,
+                 enum fuse_buf_path *path)
 {
     int src_is_fd = src->flags & FUSE_BUF_IS_FD;
     int dst_is_fd = dst->flags & FUSE_BUF_IS_FD;
@@ -241,15 +436,20 @@ static ssize_t fuse_buf_copy_one(const struct fuse_buf *dst, size_t dst_off,
                 memmove(dstmem, srcmem, len);
         }
 
+        *path = FUSE_BUF_PATH_MEMCPY;
         return len;
     } else if (!src_is_fd) {
+        *path = FUSE_BUF_PATH_WRITE;
         return fuse_buf_write(dst, dst_off, src, src_off, len);
     } else if (!dst_is_fd) {
+        *path = FUSE_BUF_PATH_READ;
         return fuse_buf_read(dst, dst_off, src, src_off, len);
     } else if (flags & FUSE_BUF_NO_SPLICE) {
+        *path = FUSE_BUF_PATH_BOUNCE;
         return fuse_buf_fd_to_fd(dst, dst_off, src, src_off, len);
     } else {
-        return fuse_buf_splice(dst, dst_off, src, src_off, len, flags);
+        return fuse_buf_splice(dst, dst_off, src, src_off, len, flags,
+                       path);
     }
 }
 
@@ -277,18 +477,104 @@ static int fuse_bufvec_advance(struct fuse_bufvec *bufv, size_t len)
     return 1;
 }
 
+static void fuse_bufvec_advance_n(struct fuse_bufvec *bufv, size_t len)
+{
+    while (len) {
+        const struct fuse_buf *buf = fuse_bufvec_current(bufv);
+        size_t this_len = min_size(buf->size - bufv->off, len);
+
+        len -= this_len;
+        if (!fuse_bufvec_advance(bufv, this_len))
+            break;
+    }
+}
+
+/*
+ * Writes up to len bytes of consecutive memory segments of srcv, starting
+ * at its current position, to the fd of dst with a single pwritev() (or
+ * writev() for unseekable fds). *wanted and *nsegs are set to the number
+ * of bytes and segments gathered. Does not advance srcv.
+ */
+static ssize_t fuse_buf_writev(const struct fuse_buf *dst, size_t dst_off,
+                   const struct fuse_bufvec *srcv, size_t len,
+                   size_t *wanted, size_t *nsegs)
+{
+    struct iovec iov[64];
+    size_t idx = srcv->idx;
+    size_t off = srcv->off;
+    size_t total = 0;
+    int cnt = 0;
+    ssize_t res;
+    size_t copied = 0;
+
+    while (idx < srcv->count && cnt < 64 && total < len) {
+        const struct fuse_buf *src = &srcv->buf[idx];
+        size_t this_len;
+
+        if (src->flags & FUSE_BUF_IS_FD)
+            break;
+        this_len = min_size(src->size - off, len - total);
+        iov[cnt].iov_base = (char *) src->mem + off;
+        iov[cnt].iov_len = this_len;
+        cnt++;
+        total += this_len;
+        idx++;
+        off = 0;
+    }
+    *wanted = total;
+    *nsegs = cnt;
+
+    while (total) {
+        if (dst->flags & FUSE_BUF_FD_SEEK)
+            res = pwritev(dst->fd, iov, cnt, dst->pos + dst_off + copied);
+        else
+            res = writev(dst->fd, iov, cnt);
+        if (res == -1) {
+            if (!copied)
+                return -errno;
+            break;
+        }
+        if (res == 0)
+            break;
+
+        copied += res;
+        total -= res;
+        if (!total || !(dst->flags & FUSE_BUF_FD_RETRY))
+            break;
+
+        /* drop what was written from the front of iov */
+        while (res >= (ssize_t) iov[0].iov_len) {
+            res -= iov[0].iov_len;
+            memmove(iov, iov + 1, --cnt * sizeof(struct iovec));
+        }
+        iov[0].iov_base = (char *) iov[0].iov_base + res;
+        iov[0].iov_len -= res;
+    }
+
+    return copied;
+}
+
+/*
+ * Like fuse_buf_copy(), but writes a run of memory segments to an fd
+ * with one pwritev() instead of one pwrite() per segment, and splices
+ * (honouring FUSE_BUF_SPLICE_MOVE) when the source is the pipe libfuse
+ * received the request into.
+ */
 ssize_t my_fuse_buf_copy(struct fuse_bufvec *dstv, struct fuse_bufvec *srcv,
               enum fuse_buf_copy_flags flags)
 {
-#ifdef DEBUG_JC
-    FILE *log_fp = fopen("/root/JcFS/log.txt", "a+");
-#endif
-    int count = 0;
+    struct fuse_buf_call call;
+    enum fuse_buf_path path;
+    int trace = fuse_buf_trace_enabled();
     size_t copied = 0;
+    ssize_t ret;
 
     if (dstv == srcv)
         return fuse_buf_size(dstv);
 
+    if (trace)
+        memset(&call, 0, sizeof(call));
+
     for (;;) {
         const struct fuse_buf *src = fuse_bufvec_current(srcv);
         const struct fuse_buf *dst = fuse_bufvec_current(dstv);
@@ -303,21 +589,53 @@ ssize_t my_fuse_buf_copy(struct fuse_bufvec *dstv, struct fuse_bufvec *srcv,
 
         src_len = src->size - srcv->off;
         dst_len = dst->size - dstv->off;
+
+        if ((dst->flags & FUSE_BUF_IS_FD) && !(src->flags & FUSE_BUF_IS_FD)) {
+            size_t nsegs;
+
+            /* one syscall for all memory segments that follow */
+            res = fuse_buf_writev(dst, dstv->off, srcv, dst_len, &len,
+                          &nsegs);
+            if (trace)
+                fuse_buf_call_note(&call, nsegs > 1 ?
+                           FUSE_BUF_PATH_WRITEV :
+                           FUSE_BUF_PATH_WRITE, nsegs, res);
+            if (res < 0) {
+                if (!copied) {
+                    ret = res;
+                    goto out;
+                }
+                break;
+            }
+            copied += res;
+            if (!res)
+                break;
+
+            fuse_bufvec_advance_n(srcv, res);
+            if (!fuse_bufvec_advance(dstv, res) ||
+                fuse_bufvec_current(srcv) == NULL)
+                break;
+
+            if ((size_t) res < len)
+                break;
+            continue;
+        }
+
         len = min_size(src_len, dst_len);
 
-        res = fuse_buf_copy_one(dst, dstv->off, src, srcv->off, len, flags);
+        res = fuse_buf_copy_one(dst, dstv->off, src, srcv->off, len, flags,
+                    &path);
+        if (trace)
+            fuse_buf_call_note(&call, path, 1, res);
         if (res < 0) {
-            if (!copied)
-                return res;
+            if (!copied) {
+                ret = res;
+                goto out;
+            }
             break;
         }
         copied += res;
 
-#ifdef DEBUG_JC
-        count += 1;
-        fprintf(log_fp, "count: %d,  src_len: %zu,  dst_len: %zu, copied: %zu\n", count, src_len, dst_len, copied);
-#endif
-
         if (!fuse_bufvec_advance(srcv, res) ||
             !fuse_bufvec_advance(dstv, res))
             break;
@@ -325,11 +643,9 @@ ssize_t my_fuse_buf_copy(struct fuse_bufvec *dstv, struct fuse_bufvec *srcv,
         if (res < len)
             break;
     }
-#ifdef DEBUG_JC
-    count += 1;
-    fprintf(log_fp, "count: %d,  copied: %zu\n", count, copied);
-    fclose(log_fp);
-#endif
-
-    return copied;
+    ret = copied;
+out:
+    if (trace)
+        fuse_buf_call_end(&call, ret);
+    return ret;
 }
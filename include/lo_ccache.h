@@ -0,0 +1,78 @@
+/*
+ * Cache of decompressed chunks of compressed files (lo_cfile.h).
+ *
+ * A chunk is keyed by the id of its file, its index and its version,
+ * the offset it was stored at in the lower file. A rewritten chunk is
+ * stored at a new offset, so stale entries are never hit and simply
+ * age out.
+ *
+ * The cache is split into shards by key hash, each with its own lock
+ * and byte budget. Each shard is a 2Q cache: chunks enter a FIFO
+ * (a1in) and are only promoted to the LRU (am) if they are missed again
+ * while their key is remembered in a ghost FIFO (a1out). A single
+ * scan through a large file only cycles a1in and does not push out
+ * the chunks that are read over and over.
+ */
+#ifndef LO_CCACHE_H
+#define LO_CCACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+struct lo_ccache_key {
+    uint64_t file;
+    uint64_t chunk;
+    uint64_t version;
+};
+
+struct lo_ccache_ent;
+
+/* lo_ccache_queue.head is the newest entry */
+struct lo_ccache_queue {
+    struct lo_ccache_ent *head;
+    struct lo_ccache_ent *tail;
+    size_t count;
+    size_t bytes;
+};
+
+enum {
+    LO_CQ_IN,       /* seen once, FIFO */
+    LO_CQ_MAIN,     /* seen again, LRU */
+    LO_CQ_GHOST,    /* evicted from LO_CQ_IN, key only */
+    LO_CQ_COUNT,
+};
+
+struct lo_ccache_shard {
+    pthread_mutex_t lock;
+    struct lo_ccache_ent **buckets;
+    size_t mask;
+    size_t cap;         /* bytes of data */
+    struct lo_ccache_queue q[LO_CQ_COUNT];
+};
+
+struct lo_ccache {
+    struct lo_ccache_shard *shards;
+    unsigned int nshards;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+};
+
+/* bytes is the total budget, 0 leaves the cache disabled. Returns 0 or
+   -1 with errno set. */
+int lo_ccache_init(struct lo_ccache *cc, size_t bytes, unsigned int nshards);
+void lo_ccache_destroy(struct lo_ccache *cc);
+
+/* Copies bytes [a, b) of a cached chunk to dst. Returns 0 on a hit, -1
+   on a miss. */
+int lo_ccache_get(struct lo_ccache *cc, const struct lo_ccache_key *k,
+          char *dst, size_t a, size_t b);
+
+/* Adds the len bytes of a chunk, taking over data (from malloc) */
+void lo_ccache_put(struct lo_ccache *cc, const struct lo_ccache_key *k,
+           char *data, size_t len);
+
+void lo_ccache_drop(struct lo_ccache *cc, const struct lo_ccache_key *k);
+
+#endif
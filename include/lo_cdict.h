@@ -0,0 +1,75 @@
+/*
+ * LZ4 dictionaries for compressed files (lo_cfile.h).
+ *
+ * Small files compress badly on their own: LZ4 only finds matches
+ * within the file. A dictionary is a sample of what the files of a
+ * directory have in common, compressed chunks may refer back into it.
+ *
+ * A dictionary is immutable and known by a random id, which the files
+ * compressed with it record in their header. Dictionaries are stored
+ * in LO_CDICT_DIR at the root of the lower file system, one file named
+ * by the id in hex each, a small header and the data:
+ *
+ *   +------------------------+------------------------+
+ *   | struct lo_cdict_hdr    | size bytes of data     |
+ *   +------------------------+------------------------+
+ *
+ * Retraining a directory makes a new dictionary with the next version,
+ * files compressed with the old one keep using it. LO_CDICT_DIR is the
+ * daemon's: only its owner can get at it and the mount hides it.
+ */
+#ifndef LO_CDICT_H
+#define LO_CDICT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "lz4.h"
+
+#define LO_CDICT_MAGIC "JCFSDCT"
+#define LO_CDICT_DIR ".jcfs-dicts"
+/* LZ4 only looks back this far */
+#define LO_CDICT_MAX_SIZE (64 * 1024)
+
+struct lo_cdict_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t size;
+    uint64_t id;
+    uint64_t reserved;
+};
+
+struct lo_cdict {
+    uint64_t id;
+    uint32_t version;
+    size_t size;
+    char *data;
+    /* data loaded, copied for every chunk instead of hashing data
+       again */
+    LZ4_stream_t stream;
+    struct lo_cdict *next;
+};
+
+/* the dictionaries loaded so far, they live until destroy */
+struct lo_cdicts {
+    pthread_mutex_t lock;
+    int rootfd;         /* not owned */
+    int dirfd;          /* LO_CDICT_DIR, -1 until needed */
+    struct lo_cdict *list;
+};
+
+void lo_cdicts_init(struct lo_cdicts *d, int rootfd);
+void lo_cdicts_destroy(struct lo_cdicts *d);
+
+/* Returns the dictionary with this id, loading it if needed, or NULL
+   with errno set. */
+const struct lo_cdict *lo_cdicts_get(struct lo_cdicts *d, uint64_t id);
+
+/* Builds a dictionary of at most size bytes out of n samples, stored
+   one after the other in samples with their lengths in lens, and
+   stores it. Returns it, or NULL with errno set. */
+const struct lo_cdict *lo_cdicts_train(struct lo_cdicts *d,
+                       const char *samples, const size_t *lens,
+                       size_t n, size_t size, uint32_t version);
+
+#endif
@@ -0,0 +1,204 @@
+/*
+ * On-disk format of files in compressed directories.
+ *
+ * The logical file is cut into chunks of 1 << chunk_shift bytes which
+ * are compressed independently with LZ4, so a read only decompresses
+ * the chunks it touches. The lower file is a log: a fixed header,
+ * then chunks appended in the order they were written, then, after a
+ * flush, the chunk index. A rewritten chunk is appended again and the
+ * old copy becomes garbage; the header always points at the last
+ * flushed index, so a crash loses the writes since the last flush but
+ * never the file. All integers are in host byte order.
+ *
+ *   +--------+---------+---------+-----+-------+---------+-----
+ *   | header | chunk 3 | chunk 0 | ... | index | chunk 3 | ...
+ *   +--------+---------+---------+-----+-------+---------+-----
+ *
+ * The last chunk of a file that is appended to stays uncompressed in
+ * memory until it is full or flushed. A flush stores the bytes appended
+ * since the previous one as a segment (struct lo_cfile_seg), an LZ4
+ * block that may refer back into the earlier bytes of the chunk, so
+ * the chunk is not compressed and stored again as a whole every time.
+ * The entry of such a linked chunk points at its newest segment, each
+ * segment points at the one before.
+ *
+ * A small overwrite inside a chunk is appended to the log as is and
+ * recorded as a delta (struct lo_cfile_delta) rather than rewriting the
+ * chunk; reads lay a chunk's deltas over it in order. A chunk is merged,
+ * rewritten with its deltas, when it has collected too many of them and
+ * when a writer closes the file. A flush writes the deltas right after
+ * the index.
+ *
+ * What the index no longer points at is garbage. Compaction stores the
+ * chunks the write path took shortcuts with again (lo_cfile_recompress)
+ * and punches the garbage out of the lower file (lo_cfile_punch), which
+ * keeps its size but not the blocks.
+ */
+#ifndef LO_CFILE_H
+#define LO_CFILE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "lo_ccache.h"
+#include "lo_cdict.h"
+#include "lo_pool.h"
+
+#define LO_CFILE_MAGIC "JCFSLZ4"
+#define LO_CFILE_VERSION 1
+#define LO_CFILE_HDR_SIZE 64
+#define LO_CFILE_MIN_SHIFT 12
+#define LO_CFILE_MAX_SHIFT 22
+/* most chunks a write compresses at once */
+#define LO_CFILE_BATCH 64
+/* most segments of a linked chunk, the next flush starts over */
+#define LO_CFILE_MAX_LINKS 16
+/* most deltas of a chunk before it is merged */
+#define LO_CFILE_MAX_DELTAS 8
+/* chunk locks, see struct lo_cfile */
+#define LO_CFILE_STRIPES 16
+
+struct lo_cfile_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t chunk_shift;
+    uint64_t size;          /* logical size */
+    uint64_t nchunks;       /* entries in the index */
+    uint64_t index_off;     /* 0 until the first flush */
+    uint32_t flags;
+    uint32_t ndeltas;       /* lo_cfile_delta entries after the index */
+    uint64_t id;            /* random, new whenever the file is emptied */
+    uint64_t dict;          /* lo_cdict of LO_CHUNK_DICT chunks, 0: none */
+};
+
+/* lo_cfile_hdr.flags */
+enum {
+    LO_CFILE_RAW = 1 << 0,  /* data did not compress, store chunks as is */
+};
+
+/* lo_cfile_ent.flags */
+enum {
+    LO_CHUNK_LZ4 = 1 << 0,  /* else stored as is */
+    LO_CHUNK_DICT = 1 << 1, /* compressed with the file's dictionary */
+    LO_CHUNK_LINKED = 1 << 2,   /* segments, see above */
+    LO_CHUNK_UNTRIED = 1 << 3,  /* stored as is in a raw file, untried */
+};
+
+struct lo_cfile_ent {
+    uint64_t off;           /* 0: never written, reads as zeros */
+    uint32_t csize;         /* bytes stored */
+    uint32_t ulen;          /* bytes of logical data, the rest is zeros */
+    uint32_t flags;
+    uint32_t linked;        /* bytes of the older segments */
+};
+
+struct lo_cfile_delta {
+    uint64_t off;           /* len bytes of data in the lower file */
+    uint64_t chunk;
+    uint32_t start;         /* offset in the chunk */
+    uint32_t len;
+};
+
+/* the deltas of one chunk, oldest first */
+struct lo_cfile_dlist {
+    uint32_t n;
+    uint32_t bytes;
+    struct lo_cfile_delta d[LO_CFILE_MAX_DELTAS];
+};
+
+/* followed by csize bytes of LZ4 block */
+struct lo_cfile_seg {
+    uint64_t prev;          /* the previous segment, 0: none */
+    uint32_t start;         /* offset in the chunk of its first byte */
+    uint32_t ulen;
+    uint32_t csize;
+    uint32_t n;             /* segments before this one */
+};
+
+/*
+ * lock is held for reading by reads and by writes that only add a
+ * delta, and for writing by everything else. The deltas of chunk i are
+ * also protected by stripes[i % LO_CFILE_STRIPES], which readers of the
+ * chunk hold for reading and delta writers for writing, so that these
+ * only wait for each other when they touch the same chunks.
+ */
+struct lo_cfile {
+    pthread_rwlock_t lock;
+    pthread_rwlock_t stripes[LO_CFILE_STRIPES];
+    unsigned int chunk_shift;
+    uint32_t flags;
+    uint64_t size;
+    uint64_t nchunks;
+    uint64_t cap;
+    struct lo_cfile_ent *index;
+    struct lo_cfile_dlist **deltas;     /* cap of them, NULL: none */
+    uint64_t ndeltas;
+    /* also updated by delta writers, atomically */
+    uint64_t end;           /* the next chunk is appended here */
+    uint64_t stored;        /* bytes of live chunks and deltas */
+    uint64_t garbage;       /* bytes of the lower file nothing points at */
+    uint64_t index_off;     /* the flushed index and delta table */
+    uint64_t index_len;
+    int dirty;              /* index or size not flushed yet */
+    uint64_t id;
+    uint64_t dict_id;
+    unsigned int raw_streak;    /* chunks in a row that did not compress */
+    unsigned int raw_skipped;
+    /* the chunk being appended to, NULL if none */
+    char *tail;
+    uint64_t tail_idx;
+    size_t tail_len;
+    size_t tail_flushed;    /* bytes of it stored in any form */
+    size_t tail_stored;     /* bytes of it in segments */
+    unsigned int tail_links;
+    LZ4_stream_t *tail_stream;
+    /* set by the user, may be NULL */
+    struct lo_ccache *cache;
+    struct lo_pool *pool;       /* compresses the chunks of large writes */
+    const struct lo_cdict *dict;    /* the one of dict_id, see below */
+};
+
+/* Reads the header of the file behind fd. Returns 1 and fills h if it
+   is a compressed file, 0 if not, -errno on error. */
+int lo_cfile_read_hdr(int fd, struct lo_cfile_hdr *h);
+
+/* Formats the empty file fd, returns 0 or -errno. */
+int lo_cfile_init(struct lo_cfile *c, int fd, unsigned int chunk_shift);
+/* Loads the file fd, returns 1, 0 if it is not a compressed file, or
+   -errno. */
+int lo_cfile_load(struct lo_cfile *c, int fd);
+void lo_cfile_destroy(struct lo_cfile *c);
+
+/* Logical I/O. fd is any fd of the lower file, open for writing for
+   the ones that change it. Return bytes or -errno. */
+ssize_t lo_cfile_pread(struct lo_cfile *c, int fd, char *buf, size_t size,
+               off_t off);
+ssize_t lo_cfile_pwrite(struct lo_cfile *c, int fd, const char *buf,
+            size_t size, off_t off);
+
+/* Empties the file (O_TRUNC), or writes the appended tail, index and
+   header, or rewrites all chunks that have deltas. 0 or -errno */
+int lo_cfile_reset(struct lo_cfile *c, int fd);
+int lo_cfile_flush(struct lo_cfile *c, int fd);
+int lo_cfile_merge(struct lo_cfile *c, int fd);
+
+/* Stores chunk *idx, or the first one after it, that has deltas, is
+   linked or was stored untried, again as one chunk compressed in full,
+   and moves *idx past it. Takes the lock for that one chunk only.
+   Returns the bytes read and written, 0 if there was none left, or
+   -errno. */
+ssize_t lo_cfile_recompress(struct lo_cfile *c, int fd, uint64_t *idx);
+/* Flushes and punches the garbage out of the lower file. Returns the
+   bytes freed, or -errno. */
+ssize_t lo_cfile_punch(struct lo_cfile *c, int fd);
+
+/* Compresses the chunks of the file with d from now on. A loaded file
+   has c->dict_id set, the user must set c->dict to that dictionary
+   before reading. Only for a file without chunks, 0 or -EBUSY. */
+int lo_cfile_set_dict(struct lo_cfile *c, const struct lo_cdict *d);
+
+uint64_t lo_cfile_size(struct lo_cfile *c);
+uint64_t lo_cfile_nchunks(struct lo_cfile *c);
+uint64_t lo_cfile_garbage(struct lo_cfile *c);
+
+#endif
@@ -0,0 +1,47 @@
+/*
+ * LRU cache of O_PATH file descriptors for handle based inodes.
+ *
+ * Inodes that are represented by a file handle do not pin a file
+ * descriptor. Instead they store the index of a slot in this cache;
+ * the slot is only valid while slot->ref points back at the inode's
+ * index field. An fd returned by lo_fdcache_get() stays open until
+ * the matching lo_fdcache_put(), after that it may be evicted.
+ */
+#ifndef LO_FDCACHE_H
+#define LO_FDCACHE_H
+
+#include <pthread.h>
+
+struct lo_fdcache_slot {
+    int *ref;       /* owner's slot index, NULL when free */
+    int fd;
+    int refs;       /* number of users currently holding fd */
+    int prev;       /* towards MRU */
+    int next;       /* towards LRU, or next free slot */
+};
+
+struct lo_fdcache {
+    pthread_mutex_t lock;
+    struct lo_fdcache_slot *slots;
+    int nslots;
+    int used;
+    int mru;
+    int lru;
+    int free;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+};
+
+/* reopens the fd of an evicted owner, returns fd or -1 with errno set */
+typedef int (*lo_fdcache_open_t)(void *arg);
+
+int lo_fdcache_init(struct lo_fdcache *c, int nslots);
+void lo_fdcache_destroy(struct lo_fdcache *c);
+int lo_fdcache_get(struct lo_fdcache *c, int *slot,
+           lo_fdcache_open_t open_fn, void *arg);
+void lo_fdcache_put(struct lo_fdcache *c, int *slot, int fd);
+void lo_fdcache_add(struct lo_fdcache *c, int *slot, int fd);
+void lo_fdcache_drop(struct lo_fdcache *c, int *slot);
+
+#endif
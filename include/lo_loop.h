@@ -0,0 +1,32 @@
+/*
+ * Multi-queue session loop for jcFs_ll.
+ *
+ * Runs a fixed number of worker threads, each reading from its own
+ * clone of the /dev/fuse fd into a buffer allocated once at startup,
+ * optionally pinned to one CPU. Replies go out on the channel the
+ * request came in on.
+ */
+#ifndef LO_LOOP_H
+#define LO_LOOP_H
+
+/* the Makefile sets it for all of jcFs_ll */
+#ifndef FUSE_USE_VERSION
+#error "FUSE_USE_VERSION must be defined"
+#endif
+#include <fuse_lowlevel.h>
+
+struct lo_loop_stats {
+    unsigned int threads;
+    unsigned int cloned;    /* workers with a channel of their own */
+    unsigned int pinned;
+};
+
+/* threads == 0 means one per CPU we are allowed to run on */
+int lo_session_loop(struct fuse_session *se, unsigned int threads,
+            int pin, struct lo_loop_stats *stats);
+
+/* channel the calling worker is serving, -1 outside of the loop */
+int lo_loop_channel(void);
+void lo_loop_set_channel(int fd);
+
+#endif
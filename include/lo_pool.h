@@ -0,0 +1,53 @@
+/*
+ * Worker pool for splitting one request into parallel pieces.
+ *
+ * Tasks are embedded in the caller's own structures and grouped; the
+ * submitter waits for its group with lo_pool_wait(), running the
+ * group's queued tasks itself in the meantime, so a request never
+ * idles while the workers are busy with somebody else's pieces. Unlike the pool of
+ * passthrough_pthread.c, idle workers sleep instead of spinning.
+ */
+#ifndef LO_POOL_H
+#define LO_POOL_H
+
+#include <pthread.h>
+
+struct lo_pool_task;
+typedef void (*lo_pool_fn_t)(struct lo_pool_task *t);
+
+struct lo_pool_group {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    unsigned int pending;
+};
+
+struct lo_pool_task {
+    lo_pool_fn_t fn;
+    struct lo_pool_group *group;
+    struct lo_pool_task *next;
+};
+
+struct lo_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct lo_pool_task *head;
+    struct lo_pool_task *tail;
+    pthread_t *threads;
+    unsigned int nthreads;
+    int stop;
+};
+
+/* nthreads == 0 starts one worker per online CPU */
+int lo_pool_init(struct lo_pool *p, unsigned int nthreads);
+void lo_pool_destroy(struct lo_pool *p);
+
+void lo_pool_group_init(struct lo_pool_group *g);
+void lo_pool_group_destroy(struct lo_pool_group *g);
+void lo_pool_submit(struct lo_pool *p, struct lo_pool_group *g,
+            struct lo_pool_task *t, lo_pool_fn_t fn);
+void lo_pool_wait(struct lo_pool *p, struct lo_pool_group *g);
+
+/* index of the calling pool worker, -1 for any other thread */
+int lo_pool_worker(void);
+
+#endif
@@ -0,0 +1,36 @@
+/*
+ * Fixed size object allocator.
+ *
+ * Objects are carved out of large cache line aligned pages, so that
+ * millions of small objects neither pay malloc's per-chunk header nor
+ * end up scattered across the heap. Freed objects are kept on a free
+ * list and reused; pages are only returned by lo_slab_destroy().
+ */
+#ifndef LO_SLAB_H
+#define LO_SLAB_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define LO_SLAB_PAGE_SIZE (256 * 1024)
+#define LO_SLAB_ALIGN 64
+
+struct lo_slab {
+    pthread_mutex_t lock;
+    size_t objsize;
+    size_t per_page;
+    void *free;
+    char **pages;
+    size_t npages;
+    size_t pages_cap;
+    size_t nobjs;   /* objects currently allocated */
+};
+
+int lo_slab_init(struct lo_slab *s, size_t objsize);
+void lo_slab_destroy(struct lo_slab *s);
+void *lo_slab_alloc(struct lo_slab *s);
+void lo_slab_free(struct lo_slab *s, void *obj);
+void lo_slab_free_many(struct lo_slab *s, void **objs, size_t n);
+size_t lo_slab_bytes(struct lo_slab *s);
+
+#endif
@@ -0,0 +1,59 @@
+/*
+ * io_uring backed asynchronous execution for jcFs_ll.
+ *
+ * A handler fills in a struct lo_uring_op (usually embedded at the
+ * start of a larger per-request structure), submits the lower
+ * filesystem call and returns without replying. The completion thread
+ * invokes op->done with the syscall result (negative errno on error)
+ * on the FUSE channel the request was received on.
+ *
+ * Without liburing (HAVE_LIBURING) every submission fails with
+ * -ENOSYS and callers fall back to their synchronous path.
+ */
+#ifndef LO_URING_H
+#define LO_URING_H
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+struct lo_uring_op;
+typedef void (*lo_uring_done_t)(struct lo_uring_op *op, int res);
+
+struct lo_uring_op {
+    lo_uring_done_t done;
+    int chan;
+};
+
+struct lo_uring {
+#ifdef HAVE_LIBURING
+    struct io_uring ring;
+#endif
+    pthread_mutex_t sq_lock;
+    pthread_t thread;
+    int running;
+    unsigned long submitted;
+    unsigned long completed;
+};
+
+int lo_uring_init(struct lo_uring *u, unsigned int entries);
+void lo_uring_destroy(struct lo_uring *u);
+
+/* Queue an operation, op->done runs on completion. Return 0 once it is
+   queued, -errno if it could not be and the caller must answer. */
+int lo_uring_read(struct lo_uring *u, struct lo_uring_op *op, int fd,
+          void *buf, size_t len, off_t off);
+int lo_uring_writev(struct lo_uring *u, struct lo_uring_op *op, int fd,
+            const struct iovec *iov, int count, off_t off);
+int lo_uring_statx(struct lo_uring *u, struct lo_uring_op *op, int dirfd,
+           const char *path, int flags, unsigned int mask,
+           struct statx *stx);
+int lo_uring_openat(struct lo_uring *u, struct lo_uring_op *op, int dirfd,
+            const char *path, int flags, mode_t mode);
+
+#endif
@@ -0,0 +1,307 @@
+/*
+ * Sharded 2Q cache of decompressed chunks, see lo_ccache.h.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lo_ccache.h"
+
+/* a1in may fill 1 / LO_CCACHE_IN_SHARE of a shard before am is evicted */
+#define LO_CCACHE_IN_SHARE 4
+/* smallest chunk, sizes the hash buckets */
+#define LO_CCACHE_MIN_CHUNK 4096
+
+struct lo_ccache_ent {
+    struct lo_ccache_key key;
+    struct lo_ccache_ent *hnext;
+    struct lo_ccache_ent *prev;     /* newer */
+    struct lo_ccache_ent *next;     /* older */
+    int queue;
+    size_t len;
+    char *data;
+};
+
+static uint64_t ccache_hash(const struct lo_ccache_key *k)
+{
+    uint64_t h = k->file ^ (k->chunk * 0x9e3779b97f4a7c15ULL) ^
+        (k->version * 0xc2b2ae3d27d4eb4fULL);
+
+    h ^= h >> 31;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 29;
+    return h;
+}
+
+static int ccache_key_eq(const struct lo_ccache_key *a,
+             const struct lo_ccache_key *b)
+{
+    return a->file == b->file && a->chunk == b->chunk &&
+        a->version == b->version;
+}
+
+int lo_ccache_init(struct lo_ccache *cc, size_t bytes, unsigned int nshards)
+{
+    size_t nbuckets;
+    unsigned int i;
+
+    memset(cc, 0, sizeof(*cc));
+    if (!bytes)
+        return 0;
+    if (!nshards)
+        nshards = 1;
+
+    cc->shards = calloc(nshards, sizeof(struct lo_ccache_shard));
+    if (!cc->shards)
+        return -1;
+    cc->nshards = nshards;
+
+    nbuckets = 64;
+    while (nbuckets < bytes / nshards / LO_CCACHE_MIN_CHUNK)
+        nbuckets *= 2;
+    for (i = 0; i < nshards; i++) {
+        struct lo_ccache_shard *s = &cc->shards[i];
+
+        pthread_mutex_init(&s->lock, NULL);
+        s->cap = bytes / nshards;
+        s->mask = nbuckets - 1;
+        s->buckets = calloc(nbuckets, sizeof(struct lo_ccache_ent *));
+        if (!s->buckets) {
+            cc->nshards = i + 1;
+            lo_ccache_destroy(cc);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void lo_ccache_destroy(struct lo_ccache *cc)
+{
+    unsigned int i;
+    size_t b;
+
+    for (i = 0; i < cc->nshards; i++) {
+        struct lo_ccache_shard *s = &cc->shards[i];
+
+        for (b = 0; s->buckets && b <= s->mask; b++) {
+            struct lo_ccache_ent *e, *next;
+
+            for (e = s->buckets[b]; e; e = next) {
+                next = e->hnext;
+                free(e->data);
+                free(e);
+            }
+        }
+        free(s->buckets);
+        pthread_mutex_destroy(&s->lock);
+    }
+    free(cc->shards);
+    cc->shards = NULL;
+    cc->nshards = 0;
+}
+
+static struct lo_ccache_shard *ccache_shard(struct lo_ccache *cc,
+                        uint64_t hash)
+{
+    return &cc->shards[(hash >> 32) % cc->nshards];
+}
+
+/* the functions below are called with the shard lock held */
+
+static struct lo_ccache_ent *ccache_find(struct lo_ccache_shard *s,
+                     const struct lo_ccache_key *k,
+                     uint64_t hash)
+{
+    struct lo_ccache_ent *e;
+
+    for (e = s->buckets[hash & s->mask]; e; e = e->hnext) {
+        if (ccache_key_eq(&e->key, k))
+            return e;
+    }
+    return NULL;
+}
+
+static void ccache_unhash(struct lo_ccache_shard *s, struct lo_ccache_ent *e)
+{
+    struct lo_ccache_ent **pp = &s->buckets[ccache_hash(&e->key) & s->mask];
+
+    while (*pp != e)
+        pp = &(*pp)->hnext;
+    *pp = e->hnext;
+}
+
+static void ccache_unlink(struct lo_ccache_shard *s, struct lo_ccache_ent *e)
+{
+    struct lo_ccache_queue *q = &s->q[e->queue];
+
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        q->head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        q->tail = e->prev;
+    q->count--;
+    q->bytes -= e->len;
+}
+
+static void ccache_push(struct lo_ccache_shard *s, int queue,
+            struct lo_ccache_ent *e)
+{
+    struct lo_ccache_queue *q = &s->q[queue];
+
+    e->queue = queue;
+    e->prev = NULL;
+    e->next = q->head;
+    if (q->head)
+        q->head->prev = e;
+    else
+        q->tail = e;
+    q->head = e;
+    q->count++;
+    q->bytes += e->len;
+}
+
+static void ccache_remove(struct lo_ccache_shard *s, struct lo_ccache_ent *e)
+{
+    ccache_unhash(s, e);
+    ccache_unlink(s, e);
+    free(e->data);
+    free(e);
+}
+
+/* Makes room for len more bytes: a1in gives up its oldest while it is
+   over its share, remembering the keys in a1out, otherwise the least
+   recently used chunk of am goes. */
+static unsigned long ccache_reclaim(struct lo_ccache_shard *s, size_t len)
+{
+    struct lo_ccache_queue *in = &s->q[LO_CQ_IN];
+    struct lo_ccache_queue *am = &s->q[LO_CQ_MAIN];
+    struct lo_ccache_queue *ghost = &s->q[LO_CQ_GHOST];
+    unsigned long evicted = 0;
+
+    while (in->bytes + am->bytes + len > s->cap && (in->tail || am->tail)) {
+        struct lo_ccache_ent *e;
+
+        if (in->tail && (in->bytes > s->cap / LO_CCACHE_IN_SHARE ||
+                 !am->tail)) {
+            e = in->tail;
+            ccache_unlink(s, e);
+            free(e->data);
+            e->data = NULL;
+            e->len = 0;
+            ccache_push(s, LO_CQ_GHOST, e);
+        } else {
+            ccache_remove(s, am->tail);
+        }
+        evicted++;
+    }
+    /* a1out remembers about as many chunks as are cached */
+    while (ghost->count > in->count + am->count + 16)
+        ccache_remove(s, ghost->tail);
+    return evicted;
+}
+
+int lo_ccache_get(struct lo_ccache *cc, const struct lo_ccache_key *k,
+          char *dst, size_t a, size_t b)
+{
+    uint64_t hash;
+    struct lo_ccache_shard *s;
+    struct lo_ccache_ent *e;
+
+    if (!cc->nshards)
+        return -1;
+    hash = ccache_hash(k);
+    s = ccache_shard(cc, hash);
+
+    pthread_mutex_lock(&s->lock);
+    e = ccache_find(s, k, hash);
+    if (!e || e->queue == LO_CQ_GHOST || b > e->len) {
+        pthread_mutex_unlock(&s->lock);
+        __atomic_fetch_add(&cc->misses, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    /* a1in is a FIFO, a hit there does not change the order */
+    if (e->queue == LO_CQ_MAIN && s->q[LO_CQ_MAIN].head != e) {
+        ccache_unlink(s, e);
+        ccache_push(s, LO_CQ_MAIN, e);
+    }
+    memcpy(dst, e->data + a, b - a);
+    pthread_mutex_unlock(&s->lock);
+    __atomic_fetch_add(&cc->hits, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void lo_ccache_put(struct lo_ccache *cc, const struct lo_ccache_key *k,
+           char *data, size_t len)
+{
+    uint64_t hash;
+    struct lo_ccache_shard *s;
+    struct lo_ccache_ent *e;
+    unsigned long evicted;
+
+    if (!cc->nshards) {
+        free(data);
+        return;
+    }
+    hash = ccache_hash(k);
+    s = ccache_shard(cc, hash);
+    if (len > s->cap / LO_CCACHE_IN_SHARE) {
+        free(data);
+        return;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    e = ccache_find(s, k, hash);
+    if (e && e->queue != LO_CQ_GHOST) {
+        /* another reader was faster */
+        pthread_mutex_unlock(&s->lock);
+        free(data);
+        return;
+    }
+    evicted = ccache_reclaim(s, len);
+    /* reclaim may have dropped the ghost */
+    e = ccache_find(s, k, hash);
+    if (e) {
+        ccache_unlink(s, e);
+        e->data = data;
+        e->len = len;
+        ccache_push(s, LO_CQ_MAIN, e);
+    } else {
+        e = malloc(sizeof(struct lo_ccache_ent));
+        if (!e) {
+            pthread_mutex_unlock(&s->lock);
+            free(data);
+            return;
+        }
+        e->key = *k;
+        e->data = data;
+        e->len = len;
+        e->hnext = s->buckets[hash & s->mask];
+        s->buckets[hash & s->mask] = e;
+        ccache_push(s, LO_CQ_IN, e);
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (evicted)
+        __atomic_fetch_add(&cc->evictions, evicted, __ATOMIC_RELAXED);
+}
+
+void lo_ccache_drop(struct lo_ccache *cc, const struct lo_ccache_key *k)
+{
+    uint64_t hash;
+    struct lo_ccache_shard *s;
+    struct lo_ccache_ent *e;
+
+    if (!cc->nshards)
+        return;
+    hash = ccache_hash(k);
+    s = ccache_shard(cc, hash);
+
+    pthread_mutex_lock(&s->lock);
+    e = ccache_find(s, k, hash);
+    if (e)
+        ccache_remove(s, e);
+    pthread_mutex_unlock(&s->lock);
+}
@@ -0,0 +1,279 @@
+/*
+ * LZ4 dictionaries, see lo_cdict.h.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+#include "lo_cdict.h"
+
+/* a sample joins the dictionary unless it compresses to less than
+   1 / LO_CDICT_COVERED with what is there already */
+#define LO_CDICT_COVERED 2
+
+void lo_cdicts_init(struct lo_cdicts *d, int rootfd)
+{
+    memset(d, 0, sizeof(*d));
+    pthread_mutex_init(&d->lock, NULL);
+    d->rootfd = rootfd;
+    d->dirfd = -1;
+}
+
+void lo_cdicts_destroy(struct lo_cdicts *d)
+{
+    struct lo_cdict *dict, *next;
+
+    for (dict = d->list; dict; dict = next) {
+        next = dict->next;
+        free(dict->data);
+        free(dict);
+    }
+    d->list = NULL;
+    if (d->dirfd != -1)
+        close(d->dirfd);
+    d->dirfd = -1;
+    pthread_mutex_destroy(&d->lock);
+}
+
+/* called with the lock held */
+static int cdicts_dir(struct lo_cdicts *d, int create)
+{
+    if (d->dirfd != -1)
+        return 0;
+    d->dirfd = openat(d->rootfd, LO_CDICT_DIR, O_PATH | O_DIRECTORY);
+    if (d->dirfd == -1 && errno == ENOENT && create) {
+        if (mkdirat(d->rootfd, LO_CDICT_DIR, 0700) == -1 && errno != EEXIST)
+            return -1;
+        d->dirfd = openat(d->rootfd, LO_CDICT_DIR, O_PATH | O_DIRECTORY);
+    }
+    return d->dirfd == -1 ? -1 : 0;
+}
+
+static struct lo_cdict *cdict_new(uint64_t id, uint32_t version, char *data,
+                  size_t size)
+{
+    struct lo_cdict *dict = calloc(1, sizeof(struct lo_cdict));
+
+    if (!dict)
+        return NULL;
+    dict->id = id;
+    dict->version = version;
+    dict->data = data;
+    dict->size = size;
+    LZ4_resetStream(&dict->stream);
+    LZ4_loadDict(&dict->stream, data, size);
+    return dict;
+}
+
+static int cdict_read(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+
+    while (len) {
+        ssize_t res = read(fd, p, len);
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (res == 0) {
+            errno = EUCLEAN;
+            return -1;
+        }
+        p += res;
+        len -= res;
+    }
+    return 0;
+}
+
+static int cdict_write(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len) {
+        ssize_t res = write(fd, p, len);
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += res;
+        len -= res;
+    }
+    return 0;
+}
+
+/* called with the lock held */
+static struct lo_cdict *cdicts_load(struct lo_cdicts *d, uint64_t id)
+{
+    struct lo_cdict_hdr h;
+    struct lo_cdict *dict = NULL;
+    char name[32];
+    char *data = NULL;
+    int fd, saverr;
+
+    if (cdicts_dir(d, 0) == -1)
+        return NULL;
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long) id);
+    fd = openat(d->dirfd, name, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+    if (cdict_read(fd, &h, sizeof(h)) == -1)
+        goto out;
+    if (memcmp(h.magic, LO_CDICT_MAGIC, 8) != 0 || h.id != id ||
+        !h.size || h.size > LO_CDICT_MAX_SIZE) {
+        errno = EUCLEAN;
+        goto out;
+    }
+    data = malloc(h.size);
+    if (!data || cdict_read(fd, data, h.size) == -1)
+        goto out;
+    dict = cdict_new(id, h.version, data, h.size);
+out:
+    saverr = errno;
+    if (!dict)
+        free(data);
+    close(fd);
+    errno = saverr;
+    return dict;
+}
+
+const struct lo_cdict *lo_cdicts_get(struct lo_cdicts *d, uint64_t id)
+{
+    struct lo_cdict *dict;
+
+    pthread_mutex_lock(&d->lock);
+    for (dict = d->list; dict; dict = dict->next) {
+        if (dict->id == id)
+            break;
+    }
+    if (!dict) {
+        dict = cdicts_load(d, id);
+        if (dict) {
+            dict->next = d->list;
+            d->list = dict;
+        }
+    }
+    pthread_mutex_unlock(&d->lock);
+    return dict;
+}
+
+/*
+ * Greedy: each sample is compressed with the dictionary built so far
+ * and joins it if that did not make it LO_CDICT_COVERED times smaller,
+ * so the dictionary fills with what the samples have in common and no
+ * content goes in twice.
+ */
+static size_t cdict_build(char *dict, size_t size, const char *samples,
+              const size_t *lens, size_t n)
+{
+    LZ4_stream_t *stream;
+    char *out = NULL;
+    size_t len = 0, max = 0, i;
+    int csize;
+
+    for (i = 0; i < n; i++) {
+        if (lens[i] > max)
+            max = lens[i];
+    }
+    stream = LZ4_createStream();
+    if (max)
+        out = malloc(LZ4_compressBound(max));
+    if (!stream || !out) {
+        LZ4_freeStream(stream);
+        free(out);
+        return 0;
+    }
+
+    for (i = 0; i < n && len < size; samples += lens[i], i++) {
+        size_t take = lens[i] < size - len ? lens[i] : size - len;
+
+        if (!lens[i])
+            continue;
+        LZ4_resetStream(stream);
+        LZ4_loadDict(stream, dict, len);
+        csize = LZ4_compress_fast_continue(stream, samples, out, lens[i],
+                           LZ4_compressBound(lens[i]), 1);
+        if (csize > 0 && (size_t) csize * LO_CDICT_COVERED <= lens[i])
+            continue;
+        memcpy(dict + len, samples, take);
+        len += take;
+    }
+    LZ4_freeStream(stream);
+    free(out);
+    return len;
+}
+
+static uint64_t cdict_new_id(void)
+{
+    uint64_t id = 0;
+
+    while (!id) {
+        if (getrandom(&id, sizeof(id), 0) != sizeof(id))
+            return 0;
+    }
+    return id;
+}
+
+const struct lo_cdict *lo_cdicts_train(struct lo_cdicts *d,
+                       const char *samples, const size_t *lens,
+                       size_t n, size_t size, uint32_t version)
+{
+    struct lo_cdict_hdr h;
+    struct lo_cdict *dict = NULL;
+    char name[32];
+    char *data;
+    int fd, saverr;
+
+    if (!size || size > LO_CDICT_MAX_SIZE)
+        size = LO_CDICT_MAX_SIZE;
+    data = malloc(size);
+    if (!data)
+        return NULL;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, LO_CDICT_MAGIC, 8);
+    h.version = version;
+    h.size = cdict_build(data, size, samples, lens, n);
+    h.id = cdict_new_id();
+    if (!h.size || !h.id) {
+        free(data);
+        errno = h.id ? EINVAL : EAGAIN;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&d->lock);
+    if (cdicts_dir(d, 1) == -1)
+        goto out;
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long) h.id);
+    fd = openat(d->dirfd, name, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd == -1)
+        goto out;
+    /* files will point at it as soon as it is returned */
+    if (cdict_write(fd, &h, sizeof(h)) == -1 ||
+        cdict_write(fd, data, h.size) == -1 || fsync(fd) == -1) {
+        saverr = errno;
+        close(fd);
+        unlinkat(d->dirfd, name, 0);
+        errno = saverr;
+        goto out;
+    }
+    close(fd);
+    dict = cdict_new(h.id, version, data, h.size);
+    if (dict) {
+        dict->next = d->list;
+        d->list = dict;
+    }
+out:
+    saverr = errno;
+    pthread_mutex_unlock(&d->lock);
+    if (!dict)
+        free(data);
+    errno = saverr;
+    return dict;
+}
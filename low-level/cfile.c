@@ -0,0 +1,1619 @@
+/*
+ * Chunked LZ4 files, see lo_cfile.h.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/random.h>
+#include "lo_cfile.h"
+#include "lz4.h"
+
+/* a chunk is first compressed into this many bytes only ... */
+#define LO_CFILE_PROBE 4096
+/* ... and stored as is unless that saved 1 / LO_CFILE_MIN_SAVING */
+#define LO_CFILE_MIN_SAVING 8
+/* chunks in a row that do not compress before the file is marked raw */
+#define LO_CFILE_RAW_STREAK 8
+/* a raw file still tries one chunk in this many */
+#define LO_CFILE_REPROBE 16
+/* a write of at most 1 / LO_CFILE_DELTA_SHARE of a chunk becomes a
+   delta, as long as the chunk's deltas stay below that much as well */
+#define LO_CFILE_DELTA_SHARE 4
+
+static int pread_full(int fd, void *buf, size_t len, off_t off)
+{
+    char *p = buf;
+
+    while (len) {
+        ssize_t res = pread(fd, p, len, off);
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        if (res == 0)
+            return -EIO;    /* index points past the end */
+        p += res;
+        len -= res;
+        off += res;
+    }
+    return 0;
+}
+
+static int pwrite_full(int fd, const void *buf, size_t len, off_t off)
+{
+    const char *p = buf;
+
+    while (len) {
+        ssize_t res = pwrite(fd, p, len, off);
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        p += res;
+        len -= res;
+        off += res;
+    }
+    return 0;
+}
+
+int lo_cfile_read_hdr(int fd, struct lo_cfile_hdr *h)
+{
+    ssize_t res;
+
+    do {
+        res = pread(fd, h, sizeof(*h), 0);
+    } while (res == -1 && errno == EINTR);
+    if (res == -1)
+        return -errno;
+    if (res != sizeof(*h) || memcmp(h->magic, LO_CFILE_MAGIC, 8) != 0)
+        return 0;
+    if (h->version != LO_CFILE_VERSION ||
+        h->chunk_shift < LO_CFILE_MIN_SHIFT ||
+        h->chunk_shift > LO_CFILE_MAX_SHIFT)
+        return -EUCLEAN;
+    return 1;
+}
+
+/* Cached chunks are keyed by this id, so it must differ from that of
+   any file the cache may have seen, including this one before it was
+   emptied. */
+static uint64_t cfile_new_id(void)
+{
+    static uint64_t seq;
+    struct timespec ts;
+    uint64_t id;
+
+    if (getrandom(&id, sizeof(id), GRND_NONBLOCK) != sizeof(id)) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        id = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+    id ^= __atomic_add_fetch(&seq, 1, __ATOMIC_RELAXED);
+    return id ? id : 1;
+}
+
+static int cfile_write_hdr(struct lo_cfile *c, int fd, uint64_t index_off)
+{
+    struct lo_cfile_hdr h;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, LO_CFILE_MAGIC, 8);
+    h.version = LO_CFILE_VERSION;
+    h.chunk_shift = c->chunk_shift;
+    h.size = c->size;
+    h.nchunks = c->nchunks;
+    h.index_off = index_off;
+    h.flags = c->flags;
+    h.ndeltas = c->ndeltas;
+    h.id = c->id;
+    h.dict = c->dict_id;
+    return pwrite_full(fd, &h, sizeof(h), 0);
+}
+
+static void cfile_setup(struct lo_cfile *c, unsigned int chunk_shift)
+{
+    int i;
+
+    memset(c, 0, sizeof(*c));
+    pthread_rwlock_init(&c->lock, NULL);
+    for (i = 0; i < LO_CFILE_STRIPES; i++)
+        pthread_rwlock_init(&c->stripes[i], NULL);
+    c->chunk_shift = chunk_shift;
+    c->end = LO_CFILE_HDR_SIZE;
+}
+
+int lo_cfile_init(struct lo_cfile *c, int fd, unsigned int chunk_shift)
+{
+    int res;
+
+    if (chunk_shift < LO_CFILE_MIN_SHIFT || chunk_shift > LO_CFILE_MAX_SHIFT)
+        return -EINVAL;
+    cfile_setup(c, chunk_shift);
+    c->id = cfile_new_id();
+    res = cfile_write_hdr(c, fd, 0);
+    if (res)
+        lo_cfile_destroy(c);
+    return res;
+}
+
+/* Rebuilds the delta lists from the table written by a flush. */
+static int cfile_load_deltas(struct lo_cfile *c, int fd, uint64_t off,
+                 uint64_t end, uint32_t n)
+{
+    struct lo_cfile_delta *d;
+    struct lo_cfile_dlist *l;
+    uint32_t i;
+    int res;
+
+    d = malloc(n * sizeof(*d));
+    if (!d)
+        return -ENOMEM;
+    res = pread_full(fd, d, n * sizeof(*d), off);
+    for (i = 0; i < n && !res; i++) {
+        const struct lo_cfile_ent *e =
+            d[i].chunk < c->nchunks ? &c->index[d[i].chunk] : NULL;
+
+        if (!e || !e->off || !d[i].len || d[i].len > e->ulen ||
+            d[i].start > e->ulen - d[i].len || d[i].off < LO_CFILE_HDR_SIZE ||
+            d[i].len > end || d[i].off > end - d[i].len) {
+            res = -EUCLEAN;
+            break;
+        }
+        l = c->deltas[d[i].chunk];
+        if (!l) {
+            l = c->deltas[d[i].chunk] = calloc(1, sizeof(*l));
+            if (!l) {
+                res = -ENOMEM;
+                break;
+            }
+        }
+        if (l->n == LO_CFILE_MAX_DELTAS) {
+            res = -EUCLEAN;
+            break;
+        }
+        l->d[l->n++] = d[i];
+        l->bytes += d[i].len;
+        c->stored += d[i].len;
+        c->ndeltas++;
+    }
+    free(d);
+    return res;
+}
+
+int lo_cfile_load(struct lo_cfile *c, int fd)
+{
+    struct lo_cfile_hdr h;
+    struct stat st;
+    uint64_t i, len, dlen, used;
+    int res;
+
+    res = lo_cfile_read_hdr(fd, &h);
+    if (res <= 0)
+        return res;
+    if (fstat(fd, &st) == -1)
+        return -errno;
+
+    len = h.nchunks * sizeof(struct lo_cfile_ent);
+    dlen = (uint64_t) h.ndeltas * sizeof(struct lo_cfile_delta);
+    if (h.nchunks > (UINT64_MAX >> 5) || (h.nchunks && !h.index_off) ||
+        (h.ndeltas && !h.nchunks) ||
+        h.index_off + len + dlen > (uint64_t) st.st_size)
+        return -EUCLEAN;
+
+    cfile_setup(c, h.chunk_shift);
+    c->flags = h.flags;
+    c->size = h.size;
+    c->dict_id = h.dict;
+    /* written with the next flush */
+    c->id = h.id ? h.id : cfile_new_id();
+    /* appends go after everything, including an unflushed tail */
+    c->end = st.st_size > LO_CFILE_HDR_SIZE ? st.st_size : LO_CFILE_HDR_SIZE;
+    if (h.nchunks) {
+        c->index = malloc(len);
+        c->deltas = calloc(h.nchunks, sizeof(*c->deltas));
+        if (!c->index || !c->deltas) {
+            lo_cfile_destroy(c);
+            return -ENOMEM;
+        }
+        c->nchunks = c->cap = h.nchunks;
+        res = pread_full(fd, c->index, len, h.index_off);
+        if (!res && h.ndeltas)
+            res = cfile_load_deltas(c, fd, h.index_off + len, st.st_size,
+                        h.ndeltas);
+        if (res) {
+            lo_cfile_destroy(c);
+            return res;
+        }
+    }
+    for (i = 0; i < c->nchunks; i++)
+        if (c->index[i].off)
+            c->stored += c->index[i].csize + c->index[i].linked;
+    c->index_off = h.index_off;
+    c->index_len = h.nchunks ? len + dlen : 0;
+    /* whatever else has blocks, holes were punched already */
+    used = (uint64_t) st.st_blocks * 512;
+    if (used > (uint64_t) st.st_size)
+        used = st.st_size;
+    used -= used < LO_CFILE_HDR_SIZE ? used : LO_CFILE_HDR_SIZE;
+    c->garbage = used > c->stored + c->index_len ?
+        used - c->stored - c->index_len : 0;
+    return 1;
+}
+
+static void cfile_tail_free(struct lo_cfile *c)
+{
+    free(c->tail);
+    LZ4_freeStream(c->tail_stream);
+    c->tail = NULL;
+    c->tail_stream = NULL;
+    c->tail_len = c->tail_stored = c->tail_flushed = 0;
+    c->tail_links = 0;
+}
+
+/* Forgets the deltas of chunk idx. Called with the write lock held. */
+static void cfile_drop_deltas(struct lo_cfile *c, uint64_t idx)
+{
+    struct lo_cfile_dlist *l = c->deltas ? c->deltas[idx] : NULL;
+
+    if (!l)
+        return;
+    c->stored -= l->bytes;
+    c->garbage += l->bytes;
+    c->ndeltas -= l->n;
+    free(l);
+    c->deltas[idx] = NULL;
+}
+
+void lo_cfile_destroy(struct lo_cfile *c)
+{
+    uint64_t i;
+
+    cfile_tail_free(c);
+    for (i = 0; i < c->nchunks; i++)
+        cfile_drop_deltas(c, i);
+    free(c->deltas);
+    free(c->index);
+    c->deltas = NULL;
+    c->index = NULL;
+    c->nchunks = c->cap = 0;
+    for (i = 0; i < LO_CFILE_STRIPES; i++)
+        pthread_rwlock_destroy(&c->stripes[i]);
+    pthread_rwlock_destroy(&c->lock);
+}
+
+int lo_cfile_set_dict(struct lo_cfile *c, const struct lo_cdict *d)
+{
+    int res = 0;
+
+    pthread_rwlock_wrlock(&c->lock);
+    if (c->nchunks) {
+        res = -EBUSY;
+    } else {
+        c->dict = d;
+        c->dict_id = d ? d->id : 0;
+        c->dirty = 1;
+    }
+    pthread_rwlock_unlock(&c->lock);
+    return res;
+}
+
+uint64_t lo_cfile_size(struct lo_cfile *c)
+{
+    uint64_t size;
+
+    pthread_rwlock_rdlock(&c->lock);
+    size = c->size;
+    pthread_rwlock_unlock(&c->lock);
+    return size;
+}
+
+uint64_t lo_cfile_nchunks(struct lo_cfile *c)
+{
+    uint64_t nchunks;
+
+    pthread_rwlock_rdlock(&c->lock);
+    nchunks = c->nchunks;
+    pthread_rwlock_unlock(&c->lock);
+    return nchunks;
+}
+
+uint64_t lo_cfile_garbage(struct lo_cfile *c)
+{
+    uint64_t garbage;
+
+    pthread_rwlock_rdlock(&c->lock);
+    garbage = c->garbage;
+    pthread_rwlock_unlock(&c->lock);
+    return garbage;
+}
+
+/*
+ * Reads bytes [a, b) of chunk idx into dst, zero filling past its data.
+ * ubuf is scratch space of one chunk, used when only part of a
+ * compressed chunk is wanted and there is no cache to keep the rest.
+ * Called with lock held.
+ */
+static struct lo_ccache_key *cfile_key(struct lo_cfile *c, uint64_t idx,
+                       const struct lo_cfile_ent *e,
+                       struct lo_ccache_key *k)
+{
+    k->file = c->id;
+    k->chunk = idx;
+    k->version = e->off;
+    return k;
+}
+
+/* Decodes the segments of a linked chunk into out, each with the bytes
+   of the ones before it as prefix. */
+static int cfile_read_linked(int fd, const struct lo_cfile_ent *e, char *out,
+                 size_t chunk)
+{
+    struct lo_cfile_seg segs[LO_CFILE_MAX_LINKS];
+    uint64_t offs[LO_CFILE_MAX_LINKS];
+    uint64_t off = e->off;
+    size_t pos = 0;
+    char *cbuf;
+    int i, n = 0, res = 0;
+
+    /* newest first */
+    while (off) {
+        if (n == LO_CFILE_MAX_LINKS)
+            return -EUCLEAN;
+        res = pread_full(fd, &segs[n], sizeof(segs[n]), off);
+        if (res)
+            return res;
+        offs[n] = off;
+        off = segs[n].prev;
+        n++;
+    }
+    if (segs[n - 1].n != 0 || segs[0].n != (uint32_t) n - 1)
+        return -EUCLEAN;
+
+    cbuf = malloc(LZ4_compressBound(chunk));
+    if (!cbuf)
+        return -ENOMEM;
+    for (i = n - 1; i >= 0 && !res; i--) {
+        const struct lo_cfile_seg *s = &segs[i];
+
+        if (s->start != pos || s->ulen > chunk - pos ||
+            s->csize > (uint32_t) LZ4_compressBound(chunk)) {
+            res = -EUCLEAN;
+            break;
+        }
+        res = pread_full(fd, cbuf, s->csize, offs[i] + sizeof(*s));
+        if (!res && LZ4_decompress_safe_usingDict(cbuf, out + pos, s->csize,
+                              s->ulen, out, pos) !=
+            (int) s->ulen)
+            res = -EUCLEAN;
+        pos += s->ulen;
+    }
+    free(cbuf);
+    if (!res && pos != e->ulen)
+        res = -EUCLEAN;
+    return res;
+}
+
+/* the chunk as stored, without its deltas */
+static int cfile_read_base(struct lo_cfile *c, int fd, uint64_t idx,
+               char *dst, size_t a, size_t b, char **ubuf)
+{
+    const struct lo_cfile_ent *e = idx < c->nchunks ? &c->index[idx] : NULL;
+    size_t chunk = (size_t) 1 << c->chunk_shift;
+    struct lo_ccache_key key;
+    size_t have;
+    char *cbuf = NULL;
+    int res;
+
+    /* appended bytes are not all stored yet */
+    if (c->tail && idx == c->tail_idx) {
+        have = b < c->tail_len ? b : c->tail_len;
+        if (have < a)
+            have = a;
+        memcpy(dst, c->tail + a, have - a);
+        memset(dst + (have - a), 0, b - have);
+        return 0;
+    }
+    if (!e || !e->off || a >= e->ulen) {
+        memset(dst, 0, b - a);
+        return 0;
+    }
+    if (e->ulen > chunk || e->csize > LZ4_compressBound(chunk) +
+        sizeof(struct lo_cfile_seg) ||
+        ((e->flags & LO_CHUNK_DICT) && !c->dict))
+        return -EUCLEAN;
+
+    have = b < e->ulen ? b : e->ulen;
+    if (!(e->flags & (LO_CHUNK_LZ4 | LO_CHUNK_LINKED))) {
+        if (e->csize != e->ulen)
+            return -EUCLEAN;
+        res = pread_full(fd, dst, have - a, e->off + a);
+    } else if (c->cache &&
+           lo_ccache_get(c->cache, cfile_key(c, idx, e, &key), dst, a,
+                 have) == 0) {
+        res = 0;
+    } else {
+        char *out = dst, *keep = NULL;
+        int n;
+
+        res = 0;
+        if (!(e->flags & LO_CHUNK_LINKED)) {
+            cbuf = malloc(e->csize);
+            if (!cbuf)
+                return -ENOMEM;
+            res = pread_full(fd, cbuf, e->csize, e->off);
+        }
+        if (!res && (a != 0 || have != e->ulen)) {
+            if (c->cache) {
+                /* decoded whole for the cache */
+                out = keep = malloc(e->ulen);
+            } else {
+                if (!*ubuf)
+                    *ubuf = malloc(chunk);
+                out = *ubuf;
+            }
+            if (!out)
+                res = -ENOMEM;
+        }
+        if (!res && (e->flags & LO_CHUNK_LINKED)) {
+            res = cfile_read_linked(fd, e, out, chunk);
+        } else if (!res && (e->flags & LO_CHUNK_DICT)) {
+            n = LZ4_decompress_safe_usingDict(cbuf, out, e->csize, e->ulen,
+                              c->dict->data, c->dict->size);
+            if (n != (int) e->ulen)
+                res = -EUCLEAN;
+        } else if (!res && !keep && have < e->ulen) {
+            /* the end of a read, decoding stops soon after have */
+            n = LZ4_decompress_safe_partial(cbuf, out, e->csize, have,
+                            e->ulen);
+            if (n < (int) have)
+                res = -EUCLEAN;
+        } else if (!res) {
+            n = LZ4_decompress_safe(cbuf, out, e->csize, e->ulen);
+            if (n != (int) e->ulen)
+                res = -EUCLEAN;
+        }
+        if (!res && out != dst)
+            memcpy(dst, out + a, have - a);
+        if (!res && c->cache && !keep) {
+            /* decoded in place, the cache gets a copy */
+            keep = malloc(e->ulen);
+            if (keep)
+                memcpy(keep, dst, e->ulen);
+        }
+        if (keep && !res)
+            lo_ccache_put(c->cache, &key, keep, e->ulen);
+        else
+            free(keep);
+        free(cbuf);
+    }
+    if (!res && b > have)
+        memset(dst + (have - a), 0, b - have);
+    return res;
+}
+
+/* Called with the stripe of idx held as well, or the write lock. */
+static int cfile_read_chunk(struct lo_cfile *c, int fd, uint64_t idx,
+                char *dst, size_t a, size_t b, char **ubuf)
+{
+    const struct lo_cfile_dlist *l;
+    uint32_t i;
+    int res;
+
+    res = cfile_read_base(c, fd, idx, dst, a, b, ubuf);
+    l = !res && c->deltas && idx < c->nchunks ? c->deltas[idx] : NULL;
+    for (i = 0; l && i < l->n && !res; i++) {
+        const struct lo_cfile_delta *d = &l->d[i];
+        size_t from = d->start > a ? d->start : a;
+        size_t to = d->start + d->len < b ? d->start + d->len : b;
+
+        if (from < to)
+            res = pread_full(fd, dst + (from - a), to - from,
+                     d->off + (from - d->start));
+    }
+    return res;
+}
+
+/* cfile_read_chunk for readers, which only hold the read lock */
+static int cfile_read_shared(struct lo_cfile *c, int fd, uint64_t idx,
+                 char *dst, size_t a, size_t b, char **ubuf)
+{
+    pthread_rwlock_t *stripe = &c->stripes[idx % LO_CFILE_STRIPES];
+    int res;
+
+    pthread_rwlock_rdlock(stripe);
+    res = cfile_read_chunk(c, fd, idx, dst, a, b, ubuf);
+    pthread_rwlock_unlock(stripe);
+    return res;
+}
+
+struct cfile_rjob {
+    struct lo_pool_task task;   /* first, tasks are cast back */
+    struct lo_cfile *c;
+    int fd;
+    uint64_t idx;
+    char *dst;
+    size_t a, b;
+    char *ubuf;
+    int res;
+};
+
+static void cfile_decompress(struct lo_pool_task *t)
+{
+    struct cfile_rjob *j = (struct cfile_rjob *) t;
+
+    j->res = cfile_read_shared(j->c, j->fd, j->idx, j->dst, j->a, j->b,
+                   &j->ubuf);
+}
+
+/*
+ * Reads the chunks of [pos, end) on the pool, LO_CFILE_BATCH at a time,
+ * each decoded straight into its part of buf. Returns the position of
+ * the first chunk that failed, or end, and its error in *res. Called
+ * with the lock held.
+ */
+static uint64_t cfile_pread_pool(struct lo_cfile *c, int fd, char *buf,
+                 uint64_t pos, uint64_t end, off_t off, int *res)
+{
+    size_t chunk = (size_t) 1 << c->chunk_shift;
+    struct lo_pool_group group;
+    struct cfile_rjob *jobs;
+    int i, n;
+
+    jobs = calloc(LO_CFILE_BATCH, sizeof(struct cfile_rjob));
+    if (!jobs) {
+        *res = -ENOMEM;
+        return pos;
+    }
+    while (pos < end && !*res) {
+        lo_pool_group_init(&group);
+        for (n = 0; n < LO_CFILE_BATCH && pos < end; n++) {
+            struct cfile_rjob *j = &jobs[n];
+            size_t a = pos & (chunk - 1);
+
+            j->c = c;
+            j->fd = fd;
+            j->idx = pos >> c->chunk_shift;
+            j->dst = buf + (pos - off);
+            j->a = a;
+            j->b = end - (pos - a) < chunk ? end - (pos - a) : chunk;
+            lo_pool_submit(c->pool, &group, &j->task, cfile_decompress);
+            pos += j->b - a;
+        }
+        lo_pool_wait(c->pool, &group);
+        lo_pool_group_destroy(&group);
+
+        for (i = 0; i < n; i++) {
+            if (jobs[i].res && !*res) {
+                *res = jobs[i].res;
+                pos = (jobs[i].idx << c->chunk_shift) + jobs[i].a;
+            }
+        }
+    }
+    for (i = 0; i < LO_CFILE_BATCH; i++)
+        free(jobs[i].ubuf);
+    free(jobs);
+    return pos;
+}
+
+ssize_t lo_cfile_pread(struct lo_cfile *c, int fd, char *buf, size_t size,
+               off_t off)
+{
+    size_t chunk = (size_t) 1 << c->chunk_shift;
+    char *ubuf = NULL;
+    uint64_t pos, end;
+    int res = 0;
+
+    if (off < 0)
+        return -EINVAL;
+    pthread_rwlock_rdlock(&c->lock);
+    pos = off;
+    end = pos + size < c->size ? pos + size : c->size;
+    /* chunks are independent, a read of several is decoded in parallel */
+    if (c->pool && end > pos &&
+        ((end - 1) >> c->chunk_shift) > (pos >> c->chunk_shift))
+        pos = cfile_pread_pool(c, fd, buf, pos, end, off, &res);
+    while (pos < end && !res) {
+        uint64_t idx = pos >> c->chunk_shift;
+        size_t a = pos & (chunk - 1);
+        size_t b = end - (pos - a) < chunk ? end - (pos - a) : chunk;
+
+        res = cfile_read_shared(c, fd, idx, buf + (pos - off), a, b, &ubuf);
+        if (res)
+            break;
+        pos += b - a;
+    }
+    pthread_rwlock_unlock(&c->lock);
+    free(ubuf);
+
+    if (res && pos == (uint64_t) off)
+        return res;
+    return pos > (uint64_t) off ? (ssize_t) (pos - off) : 0;
+}
+
+/* called with the write lock held */
+static int cfile_grow(struct lo_cfile *c, uint64_t idx)
+{
+    struct lo_cfile_dlist **deltas;
+    struct lo_cfile_ent *index;
+    uint64_t cap;
+
+    if (idx < c->cap)
+        goto out;
+    cap = c->cap ? c->cap : 16;
+    while (cap <= idx)
+        cap *= 2;
+    deltas = realloc(c->deltas, cap * sizeof(*deltas));
+    if (!deltas)
+        return -ENOMEM;
+    memset(deltas + c->cap, 0, (cap - c->cap) * sizeof(*deltas));
+    c->deltas = deltas;
+    index = realloc(c->index, cap * sizeof(*index));
+    if (!index)
+        return -ENOMEM;
+    c->index = index;
+    c->cap = cap;
+out:
+    /* entries past nchunks may be left over from before a reset */
+    if (idx >= c->nchunks) {
+        memset(c->index + c->nchunks, 0,
+               (idx + 1 - c->nchunks) * sizeof(*c->index));
+        c->nchunks = idx + 1;
+    }
+    return 0;
+}
+
+/* LZ4 hash table of the calling thread, reused by every chunk it
+   compresses instead of being set up on the stack each time */
+static pthread_key_t cfile_state_key;
+static pthread_once_t cfile_state_once = PTHREAD_ONCE_INIT;
+
+static void cfile_state_key_init(void)
+{
+    pthread_key_create(&cfile_state_key, free);
+}
+
+static void *cfile_lz4_state(void)
+{
+    void *state;
+
+    pthread_once(&cfile_state_once, cfile_state_key_init);
+    state = pthread_getspecific(cfile_state_key);
+    if (!state) {
+        state = malloc(LZ4_sizeofState());
+        if (state && pthread_setspecific(cfile_state_key, state) != 0) {
+            free(state);
+            state = NULL;
+        }
+    }
+    return state;
+}
+
+/* One chunk of a write, compressed on the pool. out has room for ulen
+   bytes, data LZ4 cannot shrink below that is stored as is. */
+struct cfile_job {
+    struct lo_pool_task task;   /* first, tasks are cast back */
+    uint64_t idx;
+    const char *data;
+    size_t ulen;
+    char *out;
+    int skip;                   /* file is raw, store as is */
+    const struct lo_cdict *dict;
+    int csize;                  /* 0: store data as is */
+    int dict_used;
+};
+
+/*
+ * Already compressed data (images, archives, encrypted files) does not
+ * shrink, so a chunk is first compressed only until LO_CFILE_PROBE
+ * bytes come out. If that consumed little more input, the chunk is
+ * stored as is at the cost of a few KiB of compression, if it
+ * consumed the whole chunk, that is the result.
+ */
+static void cfile_compress(struct lo_pool_task *t)
+{
+    struct cfile_job *j = (struct cfile_job *) t;
+    int cap = j->ulen - j->ulen / LO_CFILE_MIN_SAVING;
+    void *state;
+    int csize, taken;
+
+    j->csize = 0;
+    j->dict_used = 0;
+    if (j->skip)
+        return;
+    if (j->ulen > 2 * LO_CFILE_PROBE) {
+        taken = j->ulen;
+        csize = LZ4_compress_destSize(j->data, j->out, &taken,
+                          LO_CFILE_PROBE);
+        if (csize <= 0 || csize > taken - taken / LO_CFILE_MIN_SAVING)
+            return;
+        if ((size_t) taken == j->ulen) {
+            j->csize = csize;
+            return;
+        }
+    }
+
+    state = cfile_lz4_state();
+    if (state && j->dict) {
+        /* the stream has the dictionary hashed already */
+        memcpy(state, &j->dict->stream, sizeof(LZ4_stream_t));
+        csize = LZ4_compress_fast_continue(state, j->data, j->out, j->ulen,
+                           cap, 1);
+        j->dict_used = 1;
+    } else if (state)
+        csize = LZ4_compress_fast_extState(state, j->data, j->out, j->ulen,
+                           cap, 1);
+    else
+        csize = LZ4_compress_fast(j->data, j->out, j->ulen, cap, 1);
+    j->csize = csize > 0 ? csize : 0;
+}
+
+/* Remembers whether the data of the file compresses. Called with the
+   write lock held. */
+static void cfile_learn(struct lo_cfile *c, const struct cfile_job *j)
+{
+    if (j->skip)
+        return;
+    if (j->csize) {
+        c->raw_streak = 0;
+        if (c->flags & LO_CFILE_RAW) {
+            c->flags &= ~LO_CFILE_RAW;
+            c->dirty = 1;
+        }
+    } else if (++c->raw_streak >= LO_CFILE_RAW_STREAK &&
+           !(c->flags & LO_CFILE_RAW)) {
+        c->flags |= LO_CFILE_RAW;
+        c->dirty = 1;
+    }
+}
+
+static int pwritev_full(int fd, struct iovec *iov, int n, off_t off)
+{
+    while (n) {
+        ssize_t res = pwritev(fd, iov, n, off);
+
+        if (res == -1) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        off += res;
+        while (n && (size_t) res >= iov->iov_len) {
+            res -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n) {
+            iov->iov_base = (char *) iov->iov_base + res;
+            iov->iov_len -= res;
+        }
+    }
+    return 0;
+}
+
+/* Forgets the stored copy of a chunk that is about to be replaced.
+   Called with the write lock held. */
+static void cfile_drop_chunk(struct lo_cfile *c, uint64_t idx,
+                 struct lo_cfile_ent *e)
+{
+    struct lo_ccache_key key;
+
+    cfile_drop_deltas(c, idx);
+    if (!e->off)
+        return;
+    c->stored -= e->csize + e->linked;
+    c->garbage += e->csize + e->linked;
+    if (c->cache && (e->flags & (LO_CHUNK_LZ4 | LO_CHUNK_LINKED)))
+        lo_ccache_drop(c->cache, cfile_key(c, idx, e, &key));
+}
+
+/* Points the index at a chunk just written. Called with the write
+   lock held. */
+static void cfile_set_chunk(struct lo_cfile *c, uint64_t idx, uint64_t off,
+                size_t csize, const struct cfile_job *j)
+{
+    struct lo_cfile_ent *e = &c->index[idx];
+    struct lo_ccache_key key;
+    char *copy;
+
+    cfile_drop_chunk(c, idx, e);
+    e->off = off;
+    e->csize = csize;
+    e->linked = 0;
+    e->ulen = j->ulen;
+    e->flags = j->csize ? LO_CHUNK_LZ4 : j->skip ? LO_CHUNK_UNTRIED : 0;
+    if (j->csize && j->dict_used)
+        e->flags |= LO_CHUNK_DICT;
+    c->stored += csize;
+    c->dirty = 1;
+
+    /* the short tail chunk is the one the next write reads back */
+    if (c->cache && j->csize && j->ulen < ((size_t) 1 << c->chunk_shift)) {
+        copy = malloc(j->ulen);
+        if (copy) {
+            memcpy(copy, j->data, j->ulen);
+            lo_ccache_put(c->cache, cfile_key(c, idx, e, &key), copy,
+                      j->ulen);
+        }
+    }
+}
+
+static int cfile_write_batch(struct lo_cfile *c, int fd,
+                 struct cfile_job *jobs, int n);
+
+/*
+ * Compresses a batch of chunks, on the pool if there is more than one,
+ * and appends them. Called with the write lock held.
+ */
+static int cfile_store_batch(struct lo_cfile *c, int fd,
+                 struct cfile_job *jobs, int n)
+{
+    struct lo_pool_group group;
+    int i, first, res;
+
+    res = cfile_grow(c, jobs[n - 1].idx);
+    if (res)
+        return res;
+
+    for (i = 0; i < n; i++)
+        jobs[i].dict = c->dict;
+    /* a raw file tries one chunk in LO_CFILE_REPROBE until one compresses */
+    for (first = 0; first < n && (c->flags & LO_CFILE_RAW); first++) {
+        jobs[first].skip = ++c->raw_skipped % LO_CFILE_REPROBE != 0;
+        cfile_compress(&jobs[first].task);
+        cfile_learn(c, &jobs[first]);
+    }
+    for (i = first; i < n; i++)
+        jobs[i].skip = 0;
+    if (n - first > 1 && c->pool) {
+        lo_pool_group_init(&group);
+        for (i = first; i < n; i++)
+            lo_pool_submit(c->pool, &group, &jobs[i].task, cfile_compress);
+        lo_pool_wait(c->pool, &group);
+        lo_pool_group_destroy(&group);
+    } else {
+        for (i = first; i < n; i++)
+            cfile_compress(&jobs[i].task);
+    }
+    for (i = first; i < n; i++)
+        cfile_learn(c, &jobs[i]);
+    return cfile_write_batch(c, fd, jobs, n);
+}
+
+/* Appends the compressed chunks of a batch with a single pwritev in
+   index order. Called with the write lock held. */
+static int cfile_write_batch(struct lo_cfile *c, int fd,
+                 struct cfile_job *jobs, int n)
+{
+    struct iovec iov[LO_CFILE_BATCH];
+    uint64_t off = c->end;
+    int i, res;
+
+    for (i = 0; i < n; i++) {
+        iov[i].iov_base = jobs[i].csize ? jobs[i].out : (char *) jobs[i].data;
+        iov[i].iov_len = jobs[i].csize ? (size_t) jobs[i].csize : jobs[i].ulen;
+    }
+    res = pwritev_full(fd, iov, n, off);
+    if (res)
+        return res;
+
+    for (i = 0; i < n; i++) {
+        size_t csize = jobs[i].csize ? (size_t) jobs[i].csize : jobs[i].ulen;
+
+        cfile_set_chunk(c, jobs[i].idx, off, csize, &jobs[i]);
+        off += csize;
+    }
+    c->end = off;
+    return 0;
+}
+
+/* Starts appending to chunk idx, whose first a bytes are data. A linked
+   chunk goes on with its segments, unless it has deltas the segments do
+   not have. Called with the write lock held. */
+static int cfile_tail_open(struct lo_cfile *c, int fd, uint64_t idx, size_t a)
+{
+    const struct lo_cfile_ent *e = idx < c->nchunks ? &c->index[idx] : NULL;
+    size_t chunk = (size_t) 1 << c->chunk_shift;
+    int linked = a && e && (e->flags & LO_CHUNK_LINKED) && e->ulen == a &&
+        !c->deltas[idx];
+    struct lo_cfile_seg seg;
+    char *tail, *spare = NULL;
+    int res = 0;
+
+    tail = malloc(chunk);
+    if (!tail)
+        return -ENOMEM;
+    if (a)
+        res = cfile_read_chunk(c, fd, idx, tail, 0, a, &spare);
+    free(spare);
+    if (!res && linked)
+        res = pread_full(fd, &seg, sizeof(seg), e->off);
+    if (!res) {
+        c->tail_stream = LZ4_createStream();
+        if (!c->tail_stream)
+            res = -ENOMEM;
+    }
+    if (res) {
+        free(tail);
+        return res;
+    }
+    c->tail = tail;
+    c->tail_idx = idx;
+    c->tail_len = c->tail_flushed = a;
+    if (linked) {
+        /* the next segment may refer back into the stored ones */
+        LZ4_loadDict(c->tail_stream, c->tail, a);
+        c->tail_stored = a;
+        c->tail_links = seg.n + 1;
+    }
+    return 0;
+}
+
+/*
+ * Stores the bytes appended to the tail chunk since the last flush as
+ * its next segment. The first flush stores a plain chunk, most files
+ * are written once, and so does the one that fills the chunk. Called
+ * with the write lock held.
+ */
+static int cfile_tail_store(struct lo_cfile *c, int fd)
+{
+    size_t chunk = (size_t) 1 << c->chunk_shift;
+    struct lo_cfile_seg seg;
+    struct lo_cfile_ent *e;
+    struct iovec iov[2];
+    struct cfile_job j;
+    size_t from, len, bound;
+    char *out;
+    int csize, res;
+
+    if (!c->tail || c->tail_flushed == c->tail_len)
+        return 0;
+    if (c->tail_len == chunk || (!c->tail_flushed && !c->tail_stored)) {
+        memset(&j, 0, sizeof(j));
+        j.idx = c->tail_idx;
+        j.data = c->tail;
+        j.ulen = c->tail_len;
+        j.out = malloc(chunk);
+        if (!j.out)
+            return -ENOMEM;
+        res = cfile_store_batch(c, fd, &j, 1);
+        free(j.out);
+        if (!res)
+            c->tail_flushed = c->tail_len;
+        return res;
+    }
+
+    res = cfile_grow(c, c->tail_idx);
+    if (res)
+        return res;
+    if (!c->tail_stored || c->tail_links == LO_CFILE_MAX_LINKS) {
+        /* start over with a single segment */
+        LZ4_resetStream(c->tail_stream);
+        c->tail_stored = 0;
+        c->tail_links = 0;
+    }
+    from = c->tail_stored;
+    len = c->tail_len - from;
+    bound = LZ4_compressBound(len);
+    out = malloc(bound);
+    if (!out)
+        return -ENOMEM;
+    csize = LZ4_compress_fast_continue(c->tail_stream, c->tail + from, out,
+                       len, bound, 1);
+
+    e = &c->index[c->tail_idx];
+    memset(&seg, 0, sizeof(seg));
+    seg.prev = c->tail_links ? e->off : 0;
+    seg.start = from;
+    seg.ulen = len;
+    seg.csize = csize;
+    seg.n = c->tail_links;
+    iov[0].iov_base = &seg;
+    iov[0].iov_len = sizeof(seg);
+    iov[1].iov_base = out;
+    iov[1].iov_len = csize;
+    res = csize > 0 ? pwritev_full(fd, iov, 2, c->end) : -EIO;
+    free(out);
+    if (res) {
+        /* the stream has seen the bytes, the next try starts over */
+        c->tail_stored = 0;
+        return res;
+    }
+
+    cfile_drop_chunk(c, c->tail_idx, e);
+    e->linked = c->tail_links ? e->csize + e->linked : 0;
+    /* the older segments stay */
+    c->garbage -= e->linked;
+    e->off = c->end;
+    e->csize = sizeof(seg) + csize;
+    e->ulen = c->tail_len;
+    e->flags = LO_CHUNK_LINKED;
+    c->stored += e->csize + e->linked;
+    c->end += e->csize;
+    c->tail_stored = c->tail_flushed = c->tail_len;
+    c->tail_links++;
+    c->dirty = 1;
+    return 0;
+}
+
+/* Stores what is left of the tail chunk and stops appending to it */
+static int cfile_tail_close(struct lo_cfile *c, int fd)
+{
+    int res = cfile_tail_store(c, fd);
+
+    if (!res)
+        cfile_tail_free(c);
+    return res;
+}
+
+/* Appends len bytes at the logical end, up to the end of its chunk. A
+   chunk is only compressed as a whole once it is full. Called with the
+   write lock held. */
+static int cfile_append(struct lo_cfile *c, int fd, const char *buf,
+            size_t len)
+{
+    size_t chunk = (size_t) 1 << c->chunk_shift;
+    size_t a = c->size & (chunk - 1);
+    int res;
+
+    if (!c->tail) {
+        res = cfile_tail_open(c, fd, c->size >> c->chunk_shift, a);
+        if (res)
+            return res;
+    }
+    memcpy(c->tail + a, buf, len);
+    c->tail_len = a + len;
+    c->size += len;
+    c->dirty = 1;
+    if (c->tail_len == chunk)
+        return cfile_tail_close(c, fd);
+    return 0;
+}
+
+/*
+ * Appends a small write inside a stored chunk to the log as a delta of
+ * the chunk. Only the read lock and the stripe of the chunk are taken,
+ * so such writes to different chunks and reads of other chunks go on
+ * at the same time. Returns -EAGAIN for a write that must rewrite the
+ * chunk instead, which also merges the deltas it has so far.
+ */
+static int cfile_write_delta(struct lo_cfile *c, int fd, const char *buf,
+                 size_t size, uint64_t off)
+{
+    size_t chunk = (size_t) 1 << c->chunk_shift;
+    size_t max = chunk / LO_CFILE_DELTA_SHARE;
+    uint64_t idx = off >> c->chunk_shift;
+    size_t a = off & (chunk - 1);
+    pthread_rwlock_t *stripe = &c->stripes[idx % LO_CFILE_STRIPES];
+    const struct lo_cfile_ent *e;
+    struct lo_cfile_dlist *l;
+    struct lo_cfile_delta *d;
+    uint64_t at;
+    int res = -EAGAIN;
+
+    if (size > max || a + size > chunk)
+        return -EAGAIN;
+    pthread_rwlock_rdlock(&c->lock);
+    e = idx < c->nchunks ? &c->index[idx] : NULL;
+    if (!e || !e->off || a + size > e->ulen ||
+        (c->tail && idx == c->tail_idx))
+        goto out;
+    pthread_rwlock_wrlock(stripe);
+    l = c->deltas[idx];
+    if (l && (l->n == LO_CFILE_MAX_DELTAS || l->bytes + size > max))
+        goto unlock;
+    if (!l) {
+        l = calloc(1, sizeof(*l));
+        if (!l) {
+            res = -ENOMEM;
+            goto unlock;
+        }
+    }
+    at = __atomic_fetch_add(&c->end, size, __ATOMIC_RELAXED);
+    res = pwrite_full(fd, buf, size, at);
+    if (res) {
+        if (!c->deltas[idx])
+            free(l);
+        goto unlock;
+    }
+    d = &l->d[l->n++];
+    d->off = at;
+    d->chunk = idx;
+    d->start = a;
+    d->len = size;
+    l->bytes += size;
+    c->deltas[idx] = l;
+    __atomic_add_fetch(&c->stored, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->ndeltas, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->dirty, 1, __ATOMIC_RELAXED);
+unlock:
+    pthread_rwlock_unlock(stripe);
+out:
+    pthread_rwlock_unlock(&c->lock);
+    return res;
+}
+
+/*
+ * Chunks the write covers to their end are compressed straight from
+ * buf. Only the first and the last chunk can be partial; they are
+ * assembled from the old data in edge buffers of their own. A write at
+ * the logical end is an append: the partial chunks at its ends go to
+ * the tail chunk instead.
+ */
+ssize_t lo_cfile_pwrite(struct lo_cfile *c, int fd, const char *buf,
+            size_t size, off_t off)
+{
+    size_t chunk = (size_t) 1 << c->chunk_shift;
+    struct cfile_job *jobs;
+    char *out, *edge[2] = { NULL, NULL }, *spare = NULL;
+    uint64_t pos, end, stop, span;
+    size_t len;
+    int n, res = 0;
+
+    if (off < 0)
+        return -EINVAL;
+    if (!size)
+        return 0;
+    res = cfile_write_delta(c, fd, buf, size, off);
+    if (res != -EAGAIN)
+        return res ? res : (ssize_t) size;
+    res = 0;
+    span = ((off + size - 1) >> c->chunk_shift) - (off >> c->chunk_shift) + 1;
+    if (span > LO_CFILE_BATCH)
+        span = LO_CFILE_BATCH;
+    jobs = calloc(span, sizeof(struct cfile_job));
+    out = malloc(span * chunk);
+    if (!jobs || !out) {
+        free(jobs);
+        free(out);
+        return -ENOMEM;
+    }
+
+    pthread_rwlock_wrlock(&c->lock);
+    pos = off;
+    end = pos + size;
+    stop = end;
+    if (c->tail && pos != c->size)
+        res = cfile_tail_close(c, fd);
+    if (!res && pos == c->size) {
+        len = chunk - (pos & (chunk - 1));
+        if (pos & (chunk - 1)) {
+            if (len > size)
+                len = size;
+            res = cfile_append(c, fd, buf, len);
+            if (!res)
+                pos += len;
+        }
+        stop = end & ~((uint64_t) chunk - 1);
+        if (stop < pos)
+            stop = pos;
+    }
+    while (pos < stop && !res) {
+        uint64_t done = pos;
+
+        for (n = 0; done < stop && n < LO_CFILE_BATCH; n++) {
+            uint64_t idx = done >> c->chunk_shift;
+            size_t a = done & (chunk - 1);
+            size_t b = stop - (done - a) < chunk ? stop - (done - a) : chunk;
+            struct lo_cfile_ent *e = idx < c->nchunks ? &c->index[idx] : NULL;
+            struct cfile_job *j = &jobs[n];
+            char **ubuf;
+
+            if (e && !e->off)
+                e = NULL;
+            j->idx = idx;
+            j->out = out + n * chunk;
+            j->ulen = b;
+            if (e && e->ulen > b)
+                j->ulen = e->ulen;
+
+            if (a == 0 && j->ulen == b) {
+                j->data = buf + (done - off);
+                done += b;
+                continue;
+            }
+
+            /* keep what the write does not cover */
+            ubuf = &edge[done == (uint64_t) off ? 0 : 1];
+            if (!*ubuf)
+                *ubuf = malloc(chunk);
+            if (!*ubuf) {
+                res = -ENOMEM;
+                break;
+            }
+            if (e) {
+                res = cfile_read_chunk(c, fd, idx, *ubuf, 0, j->ulen, &spare);
+                if (res)
+                    break;
+            } else {
+                memset(*ubuf, 0, a);
+            }
+            memcpy(*ubuf + a, buf + (done - off), b - a);
+            j->data = *ubuf;
+            done += b - a;
+        }
+
+        if (n && !res)
+            res = cfile_store_batch(c, fd, jobs, n);
+        if (res)
+            break;
+        pos = done;
+        if (pos > c->size) {
+            c->size = pos;
+            c->dirty = 1;
+        }
+    }
+    if (!res && pos < end) {
+        res = cfile_append(c, fd, buf + (pos - off), end - pos);
+        if (!res)
+            pos = end;
+    }
+    pthread_rwlock_unlock(&c->lock);
+    free(jobs);
+    free(out);
+    free(edge[0]);
+    free(edge[1]);
+    free(spare);
+
+    if (res && pos == (uint64_t) off)
+        return res;
+    return pos - off;
+}
+
+int lo_cfile_reset(struct lo_cfile *c, int fd)
+{
+    uint64_t i;
+    int res;
+
+    pthread_rwlock_wrlock(&c->lock);
+    if (ftruncate(fd, LO_CFILE_HDR_SIZE) == -1) {
+        res = -errno;
+        goto out;
+    }
+    cfile_tail_free(c);
+    for (i = 0; i < c->nchunks; i++)
+        cfile_drop_deltas(c, i);
+    c->size = 0;
+    c->nchunks = 0;
+    c->stored = 0;
+    c->garbage = 0;
+    c->index_off = c->index_len = 0;
+    c->end = LO_CFILE_HDR_SIZE;
+    c->dirty = 0;
+    c->flags = 0;
+    c->raw_streak = 0;
+    c->id = cfile_new_id();
+    res = cfile_write_hdr(c, fd, 0);
+out:
+    pthread_rwlock_unlock(&c->lock);
+    return res;
+}
+
+/* Writes the index and the delta table after it at the end of the log,
+   which makes the previous ones garbage. Called with the write lock
+   held. */
+static int cfile_write_index(struct lo_cfile *c, int fd)
+{
+    struct lo_cfile_delta *table = NULL;
+    struct iovec iov[2];
+    uint64_t i, n = 0, len;
+    int res;
+
+    if (c->ndeltas) {
+        table = malloc(c->ndeltas * sizeof(*table));
+        if (!table)
+            return -ENOMEM;
+        for (i = 0; i < c->nchunks; i++) {
+            const struct lo_cfile_dlist *l = c->deltas[i];
+
+            if (l) {
+                memcpy(table + n, l->d, l->n * sizeof(*table));
+                n += l->n;
+            }
+        }
+    }
+    iov[0].iov_base = c->index;
+    iov[0].iov_len = c->nchunks * sizeof(struct lo_cfile_ent);
+    iov[1].iov_base = table;
+    iov[1].iov_len = n * sizeof(*table);
+    len = iov[0].iov_len + iov[1].iov_len;
+    res = pwritev_full(fd, iov, n ? 2 : 1, c->end);
+    free(table);
+    if (res)
+        return res;
+    c->garbage += c->index_len;
+    c->index_off = c->end;
+    c->index_len = len;
+    c->end += len;
+    return 0;
+}
+
+/*
+ * Rewrites the chunks that have deltas, LO_CFILE_BATCH at a time, like
+ * a write of each would.
+ */
+int lo_cfile_merge(struct lo_cfile *c, int fd)
+{
+    size_t chunk = (size_t) 1 << c->chunk_shift;
+    struct cfile_job *jobs = NULL;
+    char *data = NULL, *out = NULL, *spare = NULL;
+    uint64_t idx = 0, span;
+    int n, res;
+
+    pthread_rwlock_wrlock(&c->lock);
+    /* the tail chunk has its deltas in memory, storing it drops them */
+    res = cfile_tail_store(c, fd);
+    if (res || !c->ndeltas)
+        goto out;
+    span = c->ndeltas < LO_CFILE_BATCH ? c->ndeltas : LO_CFILE_BATCH;
+    jobs = calloc(span, sizeof(struct cfile_job));
+    data = malloc(span * chunk);
+    out = malloc(span * chunk);
+    if (!jobs || !data || !out) {
+        res = -ENOMEM;
+        goto out;
+    }
+    while (c->ndeltas && idx < c->nchunks && !res) {
+        for (n = 0; idx < c->nchunks && n < (int) span; idx++) {
+            struct cfile_job *j = &jobs[n];
+
+            if (!c->deltas[idx])
+                continue;
+            j->idx = idx;
+            j->ulen = c->index[idx].ulen;
+            j->data = data + n * chunk;
+            j->out = out + n * chunk;
+            res = cfile_read_chunk(c, fd, idx, data + n * chunk, 0, j->ulen,
+                           &spare);
+            if (res)
+                break;
+            n++;
+        }
+        if (n && !res)
+            res = cfile_store_batch(c, fd, jobs, n);
+    }
+out:
+    pthread_rwlock_unlock(&c->lock);
+    free(jobs);
+    free(data);
+    free(out);
+    free(spare);
+    return res;
+}
+
+/* Called with the write lock held */
+static int cfile_flush(struct lo_cfile *c, int fd)
+{
+    int res;
+
+    res = cfile_tail_store(c, fd);
+    if (res || !c->dirty)
+        return res;
+    if (c->nchunks) {
+        res = cfile_write_index(c, fd);
+        if (res)
+            return res;
+    } else {
+        c->garbage += c->index_len;
+        c->index_off = c->index_len = 0;
+    }
+    /* the index must be on disk before the header points at it */
+    if (fdatasync(fd) == -1)
+        return -errno;
+    res = cfile_write_hdr(c, fd, c->index_off);
+    if (!res)
+        c->dirty = 0;
+    return res;
+}
+
+int lo_cfile_flush(struct lo_cfile *c, int fd)
+{
+    int res;
+
+    pthread_rwlock_wrlock(&c->lock);
+    res = cfile_flush(c, fd);
+    pthread_rwlock_unlock(&c->lock);
+    return res;
+}
+
+ssize_t lo_cfile_recompress(struct lo_cfile *c, int fd, uint64_t *idx)
+{
+    size_t chunk = (size_t) 1 << c->chunk_shift;
+    struct lo_cfile_ent *e = NULL;
+    struct cfile_job j;
+    char *data, *spare = NULL;
+    ssize_t res = 0;
+
+    data = malloc(2 * chunk);
+    if (!data)
+        return -ENOMEM;
+    pthread_rwlock_wrlock(&c->lock);
+    for (; *idx < c->nchunks; (*idx)++) {
+        e = &c->index[*idx];
+        if (!e->off || (c->tail && *idx == c->tail_idx))
+            continue;
+        if (c->deltas[*idx] ||
+            (e->flags & (LO_CHUNK_LINKED | LO_CHUNK_UNTRIED)))
+            break;
+    }
+    if (*idx >= c->nchunks)
+        goto out;
+
+    memset(&j, 0, sizeof(j));
+    j.idx = *idx;
+    j.data = data;
+    j.out = data + chunk;
+    j.ulen = e->ulen;
+    j.dict = c->dict;
+    res = cfile_read_chunk(c, fd, *idx, data, 0, e->ulen, &spare);
+    if (!res) {
+        /* no shortcuts this time */
+        cfile_compress(&j.task);
+        cfile_learn(c, &j);
+        if (!j.csize && !(e->flags & LO_CHUNK_LINKED) && !c->deltas[*idx]) {
+            /* tried now, it stays as it is */
+            e->flags &= ~LO_CHUNK_UNTRIED;
+            c->dirty = 1;
+            res = e->ulen;
+        } else {
+            res = cfile_write_batch(c, fd, &j, 1);
+            if (!res)
+                res = e->ulen + e->csize;
+        }
+    }
+    (*idx)++;
+out:
+    pthread_rwlock_unlock(&c->lock);
+    free(data);
+    free(spare);
+    return res;
+}
+
+/* [off, off + len) of the lower file that something points at */
+struct cfile_extent {
+    uint64_t off;
+    uint64_t len;
+};
+
+static int cfile_extent_cmp(const void *a, const void *b)
+{
+    const struct cfile_extent *x = a, *y = b;
+
+    return x->off < y->off ? -1 : x->off > y->off;
+}
+
+static int cfile_extent_add(struct cfile_extent **x, size_t *n, size_t *cap,
+                uint64_t off, uint64_t len)
+{
+    struct cfile_extent *more;
+
+    if (*n == *cap) {
+        more = realloc(*x, 2 * *cap * sizeof(**x));
+        if (!more)
+            return -ENOMEM;
+        *x = more;
+        *cap *= 2;
+    }
+    (*x)[*n].off = off;
+    (*x)[*n].len = len;
+    (*n)++;
+    return 0;
+}
+
+/* Lists the live parts of the lower file, sorted, the older segments of
+   linked chunks read back from it. Called with the write lock held. */
+static int cfile_live(struct lo_cfile *c, int fd, struct cfile_extent **live,
+              size_t *count)
+{
+    struct cfile_extent *x;
+    struct lo_cfile_seg seg;
+    size_t n = 0, cap = c->nchunks + c->ndeltas + 2;
+    uint64_t i, off;
+    uint32_t k;
+    int links, res = 0;
+
+    x = malloc(cap * sizeof(*x));
+    if (!x)
+        return -ENOMEM;
+    res = cfile_extent_add(&x, &n, &cap, 0, LO_CFILE_HDR_SIZE);
+    if (!res && c->index_len)
+        res = cfile_extent_add(&x, &n, &cap, c->index_off, c->index_len);
+    for (i = 0; i < c->nchunks && !res; i++) {
+        const struct lo_cfile_ent *e = &c->index[i];
+        const struct lo_cfile_dlist *l = c->deltas[i];
+
+        for (k = 0; l && k < l->n && !res; k++)
+            res = cfile_extent_add(&x, &n, &cap, l->d[k].off, l->d[k].len);
+        if (!res && e->off)
+            res = cfile_extent_add(&x, &n, &cap, e->off, e->csize);
+        off = e->off && (e->flags & LO_CHUNK_LINKED) ? e->off : 0;
+        for (links = 0; off && !res; links++) {
+            if (links == LO_CFILE_MAX_LINKS) {
+                res = -EUCLEAN;
+                break;
+            }
+            res = pread_full(fd, &seg, sizeof(seg), off);
+            if (!res && off != e->off)
+                res = cfile_extent_add(&x, &n, &cap, off,
+                               sizeof(seg) + seg.csize);
+            off = seg.prev;
+        }
+    }
+    if (res) {
+        free(x);
+        return res;
+    }
+    qsort(x, n, sizeof(*x), cfile_extent_cmp);
+    *live = x;
+    *count = n;
+    return 0;
+}
+
+ssize_t lo_cfile_punch(struct lo_cfile *c, int fd)
+{
+    struct cfile_extent *live = NULL;
+    uint64_t id, pos, end, garbage = 0;
+    size_t n = 0, i;
+    int res;
+
+    pthread_rwlock_wrlock(&c->lock);
+    res = cfile_flush(c, fd);
+    /* the header must point at the new index before the old goes */
+    if (!res && fdatasync(fd) == -1)
+        res = -errno;
+    if (!res)
+        res = cfile_live(c, fd, &live, &n);
+    if (!res) {
+        garbage = c->garbage;
+        c->garbage = 0;
+    }
+    id = c->id;
+    end = c->end;
+    pthread_rwlock_unlock(&c->lock);
+    if (res)
+        return res;
+
+    /*
+     * Everything before end that was not live then never will be: the
+     * log is only appended to. The read lock only keeps a reset from
+     * reusing the space, writes of other chunks go on in between.
+     */
+    for (pos = 0, i = 0; pos < end && !res; i++) {
+        uint64_t to = i < n ? live[i].off : end;
+
+        if (to > end)
+            to = end;
+        if (to > pos) {
+            pthread_rwlock_rdlock(&c->lock);
+            if (c->id != id)
+                res = -ESTALE;
+            else if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                       pos, to - pos) == -1)
+                res = -errno;
+            pthread_rwlock_unlock(&c->lock);
+        }
+        if (i < n && live[i].off + live[i].len > pos)
+            pos = live[i].off + live[i].len;
+        if (i >= n)
+            break;
+    }
+    free(live);
+    if (res == -ESTALE)
+        res = 0;
+    if (res) {
+        /* some of it is left */
+        pthread_rwlock_wrlock(&c->lock);
+        if (c->id == id)
+            c->garbage += garbage;
+        pthread_rwlock_unlock(&c->lock);
+        return res;
+    }
+    return garbage;
+}
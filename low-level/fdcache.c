@@ -0,0 +1,217 @@
+/*
+ * LRU cache of O_PATH file descriptors, see lo_fdcache.h.
+ *
+ * Slots are kept in a doubly linked list ordered by last use, linked
+ * by index so that the owners only need to store a single int. Slots
+ * with users (refs > 0) are never evicted; if every slot is pinned the
+ * caller gets a private fd which is closed again by lo_fdcache_put().
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include "lo_fdcache.h"
+
+static void fdcache_unlink(struct lo_fdcache *c, int s)
+{
+    struct lo_fdcache_slot *p = &c->slots[s];
+
+    if (p->prev >= 0)
+        c->slots[p->prev].next = p->next;
+    else
+        c->mru = p->next;
+    if (p->next >= 0)
+        c->slots[p->next].prev = p->prev;
+    else
+        c->lru = p->prev;
+}
+
+static void fdcache_link_mru(struct lo_fdcache *c, int s)
+{
+    struct lo_fdcache_slot *p = &c->slots[s];
+
+    p->prev = -1;
+    p->next = c->mru;
+    if (c->mru >= 0)
+        c->slots[c->mru].prev = s;
+    else
+        c->lru = s;
+    c->mru = s;
+}
+
+/* called with lock held, returns a detached slot or -1 */
+static int fdcache_grab(struct lo_fdcache *c)
+{
+    int s;
+
+    if (c->free >= 0) {
+        s = c->free;
+        c->free = c->slots[s].next;
+        c->used++;
+        return s;
+    }
+
+    for (s = c->lru; s >= 0; s = c->slots[s].prev) {
+        struct lo_fdcache_slot *p = &c->slots[s];
+
+        if (p->refs)
+            continue;
+        fdcache_unlink(c, s);
+        close(p->fd);
+        *p->ref = -1;
+        p->ref = NULL;
+        c->evictions++;
+        return s;
+    }
+    return -1;
+}
+
+static void fdcache_install(struct lo_fdcache *c, int s, int *slot,
+                int fd, int refs)
+{
+    struct lo_fdcache_slot *p = &c->slots[s];
+
+    p->ref = slot;
+    p->fd = fd;
+    p->refs = refs;
+    fdcache_link_mru(c, s);
+    *slot = s;
+}
+
+int lo_fdcache_init(struct lo_fdcache *c, int nslots)
+{
+    int i;
+
+    c->slots = calloc(nslots, sizeof(struct lo_fdcache_slot));
+    if (!c->slots)
+        return -1;
+
+    for (i = 0; i < nslots; i++) {
+        c->slots[i].fd = -1;
+        c->slots[i].next = i + 1 < nslots ? i + 1 : -1;
+    }
+    c->nslots = nslots;
+    c->used = 0;
+    c->mru = c->lru = -1;
+    c->free = 0;
+    c->hits = c->misses = c->evictions = 0;
+    pthread_mutex_init(&c->lock, NULL);
+    return 0;
+}
+
+void lo_fdcache_destroy(struct lo_fdcache *c)
+{
+    int s;
+
+    if (!c->slots)
+        return;
+
+    for (s = c->mru; s >= 0; s = c->slots[s].next) {
+        close(c->slots[s].fd);
+        *c->slots[s].ref = -1;
+    }
+    free(c->slots);
+    c->slots = NULL;
+    pthread_mutex_destroy(&c->lock);
+}
+
+int lo_fdcache_get(struct lo_fdcache *c, int *slot,
+           lo_fdcache_open_t open_fn, void *arg)
+{
+    int fd;
+    int s;
+
+    pthread_mutex_lock(&c->lock);
+    s = *slot;
+    if (s >= 0) {
+        c->hits++;
+        goto found;
+    }
+    c->misses++;
+    pthread_mutex_unlock(&c->lock);
+
+    /* open_by_handle_at() can block, don't hold the lock over it */
+    fd = open_fn(arg);
+    if (fd == -1)
+        return -1;
+
+    pthread_mutex_lock(&c->lock);
+    s = *slot;
+    if (s >= 0) {
+        /* somebody else reopened it in the meantime */
+        close(fd);
+        goto found;
+    }
+    s = fdcache_grab(c);
+    if (s >= 0)
+        fdcache_install(c, s, slot, fd, 1);
+    pthread_mutex_unlock(&c->lock);
+    return fd;
+
+found:
+    c->slots[s].refs++;
+    fd = c->slots[s].fd;
+    if (c->mru != s) {
+        fdcache_unlink(c, s);
+        fdcache_link_mru(c, s);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return fd;
+}
+
+void lo_fdcache_put(struct lo_fdcache *c, int *slot, int fd)
+{
+    int s;
+
+    pthread_mutex_lock(&c->lock);
+    s = *slot;
+    if (s >= 0 && c->slots[s].fd == fd) {
+        assert(c->slots[s].refs > 0);
+        c->slots[s].refs--;
+        pthread_mutex_unlock(&c->lock);
+        return;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    /* cache was full of pinned fds when this one was opened */
+    close(fd);
+}
+
+void lo_fdcache_add(struct lo_fdcache *c, int *slot, int fd)
+{
+    int s = -1;
+
+    pthread_mutex_lock(&c->lock);
+    if (*slot < 0) {
+        s = fdcache_grab(c);
+        if (s >= 0)
+            fdcache_install(c, s, slot, fd, 0);
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    if (s < 0)
+        close(fd);
+}
+
+void lo_fdcache_drop(struct lo_fdcache *c, int *slot)
+{
+    struct lo_fdcache_slot *p;
+    int s;
+
+    pthread_mutex_lock(&c->lock);
+    s = *slot;
+    if (s >= 0) {
+        p = &c->slots[s];
+        assert(p->refs == 0);
+        fdcache_unlink(c, s);
+        close(p->fd);
+        p->fd = -1;
+        p->ref = NULL;
+        p->next = c->free;
+        c->free = s;
+        c->used--;
+        *slot = -1;
+    }
+    pthread_mutex_unlock(&c->lock);
+}
@@ -0,0 +1,301 @@
+/*
+ * Multi-queue session loop, see lo_loop.h.
+ *
+ * libfuse only exposes fuse_session_receive_buf() on the session fd.
+ * To serve cloned channels through the public API the session's I/O
+ * is redirected (fuse_session_custom_io, libfuse 3.14+) to callbacks
+ * that substitute the calling worker's channel, which is kept in a
+ * thread local. Anything that replies from another thread has to set
+ * that thread local to the channel of the request first.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include "lo_loop.h"
+
+#ifndef FUSE_DEV_IOC_CLONE
+#define FUSE_DEV_IOC_CLONE _IOR(229, 0, uint32_t)
+#endif
+
+/* same size libfuse uses for its own receive buffers (se->bufsize) */
+#define LO_LOOP_MAX_PAGES 256
+#define LO_LOOP_HEADER_SIZE 0x1000
+
+struct lo_loop;
+
+struct lo_loop_worker {
+    struct lo_loop *loop;
+    pthread_t thread;
+    int started;
+    int fd;         /* cloned channel, or the session fd */
+    int cpu;        /* -1 if not pinned */
+    struct fuse_buf fbuf;
+};
+
+struct lo_loop {
+    struct fuse_session *se;
+    sem_t finish;
+    int error;
+    unsigned int nworkers;
+    struct lo_loop_worker *workers;
+};
+
+static __thread int lo_chan = -1;
+
+int lo_loop_channel(void)
+{
+    return lo_chan;
+}
+
+void lo_loop_set_channel(int fd)
+{
+    lo_chan = fd;
+}
+
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 14)
+static ssize_t lo_loop_read(int fd, void *buf, size_t len, void *userdata)
+{
+    (void) userdata;
+    return read(lo_chan >= 0 ? lo_chan : fd, buf, len);
+}
+
+static ssize_t lo_loop_writev(int fd, struct iovec *iov, int count,
+                  void *userdata)
+{
+    (void) userdata;
+    return writev(lo_chan >= 0 ? lo_chan : fd, iov, count);
+}
+
+static ssize_t lo_loop_splice_receive(int fdin, off_t *offin, int fdout,
+                      off_t *offout, size_t len,
+                      unsigned int flags, void *userdata)
+{
+    (void) userdata;
+    return splice(lo_chan >= 0 ? lo_chan : fdin, offin, fdout, offout,
+              len, flags);
+}
+
+static ssize_t lo_loop_splice_send(int fdin, off_t *offin, int fdout,
+                   off_t *offout, size_t len,
+                   unsigned int flags, void *userdata)
+{
+    (void) userdata;
+    return splice(fdin, offin, lo_chan >= 0 ? lo_chan : fdout, offout,
+              len, flags);
+}
+
+static const struct fuse_custom_io lo_loop_io = {
+    .writev = lo_loop_writev,
+    .read = lo_loop_read,
+    .splice_receive = lo_loop_splice_receive,
+    .splice_send = lo_loop_splice_send,
+};
+
+static int lo_loop_clone_fd(int masterfd)
+{
+    uint32_t master = masterfd;
+    int fd;
+
+    fd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+
+    if (ioctl(fd, FUSE_DEV_IOC_CLONE, &master) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void *lo_loop_worker(void *arg)
+{
+    struct lo_loop_worker *w = arg;
+    struct lo_loop *loop = w->loop;
+    struct fuse_session *se = loop->se;
+    int res;
+
+    lo_chan = w->fd;
+
+    while (!fuse_session_exited(se)) {
+        /* only allow cancellation while waiting for a request */
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        w->fbuf.flags = 0;
+        res = fuse_session_receive_buf(se, &w->fbuf);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if (res == -EINTR)
+            continue;
+        if (res <= 0) {
+            if (res < 0 && res != -ENODEV)
+                loop->error = res;
+            break;
+        }
+
+        fuse_session_process_buf(se, &w->fbuf);
+    }
+
+    fuse_session_exit(se);
+    sem_post(&loop->finish);
+    return NULL;
+}
+
+/* CPUs of our affinity mask, in order */
+static int lo_loop_cpus(int **cpus)
+{
+    cpu_set_t set;
+    int i, n = 0;
+
+    if (sched_getaffinity(0, sizeof(set), &set) == -1)
+        return 0;
+
+    *cpus = malloc(CPU_COUNT(&set) * sizeof(int));
+    if (!*cpus)
+        return 0;
+    for (i = 0; i < CPU_SETSIZE; i++) {
+        if (CPU_ISSET(i, &set))
+            (*cpus)[n++] = i;
+    }
+    return n;
+}
+
+static int lo_loop_start(struct lo_loop *loop, struct lo_loop_worker *w)
+{
+    pthread_attr_t attr;
+    sigset_t newset, oldset;
+    int res;
+
+    pthread_attr_init(&attr);
+    if (w->cpu >= 0) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    }
+
+    /* signals are for the main thread, which waits for them */
+    sigfillset(&newset);
+    pthread_sigmask(SIG_BLOCK, &newset, &oldset);
+    res = pthread_create(&w->thread, &attr, lo_loop_worker, w);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    pthread_attr_destroy(&attr);
+
+    if (res) {
+        fprintf(stderr, "lo_loop: error creating thread: %s\n",
+            strerror(res));
+        return -1;
+    }
+    w->started = 1;
+    return 0;
+}
+
+int lo_session_loop(struct fuse_session *se, unsigned int threads,
+            int pin, struct lo_loop_stats *stats)
+{
+    struct lo_loop loop = { .se = se };
+    size_t bufsize = LO_LOOP_MAX_PAGES * getpagesize() + LO_LOOP_HEADER_SIZE;
+    int masterfd = fuse_session_fd(se);
+    int *cpus = NULL;
+    int ncpus;
+    unsigned int i;
+    int res = 0;
+
+    ncpus = lo_loop_cpus(&cpus);
+    if (!threads)
+        threads = ncpus > 0 ? ncpus : 1;
+    if (ncpus <= 0)
+        pin = 0;
+
+    if (fuse_session_custom_io(se, &lo_loop_io, masterfd) != 0) {
+        fprintf(stderr, "lo_loop: cannot redirect session I/O\n");
+        free(cpus);
+        return -1;
+    }
+
+    loop.workers = calloc(threads, sizeof(struct lo_loop_worker));
+    if (!loop.workers) {
+        free(cpus);
+        return -1;
+    }
+    loop.nworkers = threads;
+    sem_init(&loop.finish, 0, 0);
+    memset(stats, 0, sizeof(*stats));
+    stats->threads = threads;
+
+    for (i = 0; i < threads; i++) {
+        struct lo_loop_worker *w = &loop.workers[i];
+
+        w->loop = &loop;
+        w->cpu = pin ? cpus[i % ncpus] : -1;
+        w->fd = lo_loop_clone_fd(masterfd);
+        if (w->fd == -1)
+            w->fd = masterfd;   /* share the session channel */
+        else
+            stats->cloned++;
+
+        if (posix_memalign(&w->fbuf.mem, getpagesize(), bufsize) != 0) {
+            w->fbuf.mem = NULL;
+            res = -1;
+            break;
+        }
+        w->fbuf.mem_size = bufsize;
+        w->fbuf.size = bufsize;
+        if (lo_loop_start(&loop, w) != 0) {
+            res = -1;
+            break;
+        }
+        if (w->cpu >= 0)
+            stats->pinned++;
+    }
+    free(cpus);
+
+    if (res == 0) {
+        while (!fuse_session_exited(se))
+            sem_wait(&loop.finish);
+    }
+    fuse_session_exit(se);
+
+    for (i = 0; i < threads; i++) {
+        struct lo_loop_worker *w = &loop.workers[i];
+
+        if (w->started) {
+            pthread_cancel(w->thread);
+            pthread_join(w->thread, NULL);
+        }
+        if (w->fd != -1 && w->fd != masterfd)
+            close(w->fd);
+        free(w->fbuf.mem);
+    }
+    free(loop.workers);
+    sem_destroy(&loop.finish);
+
+    if (res == 0 && loop.error)
+        res = loop.error;
+    fuse_session_reset(se);
+    return res;
+}
+#else
+int lo_session_loop(struct fuse_session *se, unsigned int threads,
+            int pin, struct lo_loop_stats *stats)
+{
+    (void) threads;
+    (void) pin;
+
+    /* no custom I/O hooks: closest we get is libfuse's cloned channels */
+    fprintf(stderr, "lo_loop: libfuse too old, using fuse_session_loop_mt\n");
+    memset(stats, 0, sizeof(*stats));
+    return fuse_session_loop_mt(se, 1);
+}
+#endif
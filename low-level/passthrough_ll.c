@@ -28,14 +28,13 @@
  *
  * Compile with:
  *
- *     gcc -Wall passthrough_ll.c `pkg-config fuse3 --cflags --libs` -o passthrough_ll
+ *     make jcFs_ll
  *
  * ## Source code ##
  * \include passthrough_ll.c
  */
 
 #define _GNU_SOURCE
-#define FUSE_USE_VERSION 31
 
 #include <fuse_lowlevel.h>
 #include <unistd.h>
@@ -50,7 +49,25 @@
 #include <errno.h>
 #include <err.h>
 #include <inttypes.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/fsuid.h>
+#include <linux/fs.h>
+#include <linux/openat2.h>
 #include "buffer.h"
+#include "lo_fdcache.h"
+#include "lo_slab.h"
+#include "lo_loop.h"
+#include "lo_uring.h"
+#include "lo_pool.h"
+#include "lo_cfile.h"
 #include "lz4.h"
 
 /* We are re-using pointers to our `struct lo_inode` and `struct
@@ -66,18 +83,214 @@ struct _uintptr_to_must_hold_fuse_ino_t_dummy_struct \
             ((sizeof(fuse_ino_t) >= sizeof(uintptr_t)) ? 1 : -1); };
 #endif
 
+/* An inode either pins an O_PATH fd for its whole lifetime, or (with
+   -o fhandle) only stores a file handle and borrows an fd from the
+   fd cache whenever it is needed.
+
+   Inodes are allocated from a slab and only reachable through the
+   inode table, so the structure carries no list linkage. Fields used
+   by lookup and forget come first; state that is only needed while
+   a file is open lives in a separately allocated lo_inode_ext. */
 struct lo_inode {
-    struct lo_inode *next;
-    struct lo_inode *prev;
-    int fd;
     ino_t ino;
     dev_t dev;
     uint64_t nlookup;
+    union {
+        int fd;         /* without handle */
+        int fd_slot;    /* with handle */
+    };
+    uint32_t flags;
+    struct file_handle *handle;
+    struct lo_inode_ext *ext;
+};
+
+/* lo_inode.flags */
+enum {
+    /* reads and writes must be served by the daemon (e.g. compressed
+       files), never by kernel passthrough */
+    LO_I_DAEMON_IO = 1 << 0,
+    /* in a compress_dirs tree: new files are stored as chunked LZ4
+       (see lo_cfile.h); always set together with LO_I_DAEMON_IO */
+    LO_I_COMPRESS = 1 << 1,
+};
+
+/* flags a new inode inherits from the directory it was looked up in */
+#define LO_I_INHERIT (LO_I_DAEMON_IO | LO_I_COMPRESS)
+
+/* Data extents of a sparse file, sorted, as found by SEEK_DATA and
+   SEEK_HOLE; everything between them and up to size is a hole. */
+struct lo_extent {
+    off_t start;
+    off_t end;
+};
+
+struct lo_holemap {
+    off_t size;
+    struct timespec mtime;
+    size_t count;
+    struct lo_extent ext[];
+};
+
+struct lo_inode_ext {
+    pthread_mutex_t lock;
+    int nopen;
+    int backing_id;     /* kernel passthrough backing file, 0 if none */
+    int sparse;         /* allocated size < size as of the last open */
+    uint64_t holes_gen; /* bumped when holes is dropped */
+    struct lo_holemap *holes;
+    uint64_t write_gen; /* bumped by every write through the mount */
+    uint64_t compact_gen;   /* write_gen as of the last compaction pass */
+    /* compaction found nothing to do at compact_gen, with the lower
+       file at this size and mtime */
+    int compact_clean;
+    off_t compact_size;
+    struct timespec compact_mtime;
+    /* lower file as the kernel's page cache last saw it, for
+       keep_cache=auto */
+    int cache_valid;
+    off_t cache_size;
+    struct timespec cache_mtime;
+    struct timespec cache_ctime;
+    struct lo_cfile *cfile; /* compressed file, loaded while open */
+    /* header of the closed compressed file, valid while the lower file
+       has the size, mtime and ctime it was recorded with */
+    int hdr_valid;
+    off_t hdr_lower_size;
+    struct timespec hdr_mtime;
+    struct timespec hdr_ctime;
+    uint64_t hdr_size;
+    uint64_t hdr_nchunks;
+};
+
+/* Open addressing hash table keyed by (ino, dev). The inode number
+   is duplicated in the entry so that probing only touches the table
+   itself, the inode is dereferenced once ino matches. */
+struct lo_itable_ent {
+    ino_t ino;
+    struct lo_inode *inode;
 };
 
+struct lo_itable {
+    struct lo_itable_ent *ents;
+    size_t mask;
+    size_t count;
+};
+
+/* Inodes whose lookup count dropped to zero are closed and freed in
+   batches by a separate thread, so that the kernel shrinking its
+   dcache does not keep request handlers busy with close(). */
+struct lo_reaper {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct lo_inode **queue;
+    size_t count;
+    size_t cap;
+    int stop;
+    int running;
+    pthread_t thread;
+    unsigned long batches;
+    unsigned long reaped;
+};
+
+/* Compressed files are compacted in the background by a thread of its
+   own, see lo_compact_file(). What it reads, compresses and writes is
+   taken from a token bucket refilled at compact_rate KiB/s, so that it
+   uses no more than that of the disk and CPU time the daemon serves
+   requests with. */
+struct lo_compactor {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;    /* signals stop, waits on CLOCK_MONOTONIC */
+    int stop;
+    int running;
+    pthread_t thread;
+    double tokens;          /* bytes it may use now, < 0: owed */
+    struct timespec refilled;
+    int no_punch;           /* the lower filesystem cannot punch holes */
+    unsigned long passes;
+    unsigned long files;
+    unsigned long chunks;
+    uint64_t freed;
+};
+
+/* lo_data.fadvise: page cache hints on the lower file of a sequential
+   reader, whose data is cached by the kernel on the FUSE side anyway */
+enum {
+    LO_FADV_DROP = 1 << 0,      /* DONTNEED behind it */
+    LO_FADV_AHEAD = 1 << 1,     /* readahead(2) in front of it */
+};
+
+/* lo_data.keep_cache: when opens keep the kernel's cached pages */
+enum {
+    LO_KC_NEVER,
+    LO_KC_ALWAYS,
+    LO_KC_AUTO,         /* if the lower file didn't change in between */
+};
+
+/* a compress_dirs entry */
+struct lo_cdir {
+    dev_t dev;
+    ino_t ino;
+};
+
+/* xattr of a lower directory in a compressed tree: the id, in hex, of
+   the dictionary its new files are compressed with */
+#define LO_CDICT_XATTR "user.jcfs.dict"
+
+/* libfuse receives every request into one buffer of FUSE_MAX_MAX_PAGES
+   pages and silently clamps max_write to fit */
+#define LO_MAX_PAGES_LIMIT 256
+
 struct lo_data {
     int debug;
     int writeback;
+    int passthrough;
+    unsigned int max_write;
+    unsigned int max_pages;
+    int max_pages_set;
+    unsigned int max_readahead;
+    unsigned int max_background;
+    unsigned int congestion_threshold;
+    int splice;             /* -1: libfuse's defaults */
+    int parallel_direct_writes;
+    int mq_loop;
+    unsigned int threads;
+    int pin_threads;
+    struct lo_loop_stats loop_stats;
+    int async;
+    unsigned int uring_depth;
+    struct lo_uring uring;
+    struct fuse_conn_info conn;     /* what lo_init negotiated */
+    int buftrace;
+    int fadvise;
+    int keep_cache;
+    unsigned long cache_kept;
+    unsigned long cache_dropped;
+    unsigned int prefetch;
+    unsigned long prefetch_ops;
+    unsigned long prefetch_bytes;
+    unsigned int pool_threads;
+    struct lo_pool pool;
+    struct fuse_session *se;
+    char *compress_dirs;
+    unsigned int compress_chunk;
+    unsigned int chunk_shift;
+    struct lo_cdir *cdirs;
+    size_t ncdirs;
+    unsigned int chunk_cache;
+    struct lo_ccache ccache;
+    struct lo_cdicts cdicts;
+    unsigned int compact;
+    unsigned int compact_rate;
+    struct lo_compactor compactor;
+    int fhandle;
+    int max_fds;
+    int mount_id;
+    pthread_mutex_t mutex;  /* protects itable and nlookup */
+    struct lo_itable itable;
+    struct lo_slab inode_slab;
+    size_t handle_bytes;
+    struct lo_fdcache fdcache;
+    struct lo_reaper reaper;
     struct lo_inode root;
 };
 
@@ -86,6 +299,87 @@ static const struct fuse_opt lo_opts[] = {
       offsetof(struct lo_data, writeback), 1 },
     { "no_writeback",
       offsetof(struct lo_data, writeback), 0 },
+    { "passthrough",
+      offsetof(struct lo_data, passthrough), 1 },
+    { "no_passthrough",
+      offsetof(struct lo_data, passthrough), 0 },
+    { "max_write=%u",
+      offsetof(struct lo_data, max_write), 0 },
+    { "max_pages=%u",
+      offsetof(struct lo_data, max_pages), 0 },
+    /* all templates an option matches are applied */
+    { "max_pages=",
+      offsetof(struct lo_data, max_pages_set), 1 },
+    { "max_readahead=%u",
+      offsetof(struct lo_data, max_readahead), 0 },
+    { "max_background=%u",
+      offsetof(struct lo_data, max_background), 0 },
+    { "congestion_threshold=%u",
+      offsetof(struct lo_data, congestion_threshold), 0 },
+    { "splice",
+      offsetof(struct lo_data, splice), 1 },
+    { "no_splice",
+      offsetof(struct lo_data, splice), 0 },
+    { "parallel_direct_writes",
+      offsetof(struct lo_data, parallel_direct_writes), 1 },
+    { "no_parallel_direct_writes",
+      offsetof(struct lo_data, parallel_direct_writes), 0 },
+    { "mq_loop",
+      offsetof(struct lo_data, mq_loop), 1 },
+    { "no_mq_loop",
+      offsetof(struct lo_data, mq_loop), 0 },
+    { "threads=%u",
+      offsetof(struct lo_data, threads), 0 },
+    { "pin_threads",
+      offsetof(struct lo_data, pin_threads), 1 },
+    { "no_pin_threads",
+      offsetof(struct lo_data, pin_threads), 0 },
+    { "async",
+      offsetof(struct lo_data, async), 1 },
+    { "no_async",
+      offsetof(struct lo_data, async), 0 },
+    { "uring_depth=%u",
+      offsetof(struct lo_data, uring_depth), 0 },
+    { "buftrace",
+      offsetof(struct lo_data, buftrace), 1 },
+    { "fadvise=none",
+      offsetof(struct lo_data, fadvise), 0 },
+    { "fadvise=drop",
+      offsetof(struct lo_data, fadvise), LO_FADV_DROP },
+    { "fadvise=ahead",
+      offsetof(struct lo_data, fadvise), LO_FADV_AHEAD },
+    { "fadvise=both",
+      offsetof(struct lo_data, fadvise), LO_FADV_DROP | LO_FADV_AHEAD },
+    { "keep_cache",
+      offsetof(struct lo_data, keep_cache), LO_KC_ALWAYS },
+    { "no_keep_cache",
+      offsetof(struct lo_data, keep_cache), LO_KC_NEVER },
+    { "keep_cache=always",
+      offsetof(struct lo_data, keep_cache), LO_KC_ALWAYS },
+    { "keep_cache=never",
+      offsetof(struct lo_data, keep_cache), LO_KC_NEVER },
+    { "keep_cache=auto",
+      offsetof(struct lo_data, keep_cache), LO_KC_AUTO },
+    { "prefetch=%u",
+      offsetof(struct lo_data, prefetch), 0 },
+    { "pool_threads=%u",
+      offsetof(struct lo_data, pool_threads), 0 },
+    { "compress_dirs=%s",
+      offsetof(struct lo_data, compress_dirs), 0 },
+    { "compress_chunk=%u",
+      offsetof(struct lo_data, compress_chunk), 0 },
+    { "chunk_cache=%u",
+      offsetof(struct lo_data, chunk_cache), 0 },
+    { "compact=%u",
+      offsetof(struct lo_data, compact), 0 },
+    { "compact_rate=%u",
+      offsetof(struct lo_data, compact_rate), 0 },
+    { "fhandle",
+      offsetof(struct lo_data, fhandle), 1 },
+    { "no_fhandle",
+      offsetof(struct lo_data, fhandle), 0 },
+    { "max_fds=%d",
+      offsetof(struct lo_data, max_fds), 0 },
     FUSE_OPT_END
 };
 
@@ -102,9 +396,43 @@ static struct lo_inode *lo_inode(fuse_req_t req, fuse_ino_t ino)
         return (struct lo_inode *) (uintptr_t) ino;
 }
 
+struct lo_reopen_arg {
+    struct lo_data *lo;
+    struct lo_inode *inode;
+};
+
+static int lo_reopen(void *arg)
+{
+    struct lo_reopen_arg *a = arg;
+
+    return open_by_handle_at(a->lo->root.fd, a->inode->handle, O_PATH);
+}
+
+static int lo_inode_fd_get(struct lo_data *lo, struct lo_inode *inode)
+{
+    struct lo_reopen_arg a = { lo, inode };
+
+    if (!inode->handle)
+        return inode->fd;
+    return lo_fdcache_get(&lo->fdcache, &inode->fd_slot, lo_reopen, &a);
+}
+
+static void lo_inode_fd_put(struct lo_data *lo, struct lo_inode *inode, int fd)
+{
+    if (inode->handle)
+        lo_fdcache_put(&lo->fdcache, &inode->fd_slot, fd);
+}
+
+/* Every lo_fd() must be paired with lo_fd_put() once the fd is no
+   longer used, a handle based inode may be evicted otherwise. */
 static int lo_fd(fuse_req_t req, fuse_ino_t ino)
 {
-    return lo_inode(req, ino)->fd;
+    return lo_inode_fd_get(lo_data(req), lo_inode(req, ino));
+}
+
+static void lo_fd_put(fuse_req_t req, fuse_ino_t ino, int fd)
+{
+    lo_inode_fd_put(lo_data(req), lo_inode(req, ino), fd);
 }
 
 static bool lo_debug(fuse_req_t req)
@@ -112,6 +440,70 @@ static bool lo_debug(fuse_req_t req)
     return lo_data(req)->debug != 0;
 }
 
+/* Request sizes and queue depth. The kernel derives max_pages from
+   max_write (libfuse sets FUSE_MAX_PAGES whenever it is offered), so
+   raising max_write is what lifts the default 128 KiB request limit. */
+static void lo_init_limits(struct lo_data *lo, struct fuse_conn_info *conn)
+{
+    unsigned int page = getpagesize();
+    unsigned int limit = LO_MAX_PAGES_LIMIT * page;
+
+    if (lo->max_pages > LO_MAX_PAGES_LIMIT) {
+        fprintf(stderr, "lo_init: max_pages clamped to %u\n",
+            LO_MAX_PAGES_LIMIT);
+        lo->max_pages = LO_MAX_PAGES_LIMIT;
+    }
+    if (lo->max_pages)
+        lo->max_write = lo->max_pages * page;
+    if (lo->max_write > limit) {
+        fprintf(stderr, "lo_init: max_write clamped to %u\n", limit);
+        lo->max_write = limit;
+    }
+    conn->max_write = lo->max_write;
+    conn->max_readahead = lo->max_readahead ? lo->max_readahead :
+                              lo->max_write;
+
+    if (lo->max_background) {
+        conn->max_background = lo->max_background;
+        conn->congestion_threshold = lo->congestion_threshold ?
+            lo->congestion_threshold : lo->max_background * 3 / 4;
+    } else if (lo->congestion_threshold) {
+        conn->congestion_threshold = lo->congestion_threshold;
+    }
+
+    /* libfuse already wants SPLICE_READ for write_buf */
+    if (lo->splice == 1) {
+        conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ |
+                           FUSE_CAP_SPLICE_WRITE |
+                           FUSE_CAP_SPLICE_MOVE);
+    } else if (lo->splice == 0) {
+        conn->want &= ~(FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE |
+                FUSE_CAP_SPLICE_MOVE);
+    }
+}
+
+static void lo_init_report(struct lo_data *lo, struct fuse_conn_info *conn)
+{
+    unsigned int page = getpagesize();
+
+    lo->conn = *conn;
+    if (!lo->debug)
+        return;
+
+    fprintf(stderr, "lo_init: proto %u.%u, max_write=%u (%u pages), "
+        "max_readahead=%u, max_background=%u, "
+        "congestion_threshold=%u\n", conn->proto_major,
+        conn->proto_minor, conn->max_write,
+        (conn->max_write + page - 1) / page, conn->max_readahead,
+        conn->max_background, conn->congestion_threshold);
+    fprintf(stderr, "lo_init: splice read=%d write=%d move=%d, "
+        "parallel_direct_writes=%d\n",
+        !!(conn->want & FUSE_CAP_SPLICE_READ),
+        !!(conn->want & FUSE_CAP_SPLICE_WRITE),
+        !!(conn->want & FUSE_CAP_SPLICE_MOVE),
+        lo->parallel_direct_writes);
+}
+
 static void lo_init(void *userdata,
             struct fuse_conn_info *conn)
 {
@@ -120,82 +512,635 @@ static void lo_init(void *userdata,
     if(conn->capable & FUSE_CAP_EXPORT_SUPPORT)
         conn->want |= FUSE_CAP_EXPORT_SUPPORT;
 
+    lo_init_limits(lo, conn);
+
     if (lo->writeback &&
         conn->capable & FUSE_CAP_WRITEBACK_CACHE) {
         if (lo->debug)
             fprintf(stderr, "lo_init: activating writeback\n");
         conn->want |= FUSE_CAP_WRITEBACK_CACHE;
     }
+
+    if (lo->passthrough) {
+#ifdef FUSE_CAP_PASSTHROUGH
+        if (!(conn->capable & FUSE_CAP_PASSTHROUGH)) {
+            fprintf(stderr, "lo_init: kernel has no passthrough support\n");
+            lo->passthrough = 0;
+        } else if (conn->want & FUSE_CAP_WRITEBACK_CACHE) {
+            /* the kernel refuses backing files on writeback mounts */
+            fprintf(stderr, "lo_init: passthrough disabled by writeback\n");
+            lo->passthrough = 0;
+        } else {
+            if (lo->debug)
+                fprintf(stderr, "lo_init: activating passthrough\n");
+            conn->want |= FUSE_CAP_PASSTHROUGH;
+        }
+#else
+        fprintf(stderr, "lo_init: libfuse built without passthrough\n");
+        lo->passthrough = 0;
+#endif
+    }
+
+    lo_init_report(lo, conn);
+}
+
+static struct lo_inode_ext *lo_inode_ext(struct lo_data *lo,
+                     struct lo_inode *inode)
+{
+    struct lo_inode_ext *ext;
+
+    pthread_mutex_lock(&lo->mutex);
+    ext = inode->ext;
+    if (!ext) {
+        ext = calloc(1, sizeof(struct lo_inode_ext));
+        if (ext) {
+            pthread_mutex_init(&ext->lock, NULL);
+            inode->ext = ext;
+        }
+    }
+    pthread_mutex_unlock(&lo->mutex);
+    return ext;
+}
+
+static bool lo_ts_equal(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/* Called with ext->lock */
+static void lo_hdr_record(struct lo_inode_ext *ext, const struct stat *st,
+              uint64_t size, uint64_t nchunks)
+{
+    ext->hdr_valid = 1;
+    ext->hdr_lower_size = st->st_size;
+    ext->hdr_mtime = st->st_mtim;
+    ext->hdr_ctime = st->st_ctim;
+    ext->hdr_size = size;
+    ext->hdr_nchunks = nchunks;
+}
+
+/*
+ * Files in compressed directories report their logical size. That of
+ * an open one may not be flushed yet and comes from memory, the others
+ * have it in their header, which is kept with the inode until the
+ * lower file changes, so that a getattr costs no more than that of a
+ * plain file. Returns the number of chunks, 0 if it is not compressed.
+ */
+static uint64_t lo_cfile_attr(struct lo_data *lo, struct lo_inode *inode,
+                  struct stat *st)
+{
+    struct lo_inode_ext *ext;
+    struct lo_cfile_hdr h;
+    struct stat lower = *st;
+    uint64_t nchunks = 0;
+    char procname[64];
+    bool known = false;
+    int fd, ino_fd, res;
+
+    if (!(inode->flags & LO_I_COMPRESS) || !S_ISREG(st->st_mode))
+        return 0;
+    ext = lo_inode_ext(lo, inode);
+    if (ext) {
+        pthread_mutex_lock(&ext->lock);
+        if (ext->cfile) {
+            st->st_size = lo_cfile_size(ext->cfile);
+            nchunks = lo_cfile_nchunks(ext->cfile);
+            known = true;
+        } else if (ext->hdr_valid && ext->hdr_lower_size == st->st_size &&
+               lo_ts_equal(&ext->hdr_mtime, &st->st_mtim) &&
+               lo_ts_equal(&ext->hdr_ctime, &st->st_ctim)) {
+            st->st_size = ext->hdr_size;
+            nchunks = ext->hdr_nchunks;
+            known = true;
+        }
+        pthread_mutex_unlock(&ext->lock);
+    }
+    if (known || st->st_size < LO_CFILE_HDR_SIZE)
+        return nchunks;
+
+    ino_fd = lo_inode_fd_get(lo, inode);
+    if (ino_fd == -1)
+        return 0;
+    sprintf(procname, "/proc/self/fd/%i", ino_fd);
+    fd = open(procname, O_RDONLY | O_CLOEXEC);
+    lo_inode_fd_put(lo, inode, ino_fd);
+    if (fd == -1)
+        return 0;
+    res = lo_cfile_read_hdr(fd, &h);
+    close(fd);
+    if (res == 1) {
+        st->st_size = h.size;
+        nchunks = h.nchunks;
+    }
+    /* lower was taken first: had the header changed since, the lower
+       file would have grown past it. Plain files are kept as such. */
+    if (res >= 0 && ext) {
+        pthread_mutex_lock(&ext->lock);
+        if (!ext->cfile)
+            lo_hdr_record(ext, &lower, st->st_size, nchunks);
+        pthread_mutex_unlock(&ext->lock);
+    }
+    return nchunks;
+}
+
+/*
+ * Asynchronous variants of getattr, open, read and write_buf (-o async).
+ * Each submits the lower filesystem call to io_uring and returns; the
+ * reply is sent by the *_done callback on the completion thread. If
+ * the submission fails the handler carries on synchronously.
+ */
+
+struct lo_async_attr {
+    struct lo_uring_op op;
+    fuse_req_t req;
+    struct lo_inode *inode;
+    int fd;
+    struct statx stx;
+};
+
+struct lo_async_open {
+    struct lo_uring_op op;
+    fuse_req_t req;
+    struct lo_inode *inode;
+    int ino_fd;
+    struct fuse_file_info fi;
+    char path[64];
+};
+
+struct lo_async_io {
+    struct lo_uring_op op;
+    fuse_req_t req;
+    struct lo_inode *inode;     /* for writes */
+    struct iovec iov;
+    char data[];
+};
+
+static void lo_statx_to_stat(const struct statx *x, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(x->stx_dev_major, x->stx_dev_minor);
+    st->st_ino = x->stx_ino;
+    st->st_mode = x->stx_mode;
+    st->st_nlink = x->stx_nlink;
+    st->st_uid = x->stx_uid;
+    st->st_gid = x->stx_gid;
+    st->st_rdev = makedev(x->stx_rdev_major, x->stx_rdev_minor);
+    st->st_size = x->stx_size;
+    st->st_blksize = x->stx_blksize;
+    st->st_blocks = x->stx_blocks;
+    st->st_atim.tv_sec = x->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = x->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = x->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = x->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = x->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = x->stx_ctime.tv_nsec;
+}
+
+static void lo_getattr_done(struct lo_uring_op *op, int res)
+{
+    struct lo_async_attr *a = (struct lo_async_attr *) op;
+    struct stat buf;
+
+    lo_inode_fd_put(lo_data(a->req), a->inode, a->fd);
+    if (res < 0) {
+        fuse_reply_err(a->req, -res);
+    } else {
+        lo_statx_to_stat(&a->stx, &buf);
+        fuse_reply_attr(a->req, &buf, 1.0);
+    }
+    free(a);
+}
+
+/* on success the completion owns (and puts) fd */
+static int lo_getattr_async(fuse_req_t req, fuse_ino_t ino, int fd)
+{
+    struct lo_async_attr *a;
+    int res;
+
+    a = malloc(sizeof(struct lo_async_attr));
+    if (!a)
+        return -ENOMEM;
+
+    a->op.done = lo_getattr_done;
+    a->req = req;
+    a->inode = lo_inode(req, ino);
+    a->fd = fd;
+    res = lo_uring_statx(&lo_data(req)->uring, &a->op, fd, "",
+                 AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW,
+                 STATX_BASIC_STATS, &a->stx);
+    if (res)
+        free(a);
+    return res;
 }
 
 static void lo_getattr(fuse_req_t req, fuse_ino_t ino,
                  struct fuse_file_info *fi)
 {
     int res;
+    int fd;
     struct stat buf;
     (void) fi;
 
-    res = fstatat(lo_fd(req, ino), "", &buf, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
-    if (res == -1)
+    fd = lo_fd(req, ino);
+    if (fd == -1)
         return (void) fuse_reply_err(req, errno);
 
+    /* the size of compressed files is not the lower one */
+    if (lo_data(req)->async &&
+        !(lo_inode(req, ino)->flags & LO_I_COMPRESS) &&
+        lo_getattr_async(req, ino, fd) == 0)
+        return;
+
+    res = fstatat(fd, "", &buf, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+    if (res == -1)
+        res = errno;
+    lo_fd_put(req, ino, fd);
+    if (res)
+        return (void) fuse_reply_err(req, res);
+    lo_cfile_attr(lo_data(req), lo_inode(req, ino), &buf);
+
     fuse_reply_attr(req, &buf, 1.0);
 }
 
+static size_t lo_hash(ino_t ino, dev_t dev)
+{
+    uint64_t h = (uint64_t) ino ^ ((uint64_t) dev * 0x9e3779b97f4a7c15ULL);
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static int lo_itable_init(struct lo_itable *t, size_t size)
+{
+    t->ents = calloc(size, sizeof(struct lo_itable_ent));
+    if (!t->ents)
+        return -1;
+    t->mask = size - 1;
+    t->count = 0;
+    return 0;
+}
+
+static void lo_itable_place(struct lo_itable *t, struct lo_inode *inode)
+{
+    size_t i = lo_hash(inode->ino, inode->dev) & t->mask;
+
+    while (t->ents[i].inode)
+        i = (i + 1) & t->mask;
+    t->ents[i].ino = inode->ino;
+    t->ents[i].inode = inode;
+    t->count++;
+}
+
+/* called with lo->mutex held */
+static int lo_itable_insert(struct lo_itable *t, struct lo_inode *inode)
+{
+    if ((t->count + 1) * 2 > t->mask + 1) {
+        struct lo_itable old = *t;
+        size_t i;
+
+        if (lo_itable_init(t, (old.mask + 1) * 2) != 0) {
+            *t = old;
+            return -1;
+        }
+        for (i = 0; i <= old.mask; i++) {
+            if (old.ents[i].inode)
+                lo_itable_place(t, old.ents[i].inode);
+        }
+        free(old.ents);
+    }
+    lo_itable_place(t, inode);
+    return 0;
+}
+
+/* called with lo->mutex held, backward shift deletion keeps probe
+   sequences intact without tombstones */
+static void lo_itable_remove(struct lo_itable *t, struct lo_inode *inode)
+{
+    size_t i = lo_hash(inode->ino, inode->dev) & t->mask;
+    size_t j;
+
+    while (t->ents[i].inode != inode)
+        i = (i + 1) & t->mask;
+
+    for (j = (i + 1) & t->mask; t->ents[j].inode; j = (j + 1) & t->mask) {
+        struct lo_inode *p = t->ents[j].inode;
+        size_t home = lo_hash(p->ino, p->dev) & t->mask;
+
+        /* move j into the hole at i unless its home lies in (i, j] */
+        if (((j - home) & t->mask) >= ((j - i) & t->mask)) {
+            t->ents[i] = t->ents[j];
+            i = j;
+        }
+    }
+    t->ents[i].ino = 0;
+    t->ents[i].inode = NULL;
+    t->count--;
+}
+
+/* called with lo->mutex held */
 static struct lo_inode *lo_find(struct lo_data *lo, struct stat *st)
 {
-    struct lo_inode *p;
+    struct lo_itable *t = &lo->itable;
+    size_t i = lo_hash(st->st_ino, st->st_dev) & t->mask;
+
+    for (; t->ents[i].inode; i = (i + 1) & t->mask) {
+        if (t->ents[i].ino == st->st_ino &&
+            t->ents[i].inode->dev == st->st_dev)
+            return t->ents[i].inode;
+    }
+    return NULL;
+}
+
+static void lo_inode_report(struct lo_data *lo, FILE *f)
+{
+    size_t n, slab, table, handles;
+
+    pthread_mutex_lock(&lo->mutex);
+    n = lo->itable.count;
+    table = (lo->itable.mask + 1) * sizeof(struct lo_itable_ent);
+    handles = lo->handle_bytes;
+    pthread_mutex_unlock(&lo->mutex);
+    slab = lo_slab_bytes(&lo->inode_slab);
+
+    fprintf(f, "inodes: %zu cached, %zu bytes each; slab %zu, table %zu, "
+        "handles %zu bytes", n, sizeof(struct lo_inode), slab, table,
+        handles);
+    if (n)
+        fprintf(f, " (%zu bytes/inode)", (slab + table + handles) / n);
+    fprintf(f, "\n");
+}
+
+static struct file_handle *lo_name_to_handle(struct lo_data *lo, int fd)
+{
+    struct file_handle *fh;
+    struct file_handle *shrunk;
+    int mount_id;
+
+    fh = malloc(sizeof(struct file_handle) + MAX_HANDLE_SZ);
+    if (!fh)
+        return NULL;
+
+    fh->handle_bytes = MAX_HANDLE_SZ;
+    if (name_to_handle_at(fd, "", fh, &mount_id, AT_EMPTY_PATH) == -1 ||
+        mount_id != lo->mount_id) {
+        /* not exportable, or on a different mount than the root:
+           such inodes keep pinning their fd */
+        free(fh);
+        return NULL;
+    }
+
+    shrunk = realloc(fh, sizeof(struct file_handle) + fh->handle_bytes);
+    return shrunk ? shrunk : fh;
+}
+
+/* Closes and frees inodes that are already out of the table */
+static void lo_free_many(struct lo_data *lo, struct lo_inode **inodes,
+             size_t n)
+{
+    size_t handle_bytes = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        struct lo_inode *inode = inodes[i];
+
+        if (inode->handle) {
+            lo_fdcache_drop(&lo->fdcache, &inode->fd_slot);
+            handle_bytes += sizeof(struct file_handle) +
+                inode->handle->handle_bytes;
+            free(inode->handle);
+        } else {
+            close(inode->fd);
+        }
+        if (inode->ext) {
+            pthread_mutex_destroy(&inode->ext->lock);
+            free(inode->ext->holes);
+            if (inode->ext->cfile) {
+                lo_cfile_destroy(inode->ext->cfile);
+                free(inode->ext->cfile);
+            }
+            free(inode->ext);
+        }
+    }
+
+    if (handle_bytes) {
+        pthread_mutex_lock(&lo->mutex);
+        lo->handle_bytes -= handle_bytes;
+        pthread_mutex_unlock(&lo->mutex);
+    }
+    lo_slab_free_many(&lo->inode_slab, (void **) inodes, n);
+}
+
+static void lo_free(struct lo_data *lo, struct lo_inode *inode)
+{
+    lo_free_many(lo, &inode, 1);
+}
+
+static void *lo_reaper_thread(void *arg)
+{
+    struct lo_data *lo = arg;
+    struct lo_reaper *r = &lo->reaper;
+    struct lo_inode **batch;
+    size_t n;
+
+    pthread_mutex_lock(&r->lock);
+    for (;;) {
+        while (!r->count && !r->stop)
+            pthread_cond_wait(&r->cond, &r->lock);
+        if (!r->count)
+            break;
 
-    for (p = lo->root.next; p != &lo->root; p = p->next) {
-        if (p->ino == st->st_ino && p->dev == st->st_dev)
-            return p;
+        batch = r->queue;
+        n = r->count;
+        r->queue = NULL;
+        r->count = r->cap = 0;
+        r->batches++;
+        r->reaped += n;
+        pthread_mutex_unlock(&r->lock);
+
+        lo_free_many(lo, batch, n);
+        free(batch);
+
+        pthread_mutex_lock(&r->lock);
     }
+    pthread_mutex_unlock(&r->lock);
     return NULL;
 }
 
+static void lo_reaper_start(struct lo_data *lo)
+{
+    struct lo_reaper *r = &lo->reaper;
+
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    if (pthread_create(&r->thread, NULL, lo_reaper_thread, lo) == 0)
+        r->running = 1;
+    else
+        warnx("failed to start inode reaper, freeing inline");
+}
+
+static void lo_reaper_stop(struct lo_data *lo)
+{
+    struct lo_reaper *r = &lo->reaper;
+
+    if (!r->running)
+        return;
+
+    pthread_mutex_lock(&r->lock);
+    r->stop = 1;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, NULL);
+    r->running = 0;
+    if (lo->debug)
+        fprintf(stderr, "reaper: freed %lu inodes in %lu batches\n",
+            r->reaped, r->batches);
+}
+
+/* Hands unhashed inodes over to the reaper thread */
+static void lo_reap(struct lo_data *lo, struct lo_inode **inodes, size_t n)
+{
+    struct lo_reaper *r = &lo->reaper;
+
+    if (!n)
+        return;
+
+    pthread_mutex_lock(&r->lock);
+    if (r->running && r->count + n > r->cap) {
+        size_t cap = r->cap ? r->cap : 64;
+        struct lo_inode **queue;
+
+        while (cap < r->count + n)
+            cap *= 2;
+        queue = realloc(r->queue, cap * sizeof(struct lo_inode *));
+        if (queue) {
+            r->queue = queue;
+            r->cap = cap;
+        }
+    }
+    if (!r->running || r->count + n > r->cap) {
+        pthread_mutex_unlock(&r->lock);
+        lo_free_many(lo, inodes, n);
+        return;
+    }
+    memcpy(r->queue + r->count, inodes, n * sizeof(struct lo_inode *));
+    r->count += n;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static bool lo_compress_dir(struct lo_data *lo, const struct stat *st)
+{
+    size_t i;
+
+    if (!S_ISDIR(st->st_mode))
+        return false;
+    for (i = 0; i < lo->ncdirs; i++) {
+        if (lo->cdirs[i].ino == st->st_ino && lo->cdirs[i].dev == st->st_dev)
+            return true;
+    }
+    return false;
+}
+
+/* the dictionaries at the root are the daemon's, not part of the tree */
+static bool lo_hidden(fuse_ino_t parent, const char *name)
+{
+    return parent == FUSE_ROOT_ID && strcmp(name, LO_CDICT_DIR) == 0;
+}
+
 static int lo_do_lookup(fuse_req_t req, fuse_ino_t parent, const char *name,
              struct fuse_entry_param *e)
 {
     int newfd;
+    int parent_fd;
     int res;
     int saverr;
+    struct lo_data *lo = lo_data(req);
     struct lo_inode *inode;
 
     memset(e, 0, sizeof(*e));
     e->attr_timeout = 1.0;
     e->entry_timeout = 1.0;
 
-    newfd = openat(lo_fd(req, parent), name, O_PATH | O_NOFOLLOW);
+    if (lo_hidden(parent, name))
+        return ENOENT;
+
+    parent_fd = lo_fd(req, parent);
+    if (parent_fd == -1)
+        return errno;
+
+    newfd = openat(parent_fd, name, O_PATH | O_NOFOLLOW);
+    saverr = errno;
+    lo_fd_put(req, parent, parent_fd);
     if (newfd == -1)
-        goto out_err;
+        return saverr;
 
     res = fstatat(newfd, "", &e->attr, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
     if (res == -1)
         goto out_err;
 
-    inode = lo_find(lo_data(req), &e->attr);
+    pthread_mutex_lock(&lo->mutex);
+    inode = lo_find(lo, &e->attr);
+    if (inode)
+        inode->nlookup++;
+    pthread_mutex_unlock(&lo->mutex);
+
     if (inode) {
         close(newfd);
         newfd = -1;
     } else {
-        struct lo_inode *prev = &lo_data(req)->root;
-        struct lo_inode *next = prev->next;
-        saverr = ENOMEM;
-        inode = calloc(1, sizeof(struct lo_inode));
-        if (!inode)
+        struct lo_inode *found;
+
+        inode = lo_slab_alloc(&lo->inode_slab);
+        if (!inode) {
+            errno = ENOMEM;
             goto out_err;
+        }
 
         inode->fd = newfd;
         inode->ino = e->attr.st_ino;
         inode->dev = e->attr.st_dev;
-
-        next->prev = inode;
-        inode->next = next;
-        inode->prev = prev;
-        prev->next = inode;
+        inode->nlookup = 1;
+        inode->flags = lo_inode(req, parent)->flags & LO_I_INHERIT;
+        if (lo_compress_dir(lo, &e->attr))
+            inode->flags |= LO_I_COMPRESS | LO_I_DAEMON_IO;
+
+        if (lo->fhandle)
+            inode->handle = lo_name_to_handle(lo, newfd);
+        if (inode->handle)
+            inode->fd_slot = -1;
+
+        /* another lookup of the same inode may have won the race */
+        pthread_mutex_lock(&lo->mutex);
+        found = lo_find(lo, &e->attr);
+        if (found) {
+            found->nlookup++;
+        } else if (lo_itable_insert(&lo->itable, inode) != 0) {
+            pthread_mutex_unlock(&lo->mutex);
+            free(inode->handle);
+            lo_slab_free(&lo->inode_slab, inode);
+            errno = ENOMEM;
+            goto out_err;
+        } else if (inode->handle) {
+            lo->handle_bytes += sizeof(struct file_handle) +
+                inode->handle->handle_bytes;
+        }
+        pthread_mutex_unlock(&lo->mutex);
+
+        if (found) {
+            free(inode->handle);
+            lo_slab_free(&lo->inode_slab, inode);
+            close(newfd);
+            inode = found;
+        } else if (inode->handle) {
+            /* keep the fd we already have as first cache entry */
+            lo_fdcache_add(&lo->fdcache, &inode->fd_slot, newfd);
+        }
+        newfd = -1;
     }
-    inode->nlookup++;
     e->ino = (uintptr_t) inode;
+    lo_cfile_attr(lo, inode, &e->attr);
 
     if (lo_debug(req))
         fprintf(stderr, "  %lli/%s -> %lli\n",
@@ -226,45 +1171,98 @@ static void lo_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
         fuse_reply_entry(req, &e);
 }
 
-static void lo_free(struct lo_inode *inode)
+/* called with lo->mutex held, returns true if the inode was unhashed
+   and must be freed by the caller */
+static bool lo_forget_one(fuse_req_t req, struct lo_inode *inode,
+              uint64_t nlookup)
 {
-    struct lo_inode *prev = inode->prev;
-    struct lo_inode *next = inode->next;
-
-    next->prev = prev;
-    prev->next = next;
-    close(inode->fd);
-    free(inode);
-}
-
-static void lo_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
-{
-    struct lo_inode *inode = lo_inode(req, ino);
+    struct lo_data *lo = lo_data(req);
 
     if (lo_debug(req)) {
         fprintf(stderr, "  forget %lli %lli -%lli\n",
-            (unsigned long long) ino, (unsigned long long) inode->nlookup,
+            (unsigned long long) (uintptr_t) inode,
+            (unsigned long long) inode->nlookup,
             (unsigned long long) nlookup);
     }
 
     assert(inode->nlookup >= nlookup);
     inode->nlookup -= nlookup;
+    if (inode->nlookup || inode == &lo->root)
+        return false;
+
+    lo_itable_remove(&lo->itable, inode);
+    return true;
+}
+
+static void lo_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+    struct lo_data *lo = lo_data(req);
+    struct lo_inode *inode = lo_inode(req, ino);
+    bool dead;
+
+    pthread_mutex_lock(&lo->mutex);
+    dead = lo_forget_one(req, inode, nlookup);
+    pthread_mutex_unlock(&lo->mutex);
+
+    fuse_reply_none(req);
+    if (dead)
+        lo_reap(lo, &inode, 1);
+}
 
-    if (!inode->nlookup)
-        lo_free(inode);
+/* The whole batch is applied under one lock acquisition; the inodes
+   that died are closed and freed later by the reaper thread. */
+static void lo_forget_multi(fuse_req_t req, size_t count,
+                struct fuse_forget_data *forgets)
+{
+    struct lo_data *lo = lo_data(req);
+    struct lo_inode **dead;
+    size_t ndead = 0;
+    size_t i;
+
+    if (lo_debug(req))
+        fprintf(stderr, "lo_forget_multi(count=%zu)\n", count);
+
+    dead = malloc(count * sizeof(struct lo_inode *));
+
+    pthread_mutex_lock(&lo->mutex);
+    for (i = 0; i < count; i++) {
+        struct lo_inode *inode = lo_inode(req, forgets[i].ino);
+
+        if (!lo_forget_one(req, inode, forgets[i].nlookup))
+            continue;
+        if (dead) {
+            dead[ndead++] = inode;
+        } else {
+            /* no memory for the batch, free it right here */
+            pthread_mutex_unlock(&lo->mutex);
+            lo_free(lo, inode);
+            pthread_mutex_lock(&lo->mutex);
+        }
+    }
+    pthread_mutex_unlock(&lo->mutex);
 
     fuse_reply_none(req);
+    lo_reap(lo, dead, ndead);
+    free(dead);
 }
 
 static void lo_readlink(fuse_req_t req, fuse_ino_t ino)
 {
     char buf[PATH_MAX + 1];
     int res;
+    int fd;
+    int saverr;
 
-    res = readlinkat(lo_fd(req, ino), "", buf, sizeof(buf));
-    if (res == -1)
+    fd = lo_fd(req, ino);
+    if (fd == -1)
         return (void) fuse_reply_err(req, errno);
 
+    res = readlinkat(fd, "", buf, sizeof(buf));
+    saverr = errno;
+    lo_fd_put(req, ino, fd);
+    if (res == -1)
+        return (void) fuse_reply_err(req, saverr);
+
     if (res == sizeof(buf))
         return (void) fuse_reply_err(req, ENAMETOOLONG);
 
@@ -285,16 +1283,189 @@ static struct lo_dirp *lo_dirp(struct fuse_file_info *fi)
     return (struct lo_dirp *) (uintptr_t) fi->fh;
 }
 
+/* An open regular file. The stream fields are only hints and are
+   updated without locking, concurrent reads on the same open may at
+   worst cost a missed or a redundant fadvise. */
+struct lo_file {
+    int fd;
+    int passthrough;    /* served by the kernel from a backing file */
+    int keep_cache;
+    int writable;
+    off_t next;         /* where a sequential read would continue */
+    unsigned int seq;   /* sequential reads in a row */
+    off_t dropped;      /* lower cache dropped up to here */
+    off_t ahead;        /* lower readahead issued up to here */
+    off_t pushed;       /* stored into the kernel cache up to here */
+    uint64_t write_gen; /* of the inode when opened */
+    int prefetching;    /* a prefetch is queued or running */
+    struct lo_pool_group prefetch_group;
+};
+
+static struct lo_file *lo_file(struct fuse_file_info *fi)
+{
+    return (struct lo_file *) (uintptr_t) fi->fh;
+}
+
+/* takes ownership of fd, closing it on failure */
+static int lo_file_new(struct fuse_file_info *fi, int fd)
+{
+    struct lo_file *f = calloc(1, sizeof(struct lo_file));
+
+    if (!f) {
+        close(fd);
+        return ENOMEM;
+    }
+    f->fd = fd;
+    lo_pool_group_init(&f->prefetch_group);
+    fi->fh = (uintptr_t) f;
+    return 0;
+}
+
+/* Waits for the prefetches of an open. Release does it first: they
+   use the fd and the compressed file the last release frees, and must
+   not store into the inode once it may have been forgotten. */
+static void lo_file_wait(struct lo_data *lo, struct fuse_file_info *fi)
+{
+    lo_pool_wait(&lo->pool, &lo_file(fi)->prefetch_group);
+}
+
+/* no prefetch may be left, see lo_file_wait() */
+static void lo_file_free(struct fuse_file_info *fi)
+{
+    struct lo_file *f = lo_file(fi);
+
+    lo_pool_group_destroy(&f->prefetch_group);
+    close(f->fd);
+    free(f);
+}
+
+/* the compressed file of an open inode, NULL for plain files */
+static struct lo_cfile *lo_cfile_of(struct lo_inode *inode)
+{
+    if (!inode->ext)
+        return NULL;
+    return __atomic_load_n(&inode->ext->cfile, __ATOMIC_ACQUIRE);
+}
+
+/* pread() of the contents of an open file */
+static ssize_t lo_file_pread(struct lo_inode *inode, struct lo_file *f,
+                 char *buf, size_t size, off_t off)
+{
+    struct lo_cfile *c = lo_cfile_of(inode);
+    ssize_t res;
+
+    if (!c)
+        return pread(f->fd, buf, size, off);
+    res = lo_cfile_pread(c, f->fd, buf, size, off);
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+    return res;
+}
+
+/* Prefetching reads a window of the lower file on the worker pool and
+   pushes it into the kernel's page cache of the inode with
+   fuse_lowlevel_notify_store(), so that the reads that follow never
+   reach the daemon. Only done for keep_cache opens, the kernel drops
+   the cache on the next open otherwise. */
+struct lo_prefetch {
+    struct lo_pool_task task;   /* first, tasks are cast back */
+    struct lo_data *lo;
+    struct lo_inode *inode;
+    struct lo_file *f;
+    off_t off;
+    size_t len;
+};
+
+static void lo_prefetch_run(struct lo_pool_task *t)
+{
+    struct lo_prefetch *p = (struct lo_prefetch *) t;
+    struct lo_inode_ext *ext = p->inode->ext;
+    struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(0);
+    uint64_t gen;
+    ssize_t res;
+    char *buf;
+
+    gen = __atomic_load_n(&ext->write_gen, __ATOMIC_RELAXED);
+    buf = malloc(p->len);
+    if (!buf)
+        goto out;
+    res = lo_file_pread(p->inode, p->f, buf, p->len, p->off);
+    /* storing past EOF would extend the file in the kernel, pread
+       stops there; data a write overtook must not be stored either */
+    if (res > 0 && gen == __atomic_load_n(&ext->write_gen,
+                          __ATOMIC_RELAXED)) {
+        bufv.buf[0].mem = buf;
+        bufv.buf[0].size = res;
+        if (fuse_lowlevel_notify_store(p->lo->se,
+                           (uintptr_t) p->inode, p->off,
+                           &bufv, 0) == 0) {
+            __atomic_fetch_add(&p->lo->prefetch_ops, 1,
+                       __ATOMIC_RELAXED);
+            __atomic_fetch_add(&p->lo->prefetch_bytes, res,
+                       __ATOMIC_RELAXED);
+        }
+        /* A write that came in between the check and the store may
+           have had its pages overwritten with what was there before.
+           Its gen is bumped before the reply, and the store waits for
+           the pages the write holds locked until then, so looking
+           again catches it; the range is dropped for reads to fetch
+           again. */
+        if (gen != __atomic_load_n(&ext->write_gen, __ATOMIC_RELAXED))
+            fuse_lowlevel_notify_inval_inode(p->lo->se,
+                             (uintptr_t) p->inode,
+                             p->off, res);
+    }
+    free(buf);
+out:
+    __atomic_store_n(&p->f->prefetching, 0, __ATOMIC_RELEASE);
+    free(p);
+}
+
+/* queues a prefetch unless one of this open is still in flight */
+static void lo_prefetch(struct lo_data *lo, struct lo_inode *inode,
+            struct lo_file *f, off_t off, size_t len)
+{
+    struct lo_prefetch *p;
+
+    if (!f->keep_cache || !lo->pool.threads || !lo->se || !inode->ext ||
+        __atomic_exchange_n(&f->prefetching, 1, __ATOMIC_ACQUIRE))
+        return;
+
+    p = malloc(sizeof(struct lo_prefetch));
+    if (!p) {
+        __atomic_store_n(&f->prefetching, 0, __ATOMIC_RELEASE);
+        return;
+    }
+    p->lo = lo;
+    p->inode = inode;
+    p->f = f;
+    p->off = off;
+    p->len = len;
+    f->pushed = off + len;
+    lo_pool_submit(&lo->pool, &f->prefetch_group, &p->task,
+               lo_prefetch_run);
+}
+
 static void lo_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
     int error = ENOMEM;
+    int fd;
     struct lo_dirp *d = calloc(1, sizeof(struct lo_dirp));
     if (d == NULL)
         goto out_err;
 
-    d->fd = openat(lo_fd(req, ino), ".", O_RDONLY);
-    if (d->fd == -1)
+    fd = lo_fd(req, ino);
+    if (fd == -1) {
+        d->fd = -1;
         goto out_errno;
+    }
+    d->fd = openat(fd, ".", O_RDONLY);
+    error = errno;
+    lo_fd_put(req, ino, fd);
+    if (d->fd == -1)
+        goto out_err;
 
     d->dp = fdopendir(d->fd);
     if (d->dp == NULL)
@@ -327,8 +1498,6 @@ static void lo_do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
     size_t rem;
     int err;
 
-    (void) ino;
-
     buf = calloc(size, 1);
     if (!buf)
         return (void) fuse_reply_err(req, ENOMEM);
@@ -356,6 +1525,11 @@ static void lo_do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
             }
         }
         nextoff = telldir(d->dp);
+        if (lo_hidden(ino, d->entry->d_name)) {
+            d->entry = NULL;
+            d->offset = nextoff;
+            continue;
+        }
         if (plus) {
             struct fuse_entry_param e;
 
@@ -415,35 +1589,693 @@ static void lo_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info
     fuse_reply_err(req, 0);
 }
 
+/* Registers the lower fd as backing file, so that the kernel serves
+   read/write on this open without calling into the daemon. All opens
+   of an inode share one backing id. */
+static void lo_passthrough_open(fuse_req_t req, struct lo_inode_ext *ext,
+                struct fuse_file_info *fi)
+{
+#ifdef FUSE_CAP_PASSTHROUGH
+    struct lo_data *lo = lo_data(req);
+    int backing_id;
+
+    if (!ext->backing_id) {
+        backing_id = fuse_passthrough_open(req, lo_file(fi)->fd);
+        if (backing_id <= 0) {
+            /* typically EPERM: needs CAP_SYS_ADMIN, stop trying */
+            fprintf(stderr, "passthrough: cannot register backing file "
+                "(%d), falling back to daemon I/O\n", backing_id);
+            lo->passthrough = 0;
+            return;
+        }
+        ext->backing_id = backing_id;
+    }
+    fi->backing_id = ext->backing_id;
+    lo_file(fi)->passthrough = 1;
+#else
+    (void) req;
+    (void) ext;
+    (void) fi;
+#endif
+}
+
+/* A file is only treated as sparse if it was so when last opened. The
+   hole map survives reopens, and is used by reads, as long as the
+   lower file has the size and mtime it was built with (see
+   lo_read_sparse()). Called with ext->lock. */
+static void lo_holes_opened(struct lo_inode_ext *ext, const struct stat *st)
+{
+    struct lo_holemap *map = ext->holes;
+
+    if (!st || !S_ISREG(st->st_mode)) {
+        ext->sparse = 0;
+        return;
+    }
+    ext->sparse = (off_t) st->st_blocks * 512 < st->st_size;
+    if (map && (!ext->sparse || map->size != st->st_size ||
+            map->mtime.tv_sec != st->st_mtim.tv_sec ||
+            map->mtime.tv_nsec != st->st_mtim.tv_nsec)) {
+        ext->holes = NULL;
+        ext->holes_gen++;
+        free(map);
+    }
+}
+
+/* Called after data was written through the mount and before the
+   reply, so that no reader uses a hole map missing the new extents
+   and no prefetch stores what it read before the write. */
+static void lo_inode_written(struct lo_inode *inode)
+{
+    struct lo_inode_ext *ext = inode->ext;
+    struct lo_holemap *map;
+
+    if (!ext)
+        return;
+    __atomic_fetch_add(&ext->write_gen, 1, __ATOMIC_RELAXED);
+    if (!__atomic_load_n(&ext->sparse, __ATOMIC_RELAXED))
+        return;
+
+    pthread_mutex_lock(&ext->lock);
+    ext->holes_gen++;
+    map = ext->holes;
+    ext->holes = NULL;
+    pthread_mutex_unlock(&ext->lock);
+    free(map);
+}
+
+static void lo_cache_record(struct lo_inode_ext *ext, const struct stat *st)
+{
+    ext->cache_valid = 1;
+    ext->cache_size = st->st_size;
+    ext->cache_mtime = st->st_mtim;
+    ext->cache_ctime = st->st_ctim;
+}
+
+/* keep_cache=auto: the kernel's pages are still good if size, mtime
+   and ctime of the lower file are what they were when it last opened
+   or a writer closed it. Without a record the kernel inode is new and
+   has no pages to lose. Called with ext->lock. */
+static bool lo_cache_opened(struct lo_inode_ext *ext, const struct stat *st)
+{
+    bool keep;
+
+    if (!st) {
+        ext->cache_valid = 0;
+        return false;
+    }
+    keep = !ext->cache_valid ||
+        (ext->cache_size == st->st_size &&
+         lo_ts_equal(&ext->cache_mtime, &st->st_mtim) &&
+         lo_ts_equal(&ext->cache_ctime, &st->st_ctim));
+    lo_cache_record(ext, st);
+    return keep;
+}
+
+/* The lower file of a compressed one is read back to rewrite partial
+   chunks and written at offsets of our choosing. */
+static void lo_cfile_open_flags(struct fuse_file_info *fi)
+{
+    if ((fi->flags & O_ACCMODE) == O_WRONLY) {
+        fi->flags &= ~O_ACCMODE;
+        fi->flags |= O_RDWR;
+    }
+    fi->flags &= ~(O_APPEND | O_DIRECT);
+}
+
+/* The dictionary new files in the directory dirfd are compressed with,
+   NULL if it has none */
+static const struct lo_cdict *lo_dir_dict(struct lo_data *lo, int dirfd)
+{
+    const struct lo_cdict *dict;
+    char procname[64];
+    char val[32];
+    ssize_t len;
+
+    sprintf(procname, "/proc/self/fd/%i", dirfd);
+    len = getxattr(procname, LO_CDICT_XATTR, val, sizeof(val) - 1);
+    if (len <= 0)
+        return NULL;
+    val[len] = '\0';
+    dict = lo_cdicts_get(&lo->cdicts, strtoull(val, NULL, 16));
+    if (!dict && lo->debug)
+        fprintf(stderr, "lo_dir_dict: dictionary %s: %s\n", val,
+            strerror(errno));
+    return dict;
+}
+
+/* Loads a compressed file on its first open, or formats an empty one
+   opened for writing. Non-empty plain files in a compressed directory,
+   e.g. from before it was configured, stay plain. Called with
+   ext->lock, in the same section that counts the open so that a last
+   release cannot free it in between. */
+static int lo_cfile_opened(struct lo_data *lo, struct lo_inode_ext *ext,
+               struct lo_file *f, struct fuse_file_info *fi)
+{
+    struct lo_cfile *c;
+    struct stat st;
+    int res;
+
+    if (fstat(f->fd, &st) == -1)
+        return errno;
+    if (!S_ISREG(st.st_mode))
+        return 0;
+
+    if (ext->cfile) {
+        /* the lower open emptied it already */
+        if (fi->flags & O_TRUNC)
+            return -lo_cfile_reset(ext->cfile, f->fd);
+        return 0;
+    }
+    if (st.st_size == 0 && !f->writable)
+        return 0;
+
+    c = malloc(sizeof(struct lo_cfile));
+    if (!c)
+        return ENOMEM;
+    if (st.st_size == 0) {
+        res = lo_cfile_init(c, f->fd, lo->chunk_shift);
+        if (res == 0)
+            res = 1;
+    } else {
+        res = lo_cfile_load(c, f->fd);
+    }
+    if (res == 1 && c->dict_id) {
+        c->dict = lo_cdicts_get(&lo->cdicts, c->dict_id);
+        if (!c->dict) {
+            fprintf(stderr, "lo_open: dictionary %016llx: %s\n",
+                (unsigned long long) c->dict_id, strerror(errno));
+            lo_cfile_destroy(c);
+            res = -EIO;
+        }
+    }
+    if (res == 1) {
+        c->cache = lo->ccache.nshards ? &lo->ccache : NULL;
+        c->pool = lo->pool.threads ? &lo->pool : NULL;
+        __atomic_store_n(&ext->cfile, c, __ATOMIC_RELEASE);
+        return 0;
+    }
+    free(c);
+    return -res;
+}
+
+/* Accounts a new open of the inode and picks its I/O path. Fails only
+   if a compressed file cannot be loaded. */
+static int lo_file_opened(fuse_req_t req, struct lo_inode *inode,
+              struct fuse_file_info *fi)
+{
+    struct lo_data *lo = lo_data(req);
+    struct lo_inode_ext *ext = lo_inode_ext(lo, inode);
+    struct lo_file *f = lo_file(fi);
+    struct lo_cfile *c;
+    struct stat st;
+    bool have_st;
+    off_t size;
+    int err;
+
+    fi->keep_cache = lo->keep_cache == LO_KC_ALWAYS;
+    f->keep_cache = fi->keep_cache;
+    f->writable = (fi->flags & O_ACCMODE) != O_RDONLY;
+    f->write_gen = 0;
+
+    if (!ext)
+        return inode->flags & LO_I_COMPRESS ? ENOMEM : 0;
+
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 13)
+    /* let non-extending O_DIRECT writes to this file run concurrently
+       in the kernel instead of serializing on the inode lock */
+    if (lo->parallel_direct_writes)
+        fi->parallel_direct_writes = 1;
+#endif
+
+    pthread_mutex_lock(&ext->lock);
+    if (inode->flags & LO_I_COMPRESS) {
+        err = lo_cfile_opened(lo, ext, f, fi);
+        if (err) {
+            pthread_mutex_unlock(&ext->lock);
+            return err;
+        }
+    }
+    ext->nopen++;
+    if (lo->passthrough && !(inode->flags & LO_I_DAEMON_IO))
+        lo_passthrough_open(req, ext, fi);
+    pthread_mutex_unlock(&ext->lock);
+
+    /* the kernel serves passthrough opens by itself */
+    if (f->passthrough)
+        return 0;
+
+    have_st = fstat(f->fd, &st) == 0;
+    c = lo_cfile_of(inode);
+    size = have_st ? st.st_size : 0;
+    if (c)
+        size = lo_cfile_size(c);
+    pthread_mutex_lock(&ext->lock);
+    /* compressed files have no holes the lower file knows of */
+    lo_holes_opened(ext, have_st && !c ? &st : NULL);
+    if (lo->keep_cache == LO_KC_AUTO) {
+        fi->keep_cache = lo_cache_opened(ext, have_st ? &st : NULL);
+        f->keep_cache = fi->keep_cache;
+    }
+    f->write_gen = ext->write_gen;
+    pthread_mutex_unlock(&ext->lock);
+
+    if (lo->keep_cache == LO_KC_AUTO)
+        __atomic_fetch_add(fi->keep_cache ? &lo->cache_kept :
+                   &lo->cache_dropped, 1, __ATOMIC_RELAXED);
+
+    /* small files read from the start are usually read whole */
+    if (have_st && S_ISREG(st.st_mode) && size &&
+        (size_t) size <= lo->prefetch && !f->writable)
+        lo_prefetch(lo, inode, f, 0, size);
+    return 0;
+}
+
+/* Frees the compressed file of an inode the last open is gone of,
+   keeping its header for getattr. Called with ext->lock. */
+static void lo_cfile_closed(struct lo_inode_ext *ext, int fd)
+{
+    struct lo_cfile *c = ext->cfile;
+    struct stat st;
+
+    if (!c->dirty && fstat(fd, &st) == 0)
+        lo_hdr_record(ext, &st, c->size, c->nchunks);
+    __atomic_store_n(&ext->cfile, NULL, __ATOMIC_RELAXED);
+    lo_cfile_destroy(c);
+    free(c);
+}
+
+static void lo_file_released(fuse_req_t req, struct lo_inode *inode,
+                 struct fuse_file_info *fi)
+{
+    struct lo_inode_ext *ext = inode->ext;
+    struct lo_file *f = lo_file(fi);
+    struct lo_cfile *c;
+    struct stat st;
+    int err;
+
+    if (!ext)
+        return;
+
+    /* only writers dirty it and each flushes on its way out, so the
+       last release finds nothing left to write; the small overwrites
+       they left as deltas are merged into their chunks first */
+    c = lo_cfile_of(inode);
+    if (c && f->writable && (err = lo_cfile_merge(c, f->fd)) != 0)
+        fprintf(stderr, "lo_release: cannot merge chunk deltas: %s\n",
+            strerror(-err));
+    if (c && f->writable && (err = lo_cfile_flush(c, f->fd)) != 0)
+        fprintf(stderr, "lo_release: cannot write chunk index: %s\n",
+            strerror(-err));
+
+    /* writes through the mount went through the kernel's cache too,
+       they must not make the next open drop it */
+    if (lo_data(req)->keep_cache == LO_KC_AUTO && !f->passthrough &&
+        __atomic_load_n(&ext->write_gen, __ATOMIC_RELAXED) != f->write_gen &&
+        fstat(f->fd, &st) == 0) {
+        pthread_mutex_lock(&ext->lock);
+        lo_cache_record(ext, &st);
+        pthread_mutex_unlock(&ext->lock);
+    }
+
+    pthread_mutex_lock(&ext->lock);
+    if (--ext->nopen == 0 && ext->backing_id) {
+#ifdef FUSE_CAP_PASSTHROUGH
+        fuse_passthrough_close(req, ext->backing_id);
+#endif
+        ext->backing_id = 0;
+    }
+    if (ext->nopen == 0 && ext->cfile)
+        lo_cfile_closed(ext, f->fd);
+    pthread_mutex_unlock(&ext->lock);
+}
+
+/* garbage a compressed file must have before it is punched out */
+#define LO_COMPACT_GARBAGE (256 * 1024)
+
+/* Waits secs or until stop, returns true on stop */
+static bool lo_compact_sleep(struct lo_compactor *k, double secs)
+{
+    struct timespec until;
+    bool stop;
+
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    until.tv_sec += (time_t) secs;
+    until.tv_nsec += (long) ((secs - (time_t) secs) * 1e9);
+    if (until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&k->lock);
+    while (!k->stop &&
+           pthread_cond_timedwait(&k->cond, &k->lock, &until) != ETIMEDOUT)
+        ;
+    stop = k->stop;
+    pthread_mutex_unlock(&k->lock);
+    return stop;
+}
+
+/* Takes bytes out of the bucket, which holds one second's worth at
+   most, and sleeps off what it owes. Returns true on stop. */
+static bool lo_compact_take(struct lo_data *lo, size_t bytes)
+{
+    struct lo_compactor *k = &lo->compactor;
+    double rate = lo->compact_rate * 1024.0;
+    struct timespec now;
+
+    if (!rate)
+        return __atomic_load_n(&k->stop, __ATOMIC_RELAXED);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    k->tokens += rate * (now.tv_sec - k->refilled.tv_sec +
+                 (now.tv_nsec - k->refilled.tv_nsec) / 1e9);
+    k->refilled = now;
+    if (k->tokens > rate)
+        k->tokens = rate;
+    k->tokens -= bytes;
+    if (k->tokens >= 0)
+        return __atomic_load_n(&k->stop, __ATOMIC_RELAXED);
+    return lo_compact_sleep(k, -k->tokens / rate);
+}
+
+/*
+ * Stores the chunks of a compressed file that the write path took
+ * shortcuts with again, then punches its garbage out of the lower file
+ * (lo_cfile_recompress(), lo_cfile_punch()). Only files nobody wrote to
+ * since the previous pass are cold enough, and files a pass left with
+ * nothing to do are skipped until they are written to again. The file
+ * is opened like any other, sharing the lo_cfile of opens through the
+ * mount, whose lock it only holds for one chunk at a time.
+ */
+static void lo_compact_file(struct lo_data *lo, struct lo_inode *inode)
+{
+    struct lo_compactor *k = &lo->compactor;
+    struct lo_file f = { .fd = -1, .writable = 1 };
+    struct fuse_file_info fi = { .flags = O_RDWR };
+    struct lo_inode_ext *ext;
+    struct lo_cfile_hdr h;
+    struct lo_cfile *c = NULL;
+    struct stat st;
+    char procname[64];
+    bool cached = false, clean;
+    uint64_t idx = 0;
+    ssize_t res = 0;
+    int ino_fd;
+
+    ext = lo_inode_ext(lo, inode);
+    if (!ext)
+        return;
+    ino_fd = lo_inode_fd_get(lo, inode);
+    if (ino_fd == -1)
+        return;
+    /* opening anything but a regular file may have side effects */
+    if (fstat(ino_fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size > LO_CFILE_HDR_SIZE) {
+        pthread_mutex_lock(&ext->lock);
+        clean = ext->compact_clean && ext->write_gen == ext->compact_gen &&
+            ext->compact_size == st.st_size &&
+            lo_ts_equal(&ext->compact_mtime, &st.st_mtim);
+        pthread_mutex_unlock(&ext->lock);
+        if (!clean) {
+            sprintf(procname, "/proc/self/fd/%i", ino_fd);
+            f.fd = open(procname, O_RDWR);
+        }
+    }
+    lo_inode_fd_put(lo, inode, ino_fd);
+    if (f.fd == -1)
+        return;
+    if (lo_compact_take(lo, LO_CFILE_HDR_SIZE) ||
+        lo_cfile_read_hdr(f.fd, &h) != 1)
+        goto out;
+    /* what loading it reads, if no open has it loaded already */
+    if (lo_compact_take(lo, h.nchunks * sizeof(struct lo_cfile_ent) +
+                (uint64_t) h.ndeltas * sizeof(struct lo_cfile_delta)))
+        goto out;
+
+    pthread_mutex_lock(&ext->lock);
+    if (ext->write_gen == ext->compact_gen &&
+        lo_cfile_opened(lo, ext, &f, &fi) == 0 && ext->cfile) {
+        c = ext->cfile;
+        ext->nopen++;
+        /* compaction changes the lower file, not what the kernel has */
+        cached = ext->cache_valid && ext->cache_size == st.st_size &&
+            lo_ts_equal(&ext->cache_mtime, &st.st_mtim) &&
+            lo_ts_equal(&ext->cache_ctime, &st.st_ctim);
+    }
+    ext->compact_gen = ext->write_gen;
+    ext->compact_clean = 0;
+    pthread_mutex_unlock(&ext->lock);
+    if (!c)
+        goto out;
+
+    /* nothing stored again and no garbage worth punching leaves it
+       clean */
+    clean = true;
+    while ((res = lo_cfile_recompress(c, f.fd, &idx)) > 0) {
+        k->chunks++;
+        clean = false;
+        if (lo_compact_take(lo, res))
+            break;
+    }
+    if (res >= 0 && !k->no_punch &&
+        lo_cfile_garbage(c) >= LO_COMPACT_GARBAGE) {
+        res = lo_cfile_punch(c, f.fd);
+        if (res > 0)
+            k->freed += res;
+        if (res == -EOPNOTSUPP) {
+            fprintf(stderr, "compact: the lower filesystem cannot "
+                "punch holes, only recompressing from now on\n");
+            k->no_punch = 1;
+            res = 0;
+        }
+    } else if (res >= 0) {
+        res = lo_cfile_flush(c, f.fd);
+    }
+    if (res < 0)
+        fprintf(stderr, "compact: inode %llu: %s\n",
+            (unsigned long long) inode->ino, strerror(-res));
+    clean = clean && res >= 0 &&
+        (k->no_punch || lo_cfile_garbage(c) < LO_COMPACT_GARBAGE);
+    k->files++;
+
+    pthread_mutex_lock(&ext->lock);
+    if (fstat(f.fd, &st) == 0 && ext->write_gen == ext->compact_gen) {
+        if (cached)
+            lo_cache_record(ext, &st);
+        ext->compact_clean = clean;
+        ext->compact_size = st.st_size;
+        ext->compact_mtime = st.st_mtim;
+    }
+    if (--ext->nopen == 0 && ext->cfile)
+        lo_cfile_closed(ext, f.fd);
+    pthread_mutex_unlock(&ext->lock);
+out:
+    close(f.fd);
+}
+
+/* Pins the compressed inodes of the table as a lookup would, so that
+   they stay while a pass works through them */
+static size_t lo_compact_collect(struct lo_data *lo, struct lo_inode ***out)
+{
+    struct lo_inode **inodes;
+    size_t n = 0, i;
+
+    pthread_mutex_lock(&lo->mutex);
+    inodes = malloc((lo->itable.count + 1) * sizeof(*inodes));
+    for (i = 0; inodes && i <= lo->itable.mask; i++) {
+        struct lo_inode *inode = lo->itable.ents[i].inode;
+
+        if (inode && (inode->flags & LO_I_COMPRESS)) {
+            inode->nlookup++;
+            inodes[n++] = inode;
+        }
+    }
+    pthread_mutex_unlock(&lo->mutex);
+    *out = inodes;
+    return n;
+}
+
+/* Drops a reference taken with nlookup++ outside of a lookup */
+static void lo_inode_unpin(struct lo_data *lo, struct lo_inode *inode)
+{
+    bool dead;
+
+    pthread_mutex_lock(&lo->mutex);
+    dead = --inode->nlookup == 0;
+    if (dead)
+        lo_itable_remove(&lo->itable, inode);
+    pthread_mutex_unlock(&lo->mutex);
+    if (dead)
+        lo_reap(lo, &inode, 1);
+}
+
+static void *lo_compact_thread(void *arg)
+{
+    struct lo_data *lo = arg;
+    struct lo_compactor *k = &lo->compactor;
+    struct lo_inode **inodes;
+    size_t n, i;
+
+    clock_gettime(CLOCK_MONOTONIC, &k->refilled);
+    while (!lo_compact_sleep(k, lo->compact)) {
+        n = lo_compact_collect(lo, &inodes);
+        for (i = 0; i < n; i++) {
+            if (!__atomic_load_n(&k->stop, __ATOMIC_RELAXED))
+                lo_compact_file(lo, inodes[i]);
+            lo_inode_unpin(lo, inodes[i]);
+        }
+        free(inodes);
+        k->passes++;
+    }
+    return NULL;
+}
+
+static void lo_compact_start(struct lo_data *lo)
+{
+    struct lo_compactor *k = &lo->compactor;
+    pthread_condattr_t attr;
+
+    pthread_mutex_init(&k->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&k->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&k->thread, NULL, lo_compact_thread, lo) == 0)
+        k->running = 1;
+    else
+        warnx("failed to start compaction thread");
+}
+
+static void lo_compact_stop(struct lo_data *lo)
+{
+    struct lo_compactor *k = &lo->compactor;
+
+    if (!k->running)
+        return;
+
+    pthread_mutex_lock(&k->lock);
+    __atomic_store_n(&k->stop, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&k->cond);
+    pthread_mutex_unlock(&k->lock);
+    pthread_join(k->thread, NULL);
+    k->running = 0;
+    if (lo->debug)
+        fprintf(stderr, "compact: %lu passes, %lu files, %lu chunks "
+            "stored again, %llu bytes punched out\n", k->passes,
+            k->files, k->chunks, (unsigned long long) k->freed);
+}
+
 static void lo_create(fuse_req_t req, fuse_ino_t parent, const char *name,
               mode_t mode, struct fuse_file_info *fi)
 {
+    struct lo_data *lo = lo_data(req);
+    const struct lo_cdict *dict = NULL;
+    struct lo_inode *inode;
+    struct lo_cfile *c;
     int fd;
+    int parent_fd;
     struct fuse_entry_param e;
     int err;
+    bool dead;
+    bool compress = lo_inode(req, parent)->flags & LO_I_COMPRESS;
 
     if (lo_debug(req))
         fprintf(stderr, "lo_create(parent=%" PRIu64 ", name=%s)\n",
             parent, name);
-            
-    fd = openat(lo_fd(req, parent), name,
+
+    if (lo_hidden(parent, name))
+        return (void) fuse_reply_err(req, EACCES);
+
+    if (compress)
+        lo_cfile_open_flags(fi);
+
+    parent_fd = lo_fd(req, parent);
+    if (parent_fd == -1)
+        return (void) fuse_reply_err(req, errno);
+    if (compress)
+        dict = lo_dir_dict(lo, parent_fd);
+
+    fd = openat(parent_fd, name,
             (fi->flags | O_CREAT) & ~O_NOFOLLOW, mode);
+    err = errno;
+    lo_fd_put(req, parent, parent_fd);
     if (fd == -1)
-        return (void) fuse_reply_err(req, errno);
+        return (void) fuse_reply_err(req, err);
 
-    fi->fh = fd;
+    err = lo_file_new(fi, fd);
+    if (err)
+        return (void) fuse_reply_err(req, err);
 
     err = lo_do_lookup(req, parent, name, &e);
-    if (err)
-        fuse_reply_err(req, err);
+    if (err) {
+        lo_file_free(fi);
+        return (void) fuse_reply_err(req, err);
+    }
+
+    inode = (struct lo_inode *) (uintptr_t) e.ino;
+    err = lo_file_opened(req, inode, fi);
+    if (err) {
+        lo_file_free(fi);
+        pthread_mutex_lock(&lo->mutex);
+        dead = lo_forget_one(req, inode, 1);
+        pthread_mutex_unlock(&lo->mutex);
+        if (dead)
+            lo_reap(lo, &inode, 1);
+        return (void) fuse_reply_err(req, err);
+    }
+    /* only a file without chunks yet takes the directory's dictionary */
+    c = lo_cfile_of(inode);
+    if (c && dict)
+        lo_cfile_set_dict(c, dict);
+    fuse_reply_create(req, &e, fi);
+}
+
+static void lo_open_done(struct lo_uring_op *op, int res)
+{
+    struct lo_async_open *a = (struct lo_async_open *) op;
+
+    lo_inode_fd_put(lo_data(a->req), a->inode, a->ino_fd);
+    if (res >= 0)
+        res = -lo_file_new(&a->fi, res);
+    if (res >= 0) {
+        res = -lo_file_opened(a->req, a->inode, &a->fi);
+        if (res < 0)
+            lo_file_free(&a->fi);
+    }
+    if (res < 0)
+        fuse_reply_err(a->req, -res);
     else
-        fuse_reply_create(req, &e, fi);
+        fuse_reply_open(a->req, &a->fi);
+    free(a);
+}
+
+static int lo_open_async(fuse_req_t req, fuse_ino_t ino, int ino_fd,
+             struct fuse_file_info *fi)
+{
+    struct lo_async_open *a;
+    int res;
+
+    a = malloc(sizeof(struct lo_async_open));
+    if (!a)
+        return -ENOMEM;
+
+    a->op.done = lo_open_done;
+    a->req = req;
+    a->inode = lo_inode(req, ino);
+    a->ino_fd = ino_fd;
+    a->fi = *fi;
+    sprintf(a->path, "/proc/self/fd/%i", ino_fd);
+    res = lo_uring_openat(&lo_data(req)->uring, &a->op, AT_FDCWD, a->path,
+                  fi->flags & ~O_NOFOLLOW, 0);
+    if (res)
+        free(a);
+    return res;
 }
 
 static void lo_open(fuse_req_t req, fuse_ino_t ino,
             struct fuse_file_info *fi)
 {
     int fd;
+    int ino_fd;
+    int err;
     char buf[64];
 
     if (lo_debug(req))
@@ -467,23 +2299,71 @@ static void lo_open(fuse_req_t req, fuse_ino_t ino,
     if (lo_data(req)->writeback && (fi->flags & O_APPEND))
         fi->flags &= ~O_APPEND;
 
-    sprintf(buf, "/proc/self/fd/%i", lo_fd(req, ino));
+    if (lo_inode(req, ino)->flags & LO_I_COMPRESS)
+        lo_cfile_open_flags(fi);
+
+    ino_fd = lo_fd(req, ino);
+    if (ino_fd == -1)
+        return (void) fuse_reply_err(req, errno);
+
+    /* loading a compressed file would block the completion thread */
+    if (lo_data(req)->async && !(lo_inode(req, ino)->flags & LO_I_COMPRESS) &&
+        lo_open_async(req, ino, ino_fd, fi) == 0)
+        return;
+
+    sprintf(buf, "/proc/self/fd/%i", ino_fd);
     fd = open(buf, fi->flags & ~O_NOFOLLOW);
+    err = errno;
+    lo_fd_put(req, ino, ino_fd);
     if (fd == -1)
-        return (void) fuse_reply_err(req, errno);
+        return (void) fuse_reply_err(req, err);
 
-    fi->fh = fd;
+    err = lo_file_new(fi, fd);
+    if (err)
+        return (void) fuse_reply_err(req, err);
+    err = lo_file_opened(req, lo_inode(req, ino), fi);
+    if (err) {
+        lo_file_free(fi);
+        return (void) fuse_reply_err(req, err);
+    }
     fuse_reply_open(req, fi);
 }
 
 static void lo_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    (void) ino;
-
-    close(fi->fh);
+    lo_file_wait(lo_data(req), fi);
+    lo_file_released(req, lo_inode(req, ino), fi);
+    lo_file_free(fi);
     fuse_reply_err(req, 0);
 }
 
+/* The chunk index of a compressed file is written on every close, so
+   that close() can report when that fails; release does it again in
+   case writes came in after. */
+static void lo_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct lo_cfile *c = lo_cfile_of(lo_inode(req, ino));
+    int res = 0;
+
+    if (c && lo_file(fi)->writable)
+        res = -lo_cfile_flush(c, lo_file(fi)->fd);
+    fuse_reply_err(req, res);
+}
+
+static void lo_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+             struct fuse_file_info *fi)
+{
+    struct lo_cfile *c = lo_cfile_of(lo_inode(req, ino));
+    struct lo_file *f = lo_file(fi);
+    int res = 0;
+
+    if (c && f->writable)
+        res = -lo_cfile_flush(c, f->fd);
+    if (!res && (datasync ? fdatasync(f->fd) : fsync(f->fd)) == -1)
+        res = errno;
+    fuse_reply_err(req, res);
+}
+
 static void lo_read(fuse_req_t req, fuse_ino_t ino, size_t size,
             off_t offset, struct fuse_file_info *fi)
 {
@@ -494,47 +2374,381 @@ static void lo_read(fuse_req_t req, fuse_ino_t ino, size_t size,
             "off=%lu)\n", ino, size, (unsigned long) offset);
 
     buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
-    buf.buf[0].fd = fi->fh;
+    buf.buf[0].fd = lo_file(fi)->fd;
     buf.buf[0].pos = offset;
 
     fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
 }
 
-static void lo_read_reply_buf(fuse_req_t req, fuse_ino_t ino, size_t size,
-            off_t offset, struct fuse_file_info *fi)
+static void lo_read_done(struct lo_uring_op *op, int res)
 {
-    if (lo_debug(req))
-        fprintf(stderr, "lo_read(ino=%" PRIu64 ", size=%zd, "
-            "off=%lu)\n", ino, size, (unsigned long) offset);
+    struct lo_async_io *a = (struct lo_async_io *) op;
 
-    char *read_buf = (char *)malloc(sizeof(char *) * size);
+    if (res < 0)
+        fuse_reply_err(a->req, -res);
+    else
+        fuse_reply_buf(a->req, a->data, res);
+    free(a);
+}
 
-    int len = pread(fi->fh, read_buf, size, offset);
-    printf("len=%d\n", len);
+static int lo_read_async(fuse_req_t req, size_t size, off_t offset,
+             struct fuse_file_info *fi)
+{
+    struct lo_async_io *a;
+    int res;
 
-    fuse_reply_buf(req, read_buf, size);
-    free(read_buf);
+    a = malloc(sizeof(struct lo_async_io) + size);
+    if (!a)
+        return -ENOMEM;
+
+    a->op.done = lo_read_done;
+    a->req = req;
+    res = lo_uring_read(&lo_data(req)->uring, &a->op, lo_file(fi)->fd,
+                a->data, size, offset);
+    if (res)
+        free(a);
+    return res;
 }
 
-///////////////
-#ifdef INLINE_BUFFER
-static const struct fuse_buf *fuse_bufvec_current(struct fuse_bufvec *bufv)
+/* Very fragmented files are read the normal way, their map would cost
+   more than the holes save */
+#define LO_HOLEMAP_MAX 4096
+/* most data extents a single read is split into */
+#define LO_SPARSE_SEGS 64
+#define LO_ZEROS_SIZE (1024 * 1024)
+
+/* never written, reads of it map the shared zero page */
+static char lo_zeros[LO_ZEROS_SIZE];
+
+static struct lo_holemap *lo_holemap_build(int fd)
 {
-    if (bufv->idx < bufv->count)
-        return &bufv->buf[bufv->idx];
-    else
+    struct lo_holemap *map, *tmp;
+    size_t cap = 16;
+    struct stat st;
+    off_t pos = 0;
+    off_t data, hole;
+
+    if (fstat(fd, &st) == -1)
+        return NULL;
+
+    map = malloc(sizeof(struct lo_holemap) + cap * sizeof(struct lo_extent));
+    if (!map)
         return NULL;
+    map->size = st.st_size;
+    map->mtime = st.st_mtim;
+    map->count = 0;
+
+    while (pos < st.st_size) {
+        data = lseek(fd, pos, SEEK_DATA);
+        if (data == -1) {
+            if (errno == ENXIO)     /* only a hole up to EOF left */
+                break;
+            goto fail;
+        }
+        hole = lseek(fd, data, SEEK_HOLE);
+        if (hole == -1)
+            goto fail;
+
+        if (map->count == cap) {
+            if (cap == LO_HOLEMAP_MAX)
+                goto fail;
+            cap *= 2;
+            tmp = realloc(map, sizeof(struct lo_holemap) +
+                      cap * sizeof(struct lo_extent));
+            if (!tmp)
+                goto fail;
+            map = tmp;
+        }
+        map->ext[map->count].start = data;
+        map->ext[map->count].end = hole;
+        map->count++;
+        pos = hole;
+    }
+    return map;
+
+fail:
+    free(map);
+    return NULL;
 }
-static int fuse_bufvec_advance(struct fuse_bufvec *bufv, size_t len)
+
+/* Fills segs with the data extents of the map within [off, *end) and
+   clips *end to the size of the file. Returns the number of extents,
+   or -1 if there are more than LO_SPARSE_SEGS. */
+static int lo_holemap_segs(const struct lo_holemap *map, off_t off,
+               off_t *end, struct lo_extent *segs)
 {
-    const struct fuse_buf *buf = fuse_bufvec_current(bufv);
+    size_t lo = 0, hi = map->count, i;
+    int n = 0;
 
-    bufv->off += len;
-    assert(bufv->off <= buf->size);
-    if (bufv->off == buf->size) {
-        assert(bufv->idx < bufv->count);
-        bufv->idx++;
-        if (bufv->idx == bufv->count)
+    if (*end > map->size)
+        *end = map->size;
+
+    /* first extent ending after off */
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+
+        if (map->ext[mid].end <= off)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (i = lo; i < map->count && map->ext[i].start < *end; i++) {
+        if (n == LO_SPARSE_SEGS)
+            return -1;
+        segs[n].start = map->ext[i].start > off ? map->ext[i].start : off;
+        segs[n].end = map->ext[i].end < *end ? map->ext[i].end : *end;
+        n++;
+    }
+    return n;
+}
+
+/* Appends len bytes of zeros to iov */
+static int lo_iov_zeros(struct iovec *iov, int n, size_t len)
+{
+    while (len) {
+        iov[n].iov_base = lo_zeros;
+        iov[n].iov_len = min_size(len, LO_ZEROS_SIZE);
+        len -= iov[n].iov_len;
+        n++;
+    }
+    return n;
+}
+
+/* Serves a read of a sparse file from its hole map: holes are replied
+   from a zero buffer, only the data extents are read. A map the lower
+   file changed under, written to by someone else than the mount, is
+   built again. Returns -1 if the file is not sparse or its map is
+   unusable; the caller then reads the usual way. */
+static int lo_read_sparse(fuse_req_t req, struct lo_inode *inode,
+              size_t size, off_t off, struct fuse_file_info *fi)
+{
+    struct lo_inode_ext *ext = inode->ext;
+    struct lo_extent segs[LO_SPARSE_SEGS];
+    struct lo_holemap *map;
+    struct iovec *iov;
+    off_t end = off + size;
+    off_t pos;
+    size_t data = 0;
+    uint64_t gen;
+    struct stat st;
+    char *buf, *p;
+    int nsegs, niov, i;
+    ssize_t res;
+
+    if (!ext || !__atomic_load_n(&ext->sparse, __ATOMIC_RELAXED))
+        return -1;
+    if (fstat(lo_file(fi)->fd, &st) == -1)
+        return -1;
+
+    pthread_mutex_lock(&ext->lock);
+    map = ext->holes;
+    if (map && (map->size != st.st_size ||
+            !lo_ts_equal(&map->mtime, &st.st_mtim))) {
+        ext->holes = NULL;
+        ext->holes_gen++;
+        free(map);
+    }
+    if (!ext->holes) {
+        gen = ext->holes_gen;
+        pthread_mutex_unlock(&ext->lock);
+        map = lo_holemap_build(lo_file(fi)->fd);
+        if (!map)
+            return -1;
+        pthread_mutex_lock(&ext->lock);
+        /* don't install a map that a write has overtaken */
+        if (!ext->holes && ext->holes_gen == gen) {
+            ext->holes = map;
+        } else {
+            free(map);
+            if (!ext->holes) {
+                pthread_mutex_unlock(&ext->lock);
+                return -1;
+            }
+        }
+    }
+    nsegs = lo_holemap_segs(ext->holes, off, &end, segs);
+    pthread_mutex_unlock(&ext->lock);
+    if (nsegs < 0)
+        return -1;
+    if (end <= off) {
+        fuse_reply_buf(req, NULL, 0);
+        return 0;
+    }
+
+    for (i = 0; i < nsegs; i++)
+        data += segs[i].end - segs[i].start;
+
+    /* a data and a hole vector per extent, plus the zero buffer
+       sized pieces of the holes */
+    niov = 2 * nsegs + 1 + (end - off - data) / LO_ZEROS_SIZE + 1;
+    buf = malloc(niov * sizeof(struct iovec) + data);
+    if (!buf) {
+        fuse_reply_err(req, ENOMEM);
+        return 0;
+    }
+    iov = (struct iovec *) buf;
+    p = buf + niov * sizeof(struct iovec);
+
+    niov = 0;
+    pos = off;
+    for (i = 0; i < nsegs; i++) {
+        size_t len = segs[i].end - segs[i].start;
+
+        niov = lo_iov_zeros(iov, niov, segs[i].start - pos);
+        res = pread(lo_file(fi)->fd, p, len, segs[i].start);
+        if (res == -1) {
+            fuse_reply_err(req, errno);
+            free(buf);
+            return 0;
+        }
+        iov[niov].iov_base = p;
+        iov[niov].iov_len = res;
+        niov++;
+        p += res;
+        pos = segs[i].start + res;
+        /* truncated behind our back, end the reply here */
+        if ((size_t) res < len) {
+            lo_inode_written(inode);
+            end = pos;
+            break;
+        }
+    }
+    niov = lo_iov_zeros(iov, niov, end - pos);
+
+    fuse_reply_iov(req, iov, niov);
+    free(buf);
+    return 0;
+}
+
+static void lo_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence,
+             struct fuse_file_info *fi)
+{
+    struct lo_cfile *c = lo_cfile_of(lo_inode(req, ino));
+    off_t res;
+
+    if (c) {
+        /* all data up to the logical size, the kernel handles the
+           other whence values itself */
+        off_t size = lo_cfile_size(c);
+
+        if (whence != SEEK_DATA && whence != SEEK_HOLE)
+            return (void) fuse_reply_err(req, EINVAL);
+        if (off >= size)
+            return (void) fuse_reply_err(req, ENXIO);
+        return (void) fuse_reply_lseek(req, whence == SEEK_DATA ? off : size);
+    }
+
+    res = lseek(lo_file(fi)->fd, off, whence);
+    if (res == -1)
+        fuse_reply_err(req, errno);
+    else
+        fuse_reply_lseek(req, res);
+}
+
+/* Reads in a row at the expected offset before an open counts as a
+   stream, how far ahead of it the lower file is read, and how much of
+   its past is dropped at once. */
+#define LO_STREAM_MIN 4
+#define LO_STREAM_AHEAD (8 * 1024 * 1024)
+#define LO_STREAM_DROP (4 * 1024 * 1024)
+
+/* Sequential readers get their data cached by the kernel in the FUSE
+   inode; keeping a second copy in the lower file's page cache only
+   pushes other data out. With prefetching the kernel serves the pushed
+   part itself, so the next read we see starts somewhere inside or at
+   the end of it. */
+static void lo_stream_read(struct lo_data *lo, struct lo_inode *inode,
+               struct lo_file *f, off_t off, size_t size)
+{
+    off_t end = off + size;
+
+    if (off != f->next && (off < f->next || off > f->pushed)) {
+        f->seq = 0;
+        f->dropped = off;
+        f->ahead = end;
+        f->pushed = end;
+    } else if (f->seq < LO_STREAM_MIN) {
+        f->seq++;
+    }
+    f->next = end;
+    if (f->seq < LO_STREAM_MIN)
+        return;
+
+    if (lo->prefetch && f->pushed < end + (off_t) lo->prefetch / 2)
+        lo_prefetch(lo, inode, f, f->pushed > end ? f->pushed : end,
+                lo->prefetch);
+
+    /* the lower offsets of compressed files are not the logical ones */
+    if (inode->flags & LO_I_COMPRESS)
+        return;
+
+    if ((lo->fadvise & LO_FADV_AHEAD) &&
+        f->ahead < end + LO_STREAM_AHEAD / 2) {
+        if (f->ahead < end)
+            f->ahead = end;
+        readahead(f->fd, f->ahead, LO_STREAM_AHEAD);
+        f->ahead += LO_STREAM_AHEAD;
+    }
+    if ((lo->fadvise & LO_FADV_DROP) && off - f->dropped >= LO_STREAM_DROP) {
+        posix_fadvise(f->fd, f->dropped, off - f->dropped,
+                  POSIX_FADV_DONTNEED);
+        f->dropped = off;
+    }
+}
+
+static void lo_read_reply_buf(fuse_req_t req, fuse_ino_t ino, size_t size,
+            off_t offset, struct fuse_file_info *fi)
+{
+    char *read_buf;
+    ssize_t len;
+
+    if (lo_debug(req))
+        fprintf(stderr, "lo_read(ino=%" PRIu64 ", size=%zd, "
+            "off=%lu)\n", ino, size, (unsigned long) offset);
+
+    if (lo_data(req)->fadvise || lo_data(req)->prefetch)
+        lo_stream_read(lo_data(req), lo_inode(req, ino), lo_file(fi),
+                   offset, size);
+
+    if (lo_read_sparse(req, lo_inode(req, ino), size, offset, fi) == 0)
+        return;
+
+    if (lo_data(req)->async && !lo_cfile_of(lo_inode(req, ino)) &&
+        lo_read_async(req, size, offset, fi) == 0)
+        return;
+
+    read_buf = malloc(size);
+    if (!read_buf)
+        return (void) fuse_reply_err(req, ENOMEM);
+
+    len = lo_file_pread(lo_inode(req, ino), lo_file(fi), read_buf, size,
+                offset);
+    if (len == -1)
+        fuse_reply_err(req, errno);
+    else
+        fuse_reply_buf(req, read_buf, len);
+    free(read_buf);
+}
+
+///////////////
+#ifdef INLINE_BUFFER
+static const struct fuse_buf *fuse_bufvec_current(struct fuse_bufvec *bufv)
+{
+    if (bufv->idx < bufv->count)
+        return &bufv->buf[bufv->idx];
+    else
+        return NULL;
+}
+static int fuse_bufvec_advance(struct fuse_bufvec *bufv, size_t len)
+{
+    const struct fuse_buf *buf = fuse_bufvec_current(bufv);
+
+    bufv->off += len;
+    assert(bufv->off <= buf->size);
+    if (bufv->off == buf->size) {
+        assert(bufv->idx < bufv->count);
+        bufv->idx++;
+        if (bufv->idx == bufv->count)
             return 0;
         bufv->off = 0;
     }
@@ -801,6 +3015,95 @@ ssize_t my_fuse_buf_copy(struct fuse_bufvec *dstv, struct fuse_bufvec *srcv,
 #endif
 //////////////////
 
+static void lo_write_done(struct lo_uring_op *op, int res)
+{
+    struct lo_async_io *a = (struct lo_async_io *) op;
+
+    if (res < 0) {
+        fuse_reply_err(a->req, -res);
+    } else {
+        lo_inode_written(a->inode);
+        fuse_reply_write(a->req, res);
+    }
+    free(a);
+}
+
+/* The request buffer is reused as soon as we return, so the data has
+   to be copied; only done for data already in memory (not spliced). */
+static int lo_write_async(fuse_req_t req, fuse_ino_t ino,
+              struct fuse_bufvec *in_buf, off_t off,
+              struct fuse_file_info *fi)
+{
+    struct lo_async_io *a;
+    size_t size = fuse_buf_size(in_buf);
+    struct fuse_bufvec tmp = FUSE_BUFVEC_INIT(size);
+    size_t i;
+    int res;
+
+    for (i = 0; i < in_buf->count; i++) {
+        if (in_buf->buf[i].flags & FUSE_BUF_IS_FD)
+            return -EINVAL;
+    }
+
+    a = malloc(sizeof(struct lo_async_io) + size);
+    if (!a)
+        return -ENOMEM;
+
+    tmp.buf[0].mem = a->data;
+    if (my_fuse_buf_copy(&tmp, in_buf, 0) != (ssize_t) size) {
+        free(a);
+        return -EIO;
+    }
+
+    a->op.done = lo_write_done;
+    a->req = req;
+    a->inode = lo_inode(req, ino);
+    a->iov.iov_base = a->data;
+    a->iov.iov_len = size;
+    res = lo_uring_writev(&lo_data(req)->uring, &a->op, lo_file(fi)->fd,
+                  &a->iov, 1, off);
+    if (res)
+        free(a);
+    return res;
+}
+
+/* Compressed files are written from memory, a chunk at a time */
+static void lo_cfile_write(fuse_req_t req, struct lo_inode *inode,
+               struct lo_cfile *c, struct fuse_bufvec *in_buf,
+               off_t off, struct fuse_file_info *fi)
+{
+    size_t size = fuse_buf_size(in_buf);
+    struct fuse_bufvec tmp = FUSE_BUFVEC_INIT(size);
+    const char *data;
+    char *copy = NULL;
+    ssize_t res;
+
+    if (in_buf->count == 1 && !(in_buf->buf[0].flags & FUSE_BUF_IS_FD)) {
+        data = in_buf->buf[0].mem;
+    } else {
+        copy = malloc(size);
+        if (!copy)
+            return (void) fuse_reply_err(req, ENOMEM);
+        tmp.buf[0].mem = copy;
+        res = my_fuse_buf_copy(&tmp, in_buf, 0);
+        if (res < 0) {
+            free(copy);
+            return (void) fuse_reply_err(req, -res);
+        }
+        size = res;
+        data = copy;
+    }
+
+    res = lo_cfile_pwrite(c, lo_file(fi)->fd, data, size, off);
+    free(copy);
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+    } else {
+        lo_inode_written(inode);
+        fuse_reply_write(req, res);
+    }
+}
+
 static void lo_write_buf(fuse_req_t req, fuse_ino_t ino,
              struct fuse_bufvec *in_buf, off_t off,
              struct fuse_file_info *fi)
@@ -808,50 +3111,1089 @@ static void lo_write_buf(fuse_req_t req, fuse_ino_t ino,
     (void) ino;
     ssize_t res;
     struct fuse_bufvec out_buf = FUSE_BUFVEC_INIT(fuse_buf_size(in_buf));
+    enum fuse_buf_copy_flags flags = 0;
+    struct lo_cfile *c = lo_cfile_of(lo_inode(req, ino));
+
+    if (c)
+        return lo_cfile_write(req, lo_inode(req, ino), c, in_buf, off, fi);
+
+    if (lo_data(req)->async && lo_write_async(req, ino, in_buf, off, fi) == 0)
+        return;
 
     out_buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
-    out_buf.buf[0].fd = fi->fh;
+    out_buf.buf[0].fd = lo_file(fi)->fd;
     out_buf.buf[0].pos = off;
 
     if (lo_debug(req))
         fprintf(stderr, "lo_write(ino=%" PRIu64 ", size=%zd, off=%lu)\n",
             ino, out_buf.buf[0].size, (unsigned long) off);
-    
-    res = my_fuse_buf_copy(&out_buf, in_buf, 0);
-    if(res < 0)
+
+    /* pipe buffers can be moved into the page cache of the lower file */
+    if (lo_data(req)->conn.want & FUSE_CAP_SPLICE_MOVE)
+        flags |= FUSE_BUF_SPLICE_MOVE;
+
+    res = my_fuse_buf_copy(&out_buf, in_buf, flags);
+    if(res < 0) {
         fuse_reply_err(req, -res);
-    else
+    } else {
+        lo_inode_written(lo_inode(req, ino));
         fuse_reply_write(req, (size_t) res);
+    }
+}
+
+/* Both files are on the lower filesystem, so the copy never passes
+   through the daemon; filesystems that share extents (btrfs, xfs,
+   overlayfs on those) turn it into a reflink. EXDEV and EOPNOTSUPP make
+   the kernel fall back to a splice based copy, which is also how
+   compressed files are copied. */
+static void lo_copy_file_range(fuse_req_t req, fuse_ino_t ino_in,
+                   off_t off_in, struct fuse_file_info *fi_in,
+                   fuse_ino_t ino_out, off_t off_out,
+                   struct fuse_file_info *fi_out, size_t len,
+                   int flags)
+{
+    int fd_in = lo_file(fi_in)->fd;
+    int fd_out = lo_file(fi_out)->fd;
+    ssize_t res;
+
+    /* the lower bytes of compressed files are not their contents */
+    if (lo_cfile_of(lo_inode(req, ino_in)) ||
+        lo_cfile_of(lo_inode(req, ino_out)))
+        return (void) fuse_reply_err(req, EOPNOTSUPP);
+
+    if (lo_debug(req))
+        fprintf(stderr, "lo_copy_file_range(ino=%" PRIu64 "/fd=%d, "
+            "off=%lu, ino=%" PRIu64 "/fd=%d, off=%lu, size=%zd, "
+            "flags=0x%x)\n", ino_in, fd_in, (unsigned long) off_in,
+            ino_out, fd_out, (unsigned long) off_out, len, flags);
+
+    res = copy_file_range(fd_in, &off_in, fd_out, &off_out, len, flags);
+    if (res < 0) {
+        fuse_reply_err(req, errno);
+    } else {
+        lo_inode_written(lo_inode(req, ino_out));
+        fuse_reply_write(req, res);
+    }
+}
+
+/* Pieces of a clone that the lower filesystem could not share extents
+   for; at least LO_COPY_CHUNK bytes and at most LO_COPY_MAX_CHUNKS of
+   them per clone. */
+#define LO_COPY_CHUNK (8 * 1024 * 1024)
+#define LO_COPY_MAX_CHUNKS 1024
+
+struct lo_copy_chunk {
+    struct lo_pool_task task;   /* first, tasks are cast back */
+    int src;
+    int dst;
+    off_t src_off;
+    off_t dst_off;
+    size_t len;
+    int err;
+};
+
+/* read and write back one bounce buffer full, for when copy_file_range
+   can't be used between the two files */
+static ssize_t lo_copy_bounce(struct lo_copy_chunk *c)
+{
+    char *buf = fuse_buf_bounce();
+    ssize_t res;
+
+    if (!buf) {
+        errno = ENOMEM;
+        return -1;
+    }
+    res = pread(c->src, buf, min_size(c->len, FUSE_BUF_BOUNCE_SIZE),
+            c->src_off);
+    if (res <= 0)
+        return res;
+    res = pwrite(c->dst, buf, res, c->dst_off);
+    if (res > 0) {
+        c->src_off += res;
+        c->dst_off += res;
+    }
+    return res;
+}
+
+static void lo_copy_chunk(struct lo_pool_task *t)
+{
+    struct lo_copy_chunk *c = (struct lo_copy_chunk *) t;
+    int bounce = 0;
+    ssize_t res;
+
+    while (c->len) {
+        if (!bounce) {
+            res = copy_file_range(c->src, &c->src_off, c->dst,
+                          &c->dst_off, c->len, 0);
+            if (res == -1 && (errno == EXDEV || errno == EOPNOTSUPP ||
+                      errno == ENOSYS || errno == EINVAL)) {
+                bounce = 1;
+                continue;
+            }
+        } else {
+            res = lo_copy_bounce(c);
+        }
+        if (res == -1) {
+            c->err = errno;
+            return;
+        }
+        /* the source shrank under us */
+        if (res == 0)
+            return;
+        c->len -= res;
+    }
+}
+
+/* copy len bytes in parallel chunks on the worker pool, returns errno */
+static int lo_copy_parallel(struct lo_data *lo, int src, off_t src_off,
+                int dst, off_t dst_off, size_t len)
+{
+    struct lo_pool_group group;
+    struct lo_copy_chunk *chunks;
+    size_t chunk = LO_COPY_CHUNK;
+    size_t n, i;
+    int err = 0;
+
+    if (len / chunk >= LO_COPY_MAX_CHUNKS)
+        chunk = len / LO_COPY_MAX_CHUNKS + 1;
+    n = (len + chunk - 1) / chunk;
+    if (!n)
+        return 0;
+
+    chunks = calloc(n, sizeof(struct lo_copy_chunk));
+    if (!chunks)
+        return ENOMEM;
+
+    lo_pool_group_init(&group);
+    for (i = 0; i < n; i++) {
+        struct lo_copy_chunk *c = &chunks[i];
+
+        c->src = src;
+        c->dst = dst;
+        c->src_off = src_off + i * chunk;
+        c->dst_off = dst_off + i * chunk;
+        c->len = min_size(chunk, len - i * chunk);
+        lo_pool_submit(&lo->pool, &group, &c->task, lo_copy_chunk);
+    }
+    lo_pool_wait(&lo->pool, &group);
+    lo_pool_group_destroy(&group);
+
+    for (i = 0; i < n && !err; i++)
+        err = chunks[i].err;
+    free(chunks);
+    return err;
+}
+
+/* opens path relative to the root of the lower tree without letting
+   it, or a symlink on the way, lead out of the tree */
+static int lo_open_beneath(struct lo_data *lo, const char *path, int flags)
+{
+    struct open_how how = {
+        .flags = flags | O_CLOEXEC,
+        .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+    };
+    int fd;
+
+    while (*path == '/')
+        path++;
+    fd = syscall(SYS_openat2, lo->root.fd, path, &how, sizeof(how));
+    if (fd == -1 && errno == ENOSYS)
+        errno = EOPNOTSUPP;
+    return fd;
+}
+
+/* first guess of how many supplementary groups a caller has */
+#define LO_CREDS_GROUPS 32
+
+/* The filesystem credentials of a thread. Linux keeps fsuid, fsgid and
+   the supplementary groups per thread, glibc's setgroups() changes them
+   in all threads, so the system call is made directly. */
+struct lo_creds {
+    uid_t uid;
+    gid_t gid;
+    int ngroups;        /* -1: unchanged */
+    gid_t *groups;
+};
+
+/* back to the daemon's own after lo_creds_caller(), once */
+static void lo_creds_restore(struct lo_creds *old)
+{
+    if (old->ngroups == -1)
+        return;
+    setfsuid(old->uid);
+    setfsgid(old->gid);
+    if (syscall(SYS_setgroups, old->ngroups, old->groups) == -1)
+        fprintf(stderr, "lo_creds_restore: setgroups: %s\n",
+            strerror(errno));
+    free(old->groups);
+    old->groups = NULL;
+    old->ngroups = -1;
+}
+
+/* the supplementary groups of the caller of req into *out, malloc()ed.
+   Returns how many, or -errno. */
+static int lo_creds_groups(fuse_req_t req, gid_t **out)
+{
+    gid_t *groups = NULL, *p;
+    int size, n = LO_CREDS_GROUPS;
+
+    /* they may change between two reads */
+    do {
+        size = n;
+        p = realloc(groups, size * sizeof(gid_t));
+        if (!p) {
+            free(groups);
+            return -ENOMEM;
+        }
+        groups = p;
+        n = fuse_req_getgroups(req, size, groups);
+        if (n < 0) {
+            free(groups);
+            return n;
+        }
+    } while (n > size);
+    *out = groups;
+    return n;
+}
+
+/* Makes the lower filesystem check the permissions of the caller of
+   req for what this thread opens until lo_creds_restore(). For files
+   the daemon opens on behalf of a user by a name the kernel never saw.
+   Returns 0 or errno. */
+static int lo_creds_caller(fuse_req_t req, struct lo_creds *old)
+{
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    gid_t *groups;
+    int n, size;
+    int err = 0;
+
+    old->ngroups = -1;
+    old->groups = NULL;
+    if (ctx->uid == geteuid() && ctx->gid == getegid())
+        return 0;
+
+    /* without them access through a group would be refused wrongly, or
+       granted through the daemon's */
+    n = lo_creds_groups(req, &groups);
+    if (n < 0)
+        return -n;
+    size = getgroups(0, NULL);
+    if (size != -1)
+        old->groups = malloc((size ? size : 1) * sizeof(gid_t));
+    if (size == -1 || !old->groups)
+        err = size == -1 ? errno : ENOMEM;
+    else if ((size = getgroups(size, old->groups)) == -1)
+        err = errno;
+    else if (syscall(SYS_setgroups, n, groups) == -1)
+        err = errno;
+    free(groups);
+    if (err) {
+        free(old->groups);
+        old->groups = NULL;
+        return err;
+    }
+    old->ngroups = size;
+    old->gid = setfsgid(ctx->gid);
+    old->uid = setfsuid(ctx->uid);
+    /* these fail silently, returning the old id either way */
+    if (setfsgid(-1) != (int) ctx->gid || setfsuid(-1) != (int) ctx->uid) {
+        lo_creds_restore(old);
+        return EPERM;
+    }
+    return 0;
+}
+
+/* Clones src (a path relative to the mount root) into the file ino.
+   The lower filesystem shares the extents if it can (FICLONE /
+   FICLONERANGE), otherwise the data is copied by the worker pool.
+   range is NULL for a whole file clone, else src_off, len, dst_off
+   with len 0 meaning up to the end of src. */
+static int lo_clone(fuse_req_t req, fuse_ino_t ino, const char *src,
+            const off_t *range)
+{
+    struct lo_data *lo = lo_data(req);
+    struct file_clone_range fcr;
+    struct lo_cfile_hdr hdr;
+    char procname[64];
+    struct stat st;
+    off_t src_off = 0, dst_off = 0;
+    size_t len;
+    struct lo_creds creds;
+    int sfd, dfd = -1, ino_fd;
+    int err = 0;
+    int res;
+
+    /* the kernel checked neither end, both are opened as the caller */
+    err = lo_creds_caller(req, &creds);
+    if (err)
+        return err;
+    sfd = lo_open_beneath(lo, src, O_RDONLY);
+    err = errno;
+    lo_creds_restore(&creds);
+    if (sfd == -1)
+        return err;
+    err = 0;
+
+    /* neither extents nor bytes of compressed files can be shared */
+    if ((lo_inode(req, ino)->flags & LO_I_COMPRESS) ||
+        lo_cfile_read_hdr(sfd, &hdr) == 1) {
+        err = EOPNOTSUPP;
+        goto out_src;
+    }
+
+    ino_fd = lo_fd(req, ino);
+    if (ino_fd == -1) {
+        err = errno;
+        goto out_src;
+    }
+    sprintf(procname, "/proc/self/fd/%i", ino_fd);
+    err = lo_creds_caller(req, &creds);
+    if (!err) {
+        dfd = open(procname, O_WRONLY | O_CLOEXEC);
+        err = dfd == -1 ? errno : 0;
+        lo_creds_restore(&creds);
+    }
+    lo_fd_put(req, ino, ino_fd);
+    if (dfd == -1)
+        goto out_src;
+
+    if (range) {
+        fcr.src_fd = sfd;
+        fcr.src_offset = src_off = range[0];
+        fcr.src_length = range[1];
+        fcr.dest_offset = dst_off = range[2];
+        res = ioctl(dfd, FICLONERANGE, &fcr);
+    } else {
+        res = ioctl(dfd, FICLONE, sfd);
+    }
+    if (res == 0)
+        goto out;
+    if (errno != EOPNOTSUPP && errno != ENOTTY && errno != EXDEV &&
+        errno != EINVAL) {
+        err = errno;
+        goto out;
+    }
+
+    if (fstat(sfd, &st) == -1) {
+        err = errno;
+        goto out;
+    }
+    if (range && range[1]) {
+        len = range[1];
+    } else {
+        len = st.st_size > src_off ? st.st_size - src_off : 0;
+        /* a whole file clone replaces the old contents */
+        if (!range && (ftruncate(dfd, 0) == -1 ||
+                   ftruncate(dfd, st.st_size) == -1)) {
+            err = errno;
+            goto out;
+        }
+    }
+    err = lo_copy_parallel(lo, sfd, src_off, dfd, dst_off, len);
+
+    if (lo_debug(req))
+        fprintf(stderr, "lo_clone(ino=%" PRIu64 ", src=%s): no shared "
+            "extents, copied %zu bytes: %s\n", ino, src, len,
+            strerror(err));
+out:
+    close(dfd);
+out_src:
+    close(sfd);
+    return err;
+}
+
+/* Control attributes. On the root directory:
+     user.jcfs.buftrace    get: copy layer counters and recent calls
+                           set: "on", "off" or "reset"
+   On a regular file or directory, get only:
+     user.jcfs.space       "<logical> <physical> <files> <chunks>":
+                           bytes as read through the mount and blocks
+                           of the lower files, of the file or summed
+                           over the regular files in the directory
+   On a directory in a compressed tree:
+     user.jcfs.dict        get: "<version> <id> <bytes>" of the
+                           dictionary new files are compressed with
+                           set: "train [<bytes>]": build a new one out
+                           of the files in the directory
+   On any regular file, set only:
+     user.jcfs.clone       "<src>": make the file a copy of src
+     user.jcfs.clone_range "<src_off> <len> <dst_off> <src>": copy a
+                           range of src into the file, len 0 means to
+                           the end of src
+   src is a path relative to the mount root. */
+#define LO_CTL_PREFIX "user.jcfs."
+#define LO_CTL_BUFTRACE_LAST 256
+/* a dictionary is trained on the start of this many files */
+#define LO_CDICT_SAMPLES 1024
+#define LO_CDICT_SAMPLE 4096
+
+static bool lo_ctl_name(const char *name)
+{
+    return strncmp(name, LO_CTL_PREFIX, sizeof(LO_CTL_PREFIX) - 1) == 0;
+}
+
+static void lo_ctl_dict_get(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+    const struct lo_cdict *dict = NULL;
+    char text[64];
+    int len;
+    int fd;
+
+    if (lo_inode(req, ino)->flags & LO_I_COMPRESS) {
+        fd = lo_fd(req, ino);
+        if (fd == -1)
+            return (void) fuse_reply_err(req, errno);
+        dict = lo_dir_dict(lo_data(req), fd);
+        lo_fd_put(req, ino, fd);
+    }
+    if (!dict)
+        return (void) fuse_reply_err(req, ENODATA);
+
+    len = snprintf(text, sizeof(text), "%u %016llx %zu", dict->version,
+               (unsigned long long) dict->id, dict->size);
+    if (size == 0)
+        fuse_reply_xattr(req, len);
+    else if ((size_t) len > size)
+        fuse_reply_err(req, ERANGE);
+    else
+        fuse_reply_buf(req, text, len);
+}
+
+/* Reads up to LO_CDICT_SAMPLE bytes from the start of the file name in
+   dir, uncompressed, into buf. Only files the caller of req can read
+   are sampled. Returns the length or -errno. */
+static ssize_t lo_dict_sample(fuse_req_t req, int dir, const char *name,
+                  char *buf)
+{
+    struct lo_data *lo = lo_data(req);
+    struct lo_creds creds;
+    struct lo_cfile c;
+    struct stat st;
+    ssize_t res;
+    int fd;
+
+    res = lo_creds_caller(req, &creds);
+    if (res)
+        return -res;
+    fd = openat(dir, name, O_RDONLY | O_NOFOLLOW);
+    res = errno;
+    lo_creds_restore(&creds);
+    if (fd == -1)
+        return -res;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return 0;
+    }
+    res = lo_cfile_load(&c, fd);
+    if (res == 1) {
+        res = 0;
+        if (c.dict_id)
+            c.dict = lo_cdicts_get(&lo->cdicts, c.dict_id);
+        if (!c.dict_id || c.dict)
+            res = lo_cfile_pread(&c, fd, buf, LO_CDICT_SAMPLE, 0);
+        lo_cfile_destroy(&c);
+    } else if (res == 0) {
+        res = pread(fd, buf, LO_CDICT_SAMPLE, 0);
+        if (res == -1)
+            res = -errno;
+    }
+    close(fd);
+    return res;
+}
+
+/* Samples the start of up to LO_CDICT_SAMPLES files of a compressed
+   directory, builds a dictionary out of them and makes it the one new
+   files in the directory are compressed with. Runs in the request,
+   setfattr waits for it. */
+static void lo_ctl_dict_train(fuse_req_t req, fuse_ino_t ino,
+                  const char *value, size_t size)
+{
+    struct lo_data *lo = lo_data(req);
+    const struct lo_cdict *old, *dict;
+    size_t lens[LO_CDICT_SAMPLES];
+    unsigned long long bytes = 0;
+    char procname[64];
+    char arg[64];
+    char *samples;
+    size_t n = 0;
+    size_t len = 0;
+    struct dirent *d;
+    DIR *dp;
+    int fd, dfd;
+    int err = 0;
+
+    if (size >= sizeof(arg))
+        return (void) fuse_reply_err(req, EINVAL);
+    memcpy(arg, value, size);
+    arg[size] = '\0';
+    if (strncmp(arg, "train", 5) != 0 ||
+        (arg[5] && sscanf(arg + 5, " %llu", &bytes) != 1) ||
+        bytes > LO_CDICT_MAX_SIZE)
+        return (void) fuse_reply_err(req, EINVAL);
+    if (!(lo_inode(req, ino)->flags & LO_I_COMPRESS))
+        return (void) fuse_reply_err(req, EINVAL);
+
+    samples = malloc((size_t) LO_CDICT_SAMPLES * LO_CDICT_SAMPLE);
+    if (!samples)
+        return (void) fuse_reply_err(req, ENOMEM);
+    fd = lo_fd(req, ino);
+    if (fd == -1) {
+        err = errno;
+        goto out;
+    }
+    dfd = openat(fd, ".", O_RDONLY | O_DIRECTORY);
+    dp = dfd == -1 ? NULL : fdopendir(dfd);
+    if (!dp) {
+        err = errno;
+        if (dfd != -1)
+            close(dfd);
+        goto out_fd;
+    }
+    while (n < LO_CDICT_SAMPLES && (d = readdir(dp))) {
+        ssize_t res;
+
+        /* dot files include the dictionaries themselves */
+        if (d->d_name[0] == '.' ||
+            (d->d_type != DT_REG && d->d_type != DT_UNKNOWN))
+            continue;
+        res = lo_dict_sample(req, dirfd(dp), d->d_name, samples + len);
+        if (res > 0) {
+            lens[n++] = res;
+            len += res;
+        }
+    }
+    closedir(dp);
+
+    old = lo_dir_dict(lo, fd);
+    dict = lo_cdicts_train(&lo->cdicts, samples, lens, n, bytes,
+                   old ? old->version + 1 : 1);
+    if (!dict) {
+        err = errno;
+        goto out_fd;
+    }
+    snprintf(arg, sizeof(arg), "%016llx", (unsigned long long) dict->id);
+    sprintf(procname, "/proc/self/fd/%i", fd);
+    if (setxattr(procname, LO_CDICT_XATTR, arg, strlen(arg), 0) == -1)
+        err = errno;
+    if (lo_debug(req))
+        fprintf(stderr, "lo_ctl_dict_train(ino=%" PRIu64 "): %zu samples, "
+            "%zu bytes, dictionary %s v%u of %zu bytes: %s\n", ino, n,
+            len, arg, dict->version, dict->size, strerror(err));
+out_fd:
+    lo_fd_put(req, ino, fd);
+out:
+    free(samples);
+    fuse_reply_err(req, err);
+}
+
+struct lo_space {
+    unsigned long long logical;
+    unsigned long long physical;
+    unsigned long long files;
+    unsigned long long chunks;
+};
+
+static void lo_space_add(struct lo_space *sp, const struct stat *st,
+             uint64_t nchunks)
+{
+    sp->logical += st->st_size;
+    sp->physical += (unsigned long long) st->st_blocks * 512;
+    sp->files++;
+    sp->chunks += nchunks;
+}
+
+/* lo_cfile_attr() of the file name in the compressed directory dir,
+   which need not have been looked up */
+static uint64_t lo_cfile_attr_at(struct lo_data *lo, int dir,
+                 const char *name, struct stat *st)
+{
+    struct lo_inode *inode;
+    struct lo_cfile_hdr h;
+    uint64_t nchunks = 0;
+    int fd;
+
+    pthread_mutex_lock(&lo->mutex);
+    inode = lo_find(lo, st);
+    if (inode)
+        inode->nlookup++;
+    pthread_mutex_unlock(&lo->mutex);
+    if (inode) {
+        nchunks = lo_cfile_attr(lo, inode, st);
+        lo_inode_unpin(lo, inode);
+        return nchunks;
+    }
+
+    if (st->st_size < LO_CFILE_HDR_SIZE)
+        return 0;
+    fd = openat(dir, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1)
+        return 0;
+    if (lo_cfile_read_hdr(fd, &h) == 1) {
+        st->st_size = h.size;
+        nchunks = h.nchunks;
+    }
+    close(fd);
+    return nchunks;
+}
+
+static void lo_ctl_space_get(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+    struct lo_data *lo = lo_data(req);
+    struct lo_inode *inode = lo_inode(req, ino);
+    struct lo_space sp = { 0, 0, 0, 0 };
+    struct dirent *d;
+    struct stat st;
+    char text[128];
+    DIR *dp;
+    int fd, dfd;
+    int err = 0;
+    int len;
+
+    fd = lo_fd(req, ino);
+    if (fd == -1)
+        return (void) fuse_reply_err(req, errno);
+    if (fstatat(fd, "", &st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1) {
+        err = errno;
+    } else if (S_ISREG(st.st_mode)) {
+        lo_space_add(&sp, &st, lo_cfile_attr(lo, inode, &st));
+    } else if (!S_ISDIR(st.st_mode)) {
+        err = ENODATA;
+    } else {
+        dfd = openat(fd, ".", O_RDONLY | O_DIRECTORY);
+        dp = dfd == -1 ? NULL : fdopendir(dfd);
+        if (!dp) {
+            err = errno;
+            if (dfd != -1)
+                close(dfd);
+        }
+        while (dp && (d = readdir(dp))) {
+            uint64_t nchunks = 0;
+
+            if (d->d_type != DT_REG && d->d_type != DT_UNKNOWN)
+                continue;
+            if (fstatat(dirfd(dp), d->d_name, &st,
+                    AT_SYMLINK_NOFOLLOW) == -1 || !S_ISREG(st.st_mode))
+                continue;
+            if (inode->flags & LO_I_COMPRESS)
+                nchunks = lo_cfile_attr_at(lo, dirfd(dp), d->d_name, &st);
+            lo_space_add(&sp, &st, nchunks);
+        }
+        if (dp)
+            closedir(dp);
+    }
+    lo_fd_put(req, ino, fd);
+    if (err)
+        return (void) fuse_reply_err(req, err);
+
+    len = snprintf(text, sizeof(text), "%llu %llu %llu %llu", sp.logical,
+               sp.physical, sp.files, sp.chunks);
+    if (size == 0)
+        fuse_reply_xattr(req, len);
+    else if ((size_t) len > size)
+        fuse_reply_err(req, ERANGE);
+    else
+        fuse_reply_buf(req, text, len);
+}
+
+static void lo_ctl_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                size_t size)
+{
+    char *text = NULL;
+    size_t len = 0;
+    FILE *f;
+
+    name += sizeof(LO_CTL_PREFIX) - 1;
+    if (strcmp(name, "dict") == 0)
+        return lo_ctl_dict_get(req, ino, size);
+    if (strcmp(name, "space") == 0)
+        return lo_ctl_space_get(req, ino, size);
+    if (ino != FUSE_ROOT_ID || strcmp(name, "buftrace") != 0)
+        return (void) fuse_reply_err(req, ENODATA);
+
+    f = open_memstream(&text, &len);
+    if (!f)
+        return (void) fuse_reply_err(req, ENOMEM);
+    fuse_buf_trace_dump(f, LO_CTL_BUFTRACE_LAST);
+    fclose(f);
+
+    /* the dump grows between the size probe and the read, cut it
+       rather than failing the read with ERANGE */
+    if (size == 0)
+        fuse_reply_xattr(req, len);
+    else
+        fuse_reply_buf(req, text, len < size ? len : size);
+    free(text);
+}
+
+static void lo_ctl_clone(fuse_req_t req, fuse_ino_t ino, const char *value,
+             size_t size, bool ranged)
+{
+    char arg[PATH_MAX + 64];
+    const char *src = arg;
+    long long v[3];
+    off_t range[3];
+    int pos = 0;
+    int err;
+    int i;
+
+    if (size >= sizeof(arg))
+        return (void) fuse_reply_err(req, ENAMETOOLONG);
+    memcpy(arg, value, size);
+    arg[size] = '\0';
+
+    if (ranged) {
+        if (sscanf(arg, "%lld %lld %lld %n", &v[0], &v[1], &v[2],
+               &pos) != 3)
+            return (void) fuse_reply_err(req, EINVAL);
+        for (i = 0; i < 3; i++) {
+            if (v[i] < 0)
+                return (void) fuse_reply_err(req, EINVAL);
+            range[i] = v[i];
+        }
+        src += pos;
+    }
+    if (!*src)
+        return (void) fuse_reply_err(req, EINVAL);
+
+    err = lo_clone(req, ino, src, ranged ? range : NULL);
+    if (!err)
+        lo_inode_written(lo_inode(req, ino));
+    fuse_reply_err(req, err);
+
+    /* the file changed behind the kernel's page cache */
+    if (!err && lo_data(req)->se)
+        fuse_lowlevel_notify_inval_inode(lo_data(req)->se, ino, 0, 0);
+}
+
+static void lo_ctl_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                const char *value, size_t size)
+{
+    name += sizeof(LO_CTL_PREFIX) - 1;
+    if (strcmp(name, "clone") == 0)
+        return lo_ctl_clone(req, ino, value, size, false);
+    if (strcmp(name, "clone_range") == 0)
+        return lo_ctl_clone(req, ino, value, size, true);
+    if (strcmp(name, "dict") == 0)
+        return lo_ctl_dict_train(req, ino, value, size);
+    if (ino != FUSE_ROOT_ID || strcmp(name, "buftrace") != 0)
+        return (void) fuse_reply_err(req, EINVAL);
+    /* it costs every write, only for whoever runs the daemon */
+    if (fuse_req_ctx(req)->uid != 0 && fuse_req_ctx(req)->uid != geteuid())
+        return (void) fuse_reply_err(req, EPERM);
+
+    if (size == 2 && memcmp(value, "on", 2) == 0)
+        fuse_buf_trace_enable(1);
+    else if (size == 3 && memcmp(value, "off", 3) == 0)
+        fuse_buf_trace_enable(0);
+    else if (size == 5 && memcmp(value, "reset", 5) == 0)
+        fuse_buf_trace_reset();
+    else
+        return (void) fuse_reply_err(req, EINVAL);
+    fuse_reply_err(req, 0);
+}
+
+/* xattrs can't be read through an O_PATH fd, go through /proc instead */
+static void lo_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+            size_t size)
+{
+    char procname[64];
+    char *value = NULL;
+    ssize_t ret;
+    int saverr;
+    int fd;
+
+    if (lo_ctl_name(name))
+        return lo_ctl_getxattr(req, ino, name, size);
+
+    if (size) {
+        value = malloc(size);
+        if (!value)
+            return (void) fuse_reply_err(req, ENOMEM);
+    }
+
+    fd = lo_fd(req, ino);
+    if (fd == -1) {
+        saverr = errno;
+        goto out;
+    }
+    sprintf(procname, "/proc/self/fd/%i", fd);
+    ret = getxattr(procname, name, value, size);
+    saverr = errno;
+    lo_fd_put(req, ino, fd);
+    if (ret == -1)
+        goto out;
+
+    if (size)
+        fuse_reply_buf(req, value, ret);
+    else
+        fuse_reply_xattr(req, ret);
+    free(value);
+    return;
+
+out:
+    free(value);
+    fuse_reply_err(req, saverr);
+}
+
+static void lo_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+    char procname[64];
+    char *value = NULL;
+    ssize_t ret;
+    int saverr;
+    int fd;
+
+    if (size) {
+        value = malloc(size);
+        if (!value)
+            return (void) fuse_reply_err(req, ENOMEM);
+    }
+
+    fd = lo_fd(req, ino);
+    if (fd == -1) {
+        saverr = errno;
+        goto out;
+    }
+    sprintf(procname, "/proc/self/fd/%i", fd);
+    ret = listxattr(procname, value, size);
+    saverr = errno;
+    lo_fd_put(req, ino, fd);
+    if (ret == -1)
+        goto out;
+
+    if (size)
+        fuse_reply_buf(req, value, ret);
+    else
+        fuse_reply_xattr(req, ret);
+    free(value);
+    return;
+
+out:
+    free(value);
+    fuse_reply_err(req, saverr);
+}
+
+static void lo_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+            const char *value, size_t size, int flags)
+{
+    char procname[64];
+    int res;
+    int fd;
+
+    if (lo_ctl_name(name))
+        return lo_ctl_setxattr(req, ino, name, value, size);
+
+    fd = lo_fd(req, ino);
+    if (fd == -1)
+        return (void) fuse_reply_err(req, errno);
+    sprintf(procname, "/proc/self/fd/%i", fd);
+    res = setxattr(procname, name, value, size, flags);
+    fuse_reply_err(req, res == -1 ? errno : 0);
+    lo_fd_put(req, ino, fd);
+}
+
+static void lo_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name)
+{
+    char procname[64];
+    int res;
+    int fd;
+
+    if (lo_ctl_name(name))
+        return (void) fuse_reply_err(req, EINVAL);
+
+    fd = lo_fd(req, ino);
+    if (fd == -1)
+        return (void) fuse_reply_err(req, errno);
+    sprintf(procname, "/proc/self/fd/%i", fd);
+    res = removexattr(procname, name);
+    fuse_reply_err(req, res == -1 ? errno : 0);
+    lo_fd_put(req, ino, fd);
+}
+
+/* Space of the lower filesystem: compressed files take what they have
+   stored, so df and du agree. */
+static void lo_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    struct statvfs stbuf;
+    int res;
+    int fd;
+
+    fd = lo_fd(req, ino);
+    if (fd == -1)
+        return (void) fuse_reply_err(req, errno);
+    res = fstatvfs(fd, &stbuf);
+    if (res == -1)
+        res = errno;
+    lo_fd_put(req, ino, fd);
+    if (res)
+        fuse_reply_err(req, res);
+    else
+        fuse_reply_statfs(req, &stbuf);
 }
 
 static struct fuse_lowlevel_ops lo_oper = {
     .init        = lo_init,
     .lookup        = lo_lookup,
     .forget        = lo_forget,
+    .forget_multi    = lo_forget_multi,
     .getattr    = lo_getattr,
     .readlink    = lo_readlink,
     .opendir    = lo_opendir,
     .readdir    = lo_readdir,
     .readdirplus    = lo_readdirplus,
     .releasedir    = lo_releasedir,
+    .statfs        = lo_statfs,
     .create        = lo_create,
     .open        = lo_open,
     .release    = lo_release,
+    .flush        = lo_flush,
+    .fsync        = lo_fsync,
     .read        = lo_read_reply_buf,
+    .lseek        = lo_lseek,
     //.read        = lo_read,
-    .write_buf      = lo_write_buf
+    .write_buf      = lo_write_buf,
+    .copy_file_range = lo_copy_file_range,
+    .getxattr    = lo_getxattr,
+    .listxattr    = lo_listxattr,
+    .setxattr    = lo_setxattr,
+    .removexattr    = lo_removexattr
 };
 
+/* Check that handles of the backing tree can be both created and
+   opened again (the latter needs CAP_DAC_READ_SEARCH) and size the fd
+   cache from RLIMIT_NOFILE unless -o max_fds was given. */
+static int lo_fhandle_setup(struct lo_data *lo)
+{
+    struct file_handle *fh;
+    struct rlimit rl;
+    int fd;
+
+    fh = malloc(sizeof(struct file_handle) + MAX_HANDLE_SZ);
+    if (!fh)
+        return -1;
+
+    fh->handle_bytes = MAX_HANDLE_SZ;
+    if (name_to_handle_at(lo->root.fd, "", fh, &lo->mount_id,
+                  AT_EMPTY_PATH) == -1) {
+        warn("name_to_handle_at");
+        free(fh);
+        return -1;
+    }
+    fd = open_by_handle_at(lo->root.fd, fh, O_PATH);
+    free(fh);
+    if (fd == -1) {
+        warn("open_by_handle_at");
+        return -1;
+    }
+    close(fd);
+
+    if (lo->max_fds <= 0) {
+        lo->max_fds = 1024;
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0 &&
+            rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur / 2 > 1024)
+            lo->max_fds = rl.rlim_cur / 2;
+    }
+    if (lo_fdcache_init(&lo->fdcache, lo->max_fds) != 0)
+        return -1;
+
+    if (lo->debug)
+        fprintf(stderr, "fhandle: caching at most %d O_PATH fds\n",
+            lo->max_fds);
+    return 0;
+}
+
+/* shards of the decompressed chunk cache, each has its own lock */
+#define LO_CCACHE_SHARDS 16
+
+/* Resolves -o compress_dirs, directories relative to the root separated
+   by ':', to the inodes lookups compare against, and rounds
+   compress_chunk to a supported power of two. */
+static int lo_compress_setup(struct lo_data *lo)
+{
+    struct stat root, st;
+    char *dirs, *path, *save;
+    unsigned int shift = LO_CFILE_MIN_SHIFT;
+
+    while (shift < LO_CFILE_MAX_SHIFT && (1U << shift) < lo->compress_chunk)
+        shift++;
+    lo->chunk_shift = shift;
+
+    if (!lo->compress_dirs)
+        return 0;
+    lo_cdicts_init(&lo->cdicts, lo->root.fd);
+    if (lo_ccache_init(&lo->ccache, lo->chunk_cache, LO_CCACHE_SHARDS) != 0)
+        return -1;
+    if (fstat(lo->root.fd, &root) == -1)
+        return -1;
+    dirs = strdup(lo->compress_dirs);
+    if (!dirs)
+        return -1;
+
+    for (path = strtok_r(dirs, ":", &save); path;
+         path = strtok_r(NULL, ":", &save)) {
+        struct lo_cdir *cdirs;
+
+        while (*path == '/')
+            path++;
+        if (fstatat(lo->root.fd, *path ? path : ".", &st,
+                AT_SYMLINK_NOFOLLOW) == -1) {
+            warn("compress_dirs: %s", path);
+            continue;
+        }
+        if (!S_ISDIR(st.st_mode)) {
+            warnx("compress_dirs: %s: not a directory", path);
+            continue;
+        }
+        if (lo->debug)
+            fprintf(stderr, "compress_dirs: /%s, %u byte chunks\n", path,
+                1U << shift);
+        /* the root is never looked up */
+        if (st.st_dev == root.st_dev && st.st_ino == root.st_ino) {
+            lo->root.flags |= LO_I_COMPRESS | LO_I_DAEMON_IO;
+            continue;
+        }
+        cdirs = realloc(lo->cdirs, (lo->ncdirs + 1) * sizeof(*cdirs));
+        if (!cdirs) {
+            free(dirs);
+            return -1;
+        }
+        cdirs[lo->ncdirs].dev = st.st_dev;
+        cdirs[lo->ncdirs].ino = st.st_ino;
+        lo->cdirs = cdirs;
+        lo->ncdirs++;
+    }
+    free(dirs);
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
     struct fuse_session *se;
     struct fuse_cmdline_opts opts;
     struct lo_data lo = { .debug = 0,
-                          .writeback = 0 };
+                          .writeback = 0,
+                          .passthrough = 0,
+                          .max_write = 1024 * 1024,
+                          .splice = -1,
+                          .mq_loop = 1,
+                          .threads = 0,
+                          .pin_threads = 1,
+                          .async = 0,
+                          .uring_depth = 256,
+                          .buftrace = 0,
+                          .fadvise = 0,
+                          .keep_cache = LO_KC_AUTO,
+                          .prefetch = 0,
+                          .pool_threads = 0,
+                          .compress_chunk = 64 * 1024,
+                          .chunk_cache = 64 * 1024 * 1024,
+                          .compact = 60,
+                          .compact_rate = 4096,
+                          .fhandle = 0,
+                          .max_fds = 0 };
     int ret = -1;
 
-    lo.root.next = lo.root.prev = &lo.root;
     lo.root.fd = -1;
 
     if (fuse_parse_cmdline(&args, &opts) != 0)
@@ -871,6 +4213,14 @@ int main(int argc, char *argv[])
 
     if (fuse_opt_parse(&args, &lo, lo_opts, NULL)== -1)
         return 1;
+    if (lo.max_pages_set && !lo.max_pages)
+        errx(1, "max_pages must be at least 1");
+    fuse_buf_trace_enable(lo.buftrace);
+
+    pthread_mutex_init(&lo.mutex, NULL);
+    lo_slab_init(&lo.inode_slab, sizeof(struct lo_inode));
+    if (lo_itable_init(&lo.itable, 1024) != 0)
+        err(1, "lo_itable_init");
     
     lo.debug = opts.debug;
     lo.root.fd = open("/root/vdisk", O_PATH);
@@ -878,37 +4228,109 @@ int main(int argc, char *argv[])
     if (lo.root.fd == -1)
         err(1, "open(\"/\", O_PATH)");
 
+    if (lo.fhandle && lo_fhandle_setup(&lo) != 0) {
+        fprintf(stderr, "fhandle: not usable on this filesystem, "
+            "falling back to one fd per inode\n");
+        lo.fhandle = 0;
+    }
+    if (lo_compress_setup(&lo) != 0)
+        err(1, "compress_dirs");
+
     se = fuse_session_new(&args, &lo_oper, sizeof(lo_oper), &lo);
     if (se == NULL)
         goto err_out1;
+    lo.se = se;
 
     if (fuse_set_signal_handlers(se) != 0)
         goto err_out2;
 
+    lo_reaper_start(&lo);
+    if (lo_pool_init(&lo.pool, lo.pool_threads) != 0)
+        fprintf(stderr, "pool: no worker threads, copying inline\n");
+    if (lo.compress_dirs && lo.compact)
+        lo_compact_start(&lo);
+
+    if (lo.async) {
+        int res = lo_uring_init(&lo.uring, lo.uring_depth);
+
+        if (res) {
+            fprintf(stderr, "async: io_uring unavailable (%s), "
+                "handling requests synchronously\n", strerror(-res));
+            lo.async = 0;
+        }
+    }
+
     if (fuse_session_mount(se, opts.mountpoint) != 0)
         goto err_out3;
 
     fuse_daemonize(opts.foreground);
 
     /* Block until ctrl+c or fusermount -u */
-    if (opts.singlethread)
+    if (opts.singlethread) {
         ret = fuse_session_loop(se);
-    else
+    } else if (lo.mq_loop) {
+        ret = lo_session_loop(se, lo.threads, lo.pin_threads,
+                      &lo.loop_stats);
+        if (lo.debug)
+            fprintf(stderr, "lo_loop: %u workers, %u own channels, "
+                "%u pinned\n", lo.loop_stats.threads,
+                lo.loop_stats.cloned, lo.loop_stats.pinned);
+    } else {
         ret = fuse_session_loop_mt(se, opts.clone_fd);
+    }
 
     fuse_session_unmount(se);
+    if (lo.debug && lo.buftrace)
+        fuse_buf_trace_dump(stderr, 0);
+    if (lo.debug && lo.keep_cache == LO_KC_AUTO)
+        fprintf(stderr, "keep_cache: %lu opens kept the page cache, "
+            "%lu dropped it\n", lo.cache_kept, lo.cache_dropped);
+    if (lo.debug && lo.prefetch)
+        fprintf(stderr, "prefetch: %lu stores, %lu bytes\n",
+            lo.prefetch_ops, lo.prefetch_bytes);
+    if (lo.debug && lo.ccache.nshards)
+        fprintf(stderr, "chunk_cache: %lu hits, %lu misses, %lu evictions\n",
+            lo.ccache.hits, lo.ccache.misses, lo.ccache.evictions);
 err_out3:
     fuse_remove_signal_handlers(se);
+    if (lo.async)
+        lo_uring_destroy(&lo.uring);
+    /* its inodes go to the reaper */
+    lo_compact_stop(&lo);
+    lo_reaper_stop(&lo);
+    lo_pool_destroy(&lo.pool);
 err_out2:
     fuse_session_destroy(se);
 err_out1:
     free(opts.mountpoint);
     fuse_opt_free_args(&args);
 
-    while (lo.root.next != &lo.root)
-        lo_free(lo.root.next);
+    if (lo.itable.ents) {
+        size_t i;
+
+        if (lo.debug)
+            lo_inode_report(&lo, stderr);
+        for (i = 0; i <= lo.itable.mask; i++) {
+            if (lo.itable.ents[i].inode)
+                lo_free(&lo, lo.itable.ents[i].inode);
+        }
+        free(lo.itable.ents);
+        lo_slab_destroy(&lo.inode_slab);
+    }
     if (lo.root.fd >= 0)
         close(lo.root.fd);
+    free(lo.compress_dirs);
+    free(lo.cdirs);
+    lo_ccache_destroy(&lo.ccache);
+    if (lo.compress_dirs)
+        lo_cdicts_destroy(&lo.cdicts);
+    if (lo.fhandle) {
+        if (lo.debug)
+            fprintf(stderr, "fhandle: fd cache hits=%lu misses=%lu "
+                "evictions=%lu\n", lo.fdcache.hits, lo.fdcache.misses,
+                lo.fdcache.evictions);
+        lo_fdcache_destroy(&lo.fdcache);
+    }
 
     return ret ? 1 : 0;
 }
@@ -0,0 +1,223 @@
+/*
+ * Worker pool, see lo_pool.h.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include "lo_pool.h"
+
+struct lo_pool_start {
+    struct lo_pool *pool;
+    int index;
+};
+
+static __thread int lo_pool_index = -1;
+
+int lo_pool_worker(void)
+{
+    return lo_pool_index;
+}
+
+/* called with p->lock held */
+static struct lo_pool_task *pool_pop(struct lo_pool *p)
+{
+    struct lo_pool_task *t = p->head;
+
+    if (t) {
+        p->head = t->next;
+        if (!p->head)
+            p->tail = NULL;
+    }
+    return t;
+}
+
+/* First queued task of group g. Called with p->lock held. */
+static struct lo_pool_task *pool_pop_group(struct lo_pool *p,
+                       struct lo_pool_group *g)
+{
+    struct lo_pool_task **pp, *t, *prev = NULL;
+
+    for (pp = &p->head; (t = *pp); pp = &t->next) {
+        if (t->group == g) {
+            *pp = t->next;
+            if (p->tail == t)
+                p->tail = prev;
+            return t;
+        }
+        prev = t;
+    }
+    return NULL;
+}
+
+static void pool_run(struct lo_pool_task *t)
+{
+    struct lo_pool_group *g = t->group;
+
+    /* t may be freed by the waiter as soon as pending drops */
+    t->fn(t);
+    pthread_mutex_lock(&g->lock);
+    if (--g->pending == 0)
+        pthread_cond_broadcast(&g->done);
+    pthread_mutex_unlock(&g->lock);
+}
+
+static void *pool_thread(void *arg)
+{
+    struct lo_pool_start *start = arg;
+    struct lo_pool *p = start->pool;
+    struct lo_pool_task *t;
+
+    lo_pool_index = start->index;
+    free(start);
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        t = pool_pop(p);
+        if (!t) {
+            if (p->stop)
+                break;
+            pthread_cond_wait(&p->ready, &p->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&p->lock);
+        pool_run(t);
+        pthread_mutex_lock(&p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+int lo_pool_init(struct lo_pool *p, unsigned int nthreads)
+{
+    sigset_t mask, old;
+    unsigned int i;
+
+    if (nthreads == 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+        nthreads = n > 0 ? n : 1;
+    }
+
+    p->threads = calloc(nthreads, sizeof(pthread_t));
+    if (!p->threads)
+        return -1;
+    p->head = p->tail = NULL;
+    p->nthreads = 0;
+    p->stop = 0;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->ready, NULL);
+
+    /* leave signal handling to the session threads */
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &old);
+    for (i = 0; i < nthreads; i++) {
+        struct lo_pool_start *start = malloc(sizeof(*start));
+
+        if (!start)
+            break;
+        start->pool = p;
+        start->index = i;
+        if (pthread_create(&p->threads[i], NULL, pool_thread, start)) {
+            free(start);
+            break;
+        }
+        p->nthreads++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (!p->nthreads) {
+        lo_pool_destroy(p);
+        return -1;
+    }
+    return 0;
+}
+
+void lo_pool_destroy(struct lo_pool *p)
+{
+    unsigned int i;
+
+    if (!p->threads)
+        return;
+
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->ready);
+    pthread_mutex_unlock(&p->lock);
+
+    for (i = 0; i < p->nthreads; i++)
+        pthread_join(p->threads[i], NULL);
+    free(p->threads);
+    p->threads = NULL;
+    pthread_cond_destroy(&p->ready);
+    pthread_mutex_destroy(&p->lock);
+}
+
+void lo_pool_group_init(struct lo_pool_group *g)
+{
+    pthread_mutex_init(&g->lock, NULL);
+    pthread_cond_init(&g->done, NULL);
+    g->pending = 0;
+}
+
+void lo_pool_group_destroy(struct lo_pool_group *g)
+{
+    pthread_cond_destroy(&g->done);
+    pthread_mutex_destroy(&g->lock);
+}
+
+void lo_pool_submit(struct lo_pool *p, struct lo_pool_group *g,
+            struct lo_pool_task *t, lo_pool_fn_t fn)
+{
+    t->fn = fn;
+    t->group = g;
+    t->next = NULL;
+
+    pthread_mutex_lock(&g->lock);
+    g->pending++;
+    pthread_mutex_unlock(&g->lock);
+
+    /* no workers could be started, degrade to running inline */
+    if (!p->threads) {
+        pool_run(t);
+        return;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    if (p->tail)
+        p->tail->next = t;
+    else
+        p->head = t;
+    p->tail = t;
+    pthread_cond_signal(&p->ready);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void lo_pool_wait(struct lo_pool *p, struct lo_pool_group *g)
+{
+    struct lo_pool_task *t;
+
+    /* help out instead of sleeping while there is queued work. Only
+       with our own: the caller may hold locks that tasks of other
+       groups wait for. */
+    for (;;) {
+        pthread_mutex_lock(&g->lock);
+        if (g->pending == 0) {
+            pthread_mutex_unlock(&g->lock);
+            return;
+        }
+        pthread_mutex_unlock(&g->lock);
+
+        pthread_mutex_lock(&p->lock);
+        t = pool_pop_group(p, g);
+        pthread_mutex_unlock(&p->lock);
+        if (!t)
+            break;
+        pool_run(t);
+    }
+
+    pthread_mutex_lock(&g->lock);
+    while (g->pending)
+        pthread_cond_wait(&g->done, &g->lock);
+    pthread_mutex_unlock(&g->lock);
+}
@@ -0,0 +1,110 @@
+/*
+ * Fixed size object allocator, see lo_slab.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "lo_slab.h"
+
+int lo_slab_init(struct lo_slab *s, size_t objsize)
+{
+    memset(s, 0, sizeof(*s));
+    /* room for the free list link, keep pointers aligned */
+    if (objsize < sizeof(void *))
+        objsize = sizeof(void *);
+    s->objsize = (objsize + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    s->per_page = LO_SLAB_PAGE_SIZE / s->objsize;
+    pthread_mutex_init(&s->lock, NULL);
+    return 0;
+}
+
+void lo_slab_destroy(struct lo_slab *s)
+{
+    size_t i;
+
+    for (i = 0; i < s->npages; i++)
+        free(s->pages[i]);
+    free(s->pages);
+    s->pages = NULL;
+    s->npages = s->pages_cap = 0;
+    s->free = NULL;
+    pthread_mutex_destroy(&s->lock);
+}
+
+/* called with lock held */
+static int slab_grow(struct lo_slab *s)
+{
+    char *page;
+    size_t i;
+
+    if (s->npages == s->pages_cap) {
+        size_t cap = s->pages_cap ? s->pages_cap * 2 : 16;
+        char **pages = realloc(s->pages, cap * sizeof(char *));
+        if (!pages)
+            return -1;
+        s->pages = pages;
+        s->pages_cap = cap;
+    }
+
+    if (posix_memalign((void **) &page, LO_SLAB_ALIGN, LO_SLAB_PAGE_SIZE))
+        return -1;
+    s->pages[s->npages++] = page;
+
+    /* thread the new objects onto the free list, lowest address first */
+    for (i = s->per_page; i-- > 0; ) {
+        void **obj = (void **) (page + i * s->objsize);
+        *obj = s->free;
+        s->free = obj;
+    }
+    return 0;
+}
+
+void *lo_slab_alloc(struct lo_slab *s)
+{
+    void **obj;
+
+    pthread_mutex_lock(&s->lock);
+    if (!s->free && slab_grow(s) != 0) {
+        pthread_mutex_unlock(&s->lock);
+        return NULL;
+    }
+    obj = s->free;
+    s->free = *obj;
+    s->nobjs++;
+    pthread_mutex_unlock(&s->lock);
+
+    memset(obj, 0, s->objsize);
+    return obj;
+}
+
+void lo_slab_free(struct lo_slab *s, void *obj)
+{
+    pthread_mutex_lock(&s->lock);
+    *(void **) obj = s->free;
+    s->free = obj;
+    s->nobjs--;
+    pthread_mutex_unlock(&s->lock);
+}
+
+void lo_slab_free_many(struct lo_slab *s, void **objs, size_t n)
+{
+    size_t i;
+
+    pthread_mutex_lock(&s->lock);
+    for (i = 0; i < n; i++) {
+        *(void **) objs[i] = s->free;
+        s->free = objs[i];
+    }
+    s->nobjs -= n;
+    pthread_mutex_unlock(&s->lock);
+}
+
+size_t lo_slab_bytes(struct lo_slab *s)
+{
+    size_t bytes;
+
+    pthread_mutex_lock(&s->lock);
+    bytes = s->npages * LO_SLAB_PAGE_SIZE + s->pages_cap * sizeof(char *);
+    pthread_mutex_unlock(&s->lock);
+    return bytes;
+}
@@ -0,0 +1,236 @@
+/*
+ * io_uring backed asynchronous execution, see lo_uring.h.
+ *
+ * One ring is shared by all workers; submission is serialized by a
+ * mutex (the SQ has a single producer), completions are reaped by one
+ * thread. A NOP with NULL user data tells that thread to stop.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "lo_uring.h"
+#include "lo_loop.h"
+
+#ifdef HAVE_LIBURING
+
+static void *lo_uring_thread(void *arg)
+{
+    struct lo_uring *u = arg;
+    struct io_uring_cqe *cqe;
+    struct lo_uring_op *op;
+    int res;
+
+    for (;;) {
+        res = io_uring_wait_cqe(&u->ring, &cqe);
+        if (res == -EINTR)
+            continue;
+        if (res < 0) {
+            fprintf(stderr, "lo_uring: wait_cqe: %s\n", strerror(-res));
+            break;
+        }
+
+        op = io_uring_cqe_get_data(cqe);
+        res = cqe->res;
+        io_uring_cqe_seen(&u->ring, cqe);
+        if (!op)
+            break;
+
+        __atomic_add_fetch(&u->completed, 1, __ATOMIC_RELAXED);
+        lo_loop_set_channel(op->chan);
+        op->done(op, res);
+    }
+    return NULL;
+}
+
+int lo_uring_init(struct lo_uring *u, unsigned int entries)
+{
+    int res;
+
+    memset(u, 0, sizeof(*u));
+    res = io_uring_queue_init(entries, &u->ring, 0);
+    if (res < 0)
+        return res;
+
+    pthread_mutex_init(&u->sq_lock, NULL);
+    res = pthread_create(&u->thread, NULL, lo_uring_thread, u);
+    if (res) {
+        io_uring_queue_exit(&u->ring);
+        return -res;
+    }
+    u->running = 1;
+    return 0;
+}
+
+/* returns an sqe with sq_lock held, or NULL (lock released) */
+static struct io_uring_sqe *lo_uring_sqe(struct lo_uring *u)
+{
+    struct io_uring_sqe *sqe;
+
+    pthread_mutex_lock(&u->sq_lock);
+    sqe = io_uring_get_sqe(&u->ring);
+    if (!sqe) {
+        /* SQ full: push what is queued and try once more */
+        io_uring_submit(&u->ring);
+        sqe = io_uring_get_sqe(&u->ring);
+    }
+    if (!sqe)
+        pthread_mutex_unlock(&u->sq_lock);
+    return sqe;
+}
+
+/* Once io_uring_get_sqe() handed it out, the sqe is in the SQ ring
+   whatever io_uring_submit() returns and the kernel will run it, so op
+   must not fail: the enter is retried until it goes through, with the
+   lock dropped while backing off so that the others can go on (and
+   may submit it along with theirs). Always returns 0. */
+static int lo_uring_submit(struct lo_uring *u, struct io_uring_sqe *sqe,
+               struct lo_uring_op *op)
+{
+    int logged = 0;
+    int res;
+
+    if (op)
+        op->chan = lo_loop_channel();
+    io_uring_sqe_set_data(sqe, op);
+    while ((res = io_uring_submit(&u->ring)) < 0) {
+        pthread_mutex_unlock(&u->sq_lock);
+        if (!logged)
+            fprintf(stderr, "lo_uring: cannot submit: %s, retrying\n",
+                strerror(-res));
+        logged = 1;
+        /* the completion thread makes room in the CQ ring */
+        if (res != -EINTR)
+            usleep(100);
+        pthread_mutex_lock(&u->sq_lock);
+    }
+    pthread_mutex_unlock(&u->sq_lock);
+
+    __atomic_add_fetch(&u->submitted, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void lo_uring_destroy(struct lo_uring *u)
+{
+    struct io_uring_sqe *sqe;
+    int i;
+
+    if (!u->running)
+        return;
+
+    /* let requests still in flight be answered, but don't hang */
+    for (i = 0; i < 5000; i++) {
+        if (__atomic_load_n(&u->completed, __ATOMIC_RELAXED) >=
+            __atomic_load_n(&u->submitted, __ATOMIC_RELAXED))
+            break;
+        usleep(1000);
+    }
+
+    sqe = lo_uring_sqe(u);
+    if (sqe) {
+        io_uring_prep_nop(sqe);
+        lo_uring_submit(u, sqe, NULL);
+        pthread_join(u->thread, NULL);
+    } else {
+        pthread_cancel(u->thread);
+        pthread_join(u->thread, NULL);
+    }
+    io_uring_queue_exit(&u->ring);
+    pthread_mutex_destroy(&u->sq_lock);
+    u->running = 0;
+}
+
+int lo_uring_read(struct lo_uring *u, struct lo_uring_op *op, int fd,
+          void *buf, size_t len, off_t off)
+{
+    struct io_uring_sqe *sqe = lo_uring_sqe(u);
+
+    if (!sqe)
+        return -EAGAIN;
+    io_uring_prep_read(sqe, fd, buf, len, off);
+    return lo_uring_submit(u, sqe, op);
+}
+
+int lo_uring_writev(struct lo_uring *u, struct lo_uring_op *op, int fd,
+            const struct iovec *iov, int count, off_t off)
+{
+    struct io_uring_sqe *sqe = lo_uring_sqe(u);
+
+    if (!sqe)
+        return -EAGAIN;
+    io_uring_prep_writev(sqe, fd, iov, count, off);
+    return lo_uring_submit(u, sqe, op);
+}
+
+int lo_uring_statx(struct lo_uring *u, struct lo_uring_op *op, int dirfd,
+           const char *path, int flags, unsigned int mask,
+           struct statx *stx)
+{
+    struct io_uring_sqe *sqe = lo_uring_sqe(u);
+
+    if (!sqe)
+        return -EAGAIN;
+    io_uring_prep_statx(sqe, dirfd, path, flags, mask, stx);
+    return lo_uring_submit(u, sqe, op);
+}
+
+int lo_uring_openat(struct lo_uring *u, struct lo_uring_op *op, int dirfd,
+            const char *path, int flags, mode_t mode)
+{
+    struct io_uring_sqe *sqe = lo_uring_sqe(u);
+
+    if (!sqe)
+        return -EAGAIN;
+    io_uring_prep_openat(sqe, dirfd, path, flags, mode);
+    return lo_uring_submit(u, sqe, op);
+}
+
+#else /* HAVE_LIBURING */
+
+int lo_uring_init(struct lo_uring *u, unsigned int entries)
+{
+    (void) entries;
+    memset(u, 0, sizeof(*u));
+    return -ENOSYS;
+}
+
+void lo_uring_destroy(struct lo_uring *u)
+{
+    (void) u;
+}
+
+int lo_uring_read(struct lo_uring *u, struct lo_uring_op *op, int fd,
+          void *buf, size_t len, off_t off)
+{
+    (void) u; (void) op; (void) fd; (void) buf; (void) len; (void) off;
+    return -ENOSYS;
+}
+
+int lo_uring_writev(struct lo_uring *u, struct lo_uring_op *op, int fd,
+            const struct iovec *iov, int count, off_t off)
+{
+    (void) u; (void) op; (void) fd; (void) iov; (void) count; (void) off;
+    return -ENOSYS;
+}
+
+int lo_uring_statx(struct lo_uring *u, struct lo_uring_op *op, int dirfd,
+           const char *path, int flags, unsigned int mask,
+           struct statx *stx)
+{
+    (void) u; (void) op; (void) dirfd; (void) path; (void) flags;
+    (void) mask; (void) stx;
+    return -ENOSYS;
+}
+
+int lo_uring_openat(struct lo_uring *u, struct lo_uring_op *op, int dirfd,
+            const char *path, int flags, mode_t mode)
+{
+    (void) u; (void) op; (void) dirfd; (void) path; (void) flags;
+    (void) mode;
+    return -ENOSYS;
+}
+
+#endif /* HAVE_LIBURING */
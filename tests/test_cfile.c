@@ -0,0 +1,352 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "lo_cfile.h"
+
+#define FILE_SIZE (1 << 20)
+
+static char ref[FILE_SIZE], buf[FILE_SIZE];
+
+static int check(struct lo_cfile *c, int fd, size_t size);
+
+/* small records that only share their keys */
+static size_t record(char *p, int i)
+{
+    return sprintf(p, "{\"id\": %d, \"name\": \"user%d\", \"email\": "
+               "\"user%d@example.com\", \"active\": %s, \"score\": %d}\n",
+               i, i * 7, i * 13, i & 1 ? "true" : "false", rand() % 1000);
+}
+
+/* compresses one record per file, with or without the dictionary,
+   returns the bytes stored */
+static size_t dict_round(struct lo_cdicts *d, const struct lo_cdict *dict,
+             int fd)
+{
+    size_t stored = 0, len;
+    struct lo_cfile c;
+    int i;
+
+    for (i = 0; i < 100; i++) {
+        len = record(ref, 1000 + i);
+        if (ftruncate(fd, 0) != 0 || lo_cfile_init(&c, fd, 12) != 0 ||
+            lo_cfile_set_dict(&c, dict) != 0 ||
+            lo_cfile_pwrite(&c, fd, ref, len, 0) != (ssize_t) len ||
+            lo_cfile_flush(&c, fd) != 0)
+            return 0;
+        stored += c.stored;
+        lo_cfile_destroy(&c);
+
+        /* read back with the dictionary found by its id */
+        if (lo_cfile_load(&c, fd) != 1 || c.dict_id != (dict ? dict->id : 0))
+            return 0;
+        c.dict = c.dict_id ? lo_cdicts_get(d, c.dict_id) : NULL;
+        if (check(&c, fd, len))
+            return 0;
+        lo_cfile_destroy(&c);
+    }
+    return stored;
+}
+
+static int check(struct lo_cfile *c, int fd, size_t size)
+{
+    ssize_t res = lo_cfile_pread(c, fd, buf, FILE_SIZE, 0);
+
+    if (res != (ssize_t) size || memcmp(buf, ref, size) != 0) {
+        printf("mismatch: read %zd, expected %zu\n", res, size);
+        return 1;
+    }
+    return 0;
+}
+
+/* a log written a line at a time, flushed every few lines */
+static int append_test(int fd)
+{
+    struct lo_cfile c;
+    size_t size = 0, len;
+    uint64_t last;
+    int i;
+
+    if (ftruncate(fd, 0) != 0 || lo_cfile_init(&c, fd, 16) != 0)
+        return 1;
+    for (i = 0; i < 3000; i++) {
+        len = sprintf(ref + size, "%d: request %d served in %d us\n", i,
+                  i * 3, rand() % 500);
+        if (lo_cfile_pwrite(&c, fd, ref + size, len, size) != (ssize_t) len)
+            return 1;
+        size += len;
+        if (i % 10 == 9 && lo_cfile_flush(&c, fd) != 0)
+            return 1;
+        /* appending goes on with the segments stored before */
+        if (i % 500 == 499) {
+            lo_cfile_destroy(&c);
+            if (lo_cfile_load(&c, fd) != 1)
+                return 1;
+        }
+    }
+    last = (size - 1) >> 16;
+    if (check(&c, fd, size) || !(c.index[last].flags & LO_CHUNK_LINKED) ||
+        c.stored >= size / 2)
+        return 1;
+
+    /* a write that is no append ends the tail */
+    memset(ref + size - 10, 'x', 5);
+    if (lo_cfile_pwrite(&c, fd, ref + size - 10, 5, size - 10) != 5 ||
+        check(&c, fd, size) || lo_cfile_flush(&c, fd) != 0)
+        return 1;
+    lo_cfile_destroy(&c);
+    if (lo_cfile_load(&c, fd) != 1 || check(&c, fd, size))
+        return 1;
+    lo_cfile_destroy(&c);
+    return 0;
+}
+
+/* small overwrites all over a file, kept as deltas until merged */
+static int delta_test(int fd)
+{
+    struct lo_cfile c;
+    size_t size = FILE_SIZE, off, len;
+    uint64_t ndeltas;
+    int i;
+
+    for (i = 0; i < FILE_SIZE; i++)
+        ref[i] = 'a' + i % 13;
+    if (ftruncate(fd, 0) != 0 || lo_cfile_init(&c, fd, 14) != 0 ||
+        lo_cfile_pwrite(&c, fd, ref, size, 0) != (ssize_t) size)
+        return 1;
+    for (i = 0; i < 300; i++) {
+        len = 1 + rand() % 512;
+        off = rand() % (size - len);
+        memset(ref + off, '0' + i % 10, len);
+        if (lo_cfile_pwrite(&c, fd, ref + off, len, off) != (ssize_t) len)
+            return 1;
+    }
+    ndeltas = c.ndeltas;
+    if (!ndeltas || check(&c, fd, size) || lo_cfile_flush(&c, fd) != 0)
+        return 1;
+    lo_cfile_destroy(&c);
+    if (lo_cfile_load(&c, fd) != 1 || c.ndeltas != ndeltas ||
+        check(&c, fd, size))
+        return 1;
+
+    if (lo_cfile_merge(&c, fd) != 0 || c.ndeltas || check(&c, fd, size) ||
+        c.stored >= size / 4 || lo_cfile_flush(&c, fd) != 0)
+        return 1;
+    lo_cfile_destroy(&c);
+    if (lo_cfile_load(&c, fd) != 1 || c.ndeltas || check(&c, fd, size))
+        return 1;
+    lo_cfile_destroy(&c);
+    return 0;
+}
+
+/* a file stored with every shortcut there is, then compacted */
+static int compact_test(int fd)
+{
+    struct lo_cfile c;
+    struct stat before, after;
+    size_t size = FILE_SIZE / 2, off, len, i;
+    uint64_t idx = 0;
+    ssize_t res, freed;
+
+    if (ftruncate(fd, 0) != 0 || lo_cfile_init(&c, fd, 14) != 0)
+        return 1;
+    /* random data marks the file raw, text after it is stored untried */
+    for (i = 0; i < size; i++)
+        ref[i] = i < size / 4 ? rand() : 'a' + i % 11;
+    if (lo_cfile_pwrite(&c, fd, ref, size / 4, 0) != (ssize_t) size / 4 ||
+        lo_cfile_pwrite(&c, fd, ref + size / 4, size - size / 4, size / 4) !=
+        (ssize_t) (size - size / 4))
+        return 1;
+    /* garbage and deltas */
+    for (i = 0; i < 100; i++) {
+        len = 1 + rand() % 8000;
+        off = rand() % (size - len);
+        memset(ref + off, 'A' + i % 26, len);
+        if (lo_cfile_pwrite(&c, fd, ref + off, len, off) != (ssize_t) len)
+            return 1;
+    }
+    /* segments, closed by a write elsewhere */
+    for (i = 0; i < 20; i++) {
+        len = sprintf(ref + size, "line %zu\n", i);
+        if (lo_cfile_pwrite(&c, fd, ref + size, len, size) != (ssize_t) len ||
+            lo_cfile_flush(&c, fd) != 0)
+            return 1;
+        size += len;
+    }
+    if (lo_cfile_pwrite(&c, fd, ref, 10000, 0) != 10000 ||
+        lo_cfile_flush(&c, fd) != 0 || check(&c, fd, size) ||
+        fstat(fd, &before) != 0)
+        return 1;
+
+    for (i = 0, idx = 0; idx < c.nchunks; idx++)
+        i |= c.index[idx].flags & (LO_CHUNK_LINKED | LO_CHUNK_UNTRIED);
+    if (i != (LO_CHUNK_LINKED | LO_CHUNK_UNTRIED) || !c.ndeltas)
+        return 1;
+    idx = 0;
+    while ((res = lo_cfile_recompress(&c, fd, &idx)) > 0)
+        ;
+    if (res < 0 || c.ndeltas || check(&c, fd, size))
+        return 1;
+    for (idx = 0; idx < c.nchunks; idx++) {
+        if (c.index[idx].flags & (LO_CHUNK_LINKED | LO_CHUNK_UNTRIED))
+            return 1;
+    }
+    freed = lo_cfile_punch(&c, fd);
+    if (freed <= 0 || c.garbage || fstat(fd, &after) != 0 ||
+        after.st_blocks >= before.st_blocks || check(&c, fd, size))
+        return 1;
+    printf("cfile_test compaction: %zd bytes punched out, %lld blocks "
+           "left of %lld\n", freed, (long long) after.st_blocks,
+           (long long) before.st_blocks);
+    lo_cfile_destroy(&c);
+    if (lo_cfile_load(&c, fd) != 1 || check(&c, fd, size))
+        return 1;
+    lo_cfile_destroy(&c);
+    return 0;
+}
+
+static int dict_test(int fd)
+{
+    char dir[] = "/tmp/test_cdict.XXXXXX";
+    char name[64], *samples = buf, *p = buf;
+    size_t lens[200], plain, small;
+    const struct lo_cdict *dict;
+    struct lo_cdicts d, d2;
+    int rootfd, i;
+
+    if (!mkdtemp(dir) || (rootfd = open(dir, O_RDONLY | O_DIRECTORY)) == -1)
+        return 1;
+    lo_cdicts_init(&d, rootfd);
+    for (i = 0; i < 200; i++) {
+        lens[i] = record(p, i);
+        p += lens[i];
+    }
+    dict = lo_cdicts_train(&d, samples, lens, 200, 0, 1);
+    if (!dict)
+        return 1;
+
+    /* a fresh registry loads it from disk */
+    lo_cdicts_init(&d2, rootfd);
+    plain = dict_round(&d2, NULL, fd);
+    small = dict_round(&d2, dict, fd);
+    printf("cfile_test dictionary: %zu bytes of records stored in %zu, "
+           "%zu without\n", (size_t) (p - samples), small, plain);
+    if (!plain || !small || small >= plain)
+        return 1;
+
+    snprintf(name, sizeof(name), "%s/%016llx", LO_CDICT_DIR,
+         (unsigned long long) dict->id);
+    lo_cdicts_destroy(&d2);
+    lo_cdicts_destroy(&d);
+    if (unlinkat(rootfd, name, 0) != 0 ||
+        unlinkat(rootfd, LO_CDICT_DIR, AT_REMOVEDIR) != 0)
+        return 1;
+    close(rootfd);
+    return rmdir(dir);
+}
+
+int main(void)
+{
+    char path[] = "/tmp/test_cfile.XXXXXX";
+    struct lo_cfile c;
+    struct lo_ccache cc;
+    struct lo_pool pool;
+    size_t size = 0;
+    int fd, i;
+
+    printf("cfile_test start...\n");
+    fd = mkstemp(path);
+    if (fd == -1 || lo_cfile_init(&c, fd, 12) != 0)
+        return 1;
+    unlink(path);
+
+    printf("cfile_test writing...\n");
+    srand(1);
+    for (i = 0; i < 200; i++) {
+        size_t off = rand() % (FILE_SIZE - 20000);
+        size_t len = 1 + rand() % 20000;
+        size_t j;
+
+        /* alternate compressible and random data */
+        for (j = 0; j < len; j++)
+            ref[off + j] = i & 1 ? rand() : 'a' + j % 7;
+        if (lo_cfile_pwrite(&c, fd, ref + off, len, off) != (ssize_t) len)
+            return 1;
+        if (off + len > size)
+            size = off + len;
+    }
+    if (check(&c, fd, size))
+        return 1;
+
+    printf("cfile_test reloading...\n");
+    if (lo_cfile_flush(&c, fd) != 0)
+        return 1;
+    lo_cfile_destroy(&c);
+    if (lo_cfile_load(&c, fd) != 1 || lo_cfile_size(&c) != size ||
+        lo_cfile_nchunks(&c) != ((size - 1) >> 12) + 1 ||
+        check(&c, fd, size))
+        return 1;
+
+    printf("cfile_test caching...\n");
+    if (lo_ccache_init(&cc, 1 << 20, 4) != 0)
+        return 1;
+    c.cache = &cc;
+    if (check(&c, fd, size) || check(&c, fd, size) || !cc.hits)
+        return 1;
+
+    printf("cfile_test compressing in parallel...\n");
+    if (lo_pool_init(&pool, 4) != 0)
+        return 1;
+    c.pool = &pool;
+    for (i = 1000; i < FILE_SIZE - 1000; i++)
+        ref[i] = i < FILE_SIZE / 2 ? i % 251 : rand();
+    if (lo_cfile_pwrite(&c, fd, ref + 1000, FILE_SIZE - 2000, 1000) !=
+        FILE_SIZE - 2000)
+        return 1;
+    size = size > FILE_SIZE - 1000 ? size : FILE_SIZE - 1000;
+    /* the random second half marks the file raw */
+    if (check(&c, fd, size) || !(c.flags & LO_CFILE_RAW))
+        return 1;
+
+    printf("cfile_test decompressing in parallel...\n");
+    /* unaligned at both ends, with and without the cache */
+    for (i = 0; i < 2; i++) {
+        c.cache = i ? &cc : NULL;
+        if (lo_cfile_pread(&c, fd, buf, 300000, 1234) != 300000 ||
+            memcmp(buf, ref + 1234, 300000) != 0)
+            return 1;
+    }
+
+    if (lo_cfile_reset(&c, fd) != 0 || check(&c, fd, 0))
+        return 1;
+    /* chunks from before the reset must not come back */
+    memset(ref, 0, sizeof(ref));
+    memset(ref + 100000, 'x', 10);
+    if (lo_cfile_pwrite(&c, fd, ref + 100000, 10, 100000) != 10 ||
+        check(&c, fd, 100010))
+        return 1;
+    lo_cfile_destroy(&c);
+    lo_ccache_destroy(&cc);
+    lo_pool_destroy(&pool);
+
+    printf("cfile_test appending...\n");
+    if (append_test(fd))
+        return 1;
+
+    printf("cfile_test overwriting...\n");
+    if (delta_test(fd))
+        return 1;
+
+    printf("cfile_test compacting...\n");
+    if (compact_test(fd))
+        return 1;
+
+    printf("cfile_test dictionary...\n");
+    if (dict_test(fd))
+        return 1;
+    close(fd);
+    printf("cfile_test end\n");
+    return 0;
+}